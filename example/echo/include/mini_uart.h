@@ -4,6 +4,7 @@
 void uart_init ( void );
 char uart_recv ( void );
 void uart_send ( char c );
+void uart_flush ( void );
 void putc ( void* p, char c );
 
 #endif  /*_MINI_UART_H */
@@ -5,5 +5,7 @@ extern void delay ( unsigned long);
 extern void put32 ( unsigned long, unsigned int );
 extern unsigned int get32 ( unsigned long );
 extern int get_el ( void );
+extern long hv_console_write ( const char *, unsigned long );
+extern long hv_console_read ( char *, unsigned long );
 
 #endif  /*_BOOT_H */
@@ -2,22 +2,61 @@
 #include "peripherals/mini_uart.h"
 #include "peripherals/gpio.h"
 
-void uart_send ( char c )
+// 出力はハイパーバイザの PV コンソールを使う
+// AUX_MU_IO_REG などを直接触ると 1 文字ごとに VM exit が 2 回発生するので、
+// 送信バッファに溜めてからハイパーコール 1 回でまとめて渡す
+#define TX_BUFFER_LENGTH 128
+
+static char tx_buf[TX_BUFFER_LENGTH];
+static int tx_len = 0;
+
+void uart_flush ( void )
 {
-	while(1) {
-		if(get32(AUX_MU_LSR_REG)&0x20) 
+	int done = 0;
+	while (done < tx_len) {
+		long n = hv_console_write(&tx_buf[done], tx_len - done);
+		if (n < 0) {
 			break;
+		}
+		if (n == 0) {
+			// ハイパーバイザ側のバッファが一杯なので CPU を譲って待つ
+			asm volatile("wfi");
+		}
+		done += n;
 	}
-	put32(AUX_MU_IO_REG,c);
+	tx_len = 0;
 }
 
+void uart_send ( char c )
+{
+	tx_buf[tx_len++] = c;
+	if (c == '\n' || tx_len == TX_BUFFER_LENGTH) {
+		uart_flush();
+	}
+}
+
+#define RX_BUFFER_LENGTH 64
+
+static char rx_buf[RX_BUFFER_LENGTH];
+static int rx_len = 0;
+static int rx_pos = 0;
+
 char uart_recv ( void )
 {
-	while(1) {
-		if(get32(AUX_MU_LSR_REG)&0x01) 
+	// 入力を待つ前に、溜まっている出力(プロンプトなど)を出しておく
+	uart_flush();
+
+	while (rx_pos == rx_len) {
+		long n = hv_console_read(rx_buf, sizeof(rx_buf));
+		if (n > 0) {
+			rx_len = n;
+			rx_pos = 0;
 			break;
+		}
+		// 入力がなければ CPU を譲る
+		asm volatile("wfi");
 	}
-	return(get32(AUX_MU_IO_REG)&0xFF);
+	return rx_buf[rx_pos++];
 }
 
 void uart_send_string(char* str)
@@ -5,5 +5,11 @@ extern void delay ( unsigned long);
 extern void put32 ( unsigned long, unsigned int );
 extern unsigned int get32 ( unsigned long );
 extern int get_el ( void );
+extern long hv_console_write ( const char *, unsigned long );
+extern long hv_console_read ( char *, unsigned long );
+extern long hv_version ( void );
+extern long hv_pv_irq_ack ( unsigned long );
+extern void enable_cycle_counter ( void );
+extern unsigned long get_cycle_count ( void );
 
 #endif  /*_BOOT_H */
@@ -25,6 +25,30 @@ int strncmp(char *a, char *b, int n) {
 }
 
 #define EQUAL(A, B) (strncmp(A, B, sizeof(B)) == 0)
+
+#define BENCH_ITERATIONS 1000
+
+// ハイパーコールの往復にかかるサイクル数を、高速パスと通常の経路のそれぞれで計測する
+void bench_hvc() {
+	enable_cycle_counter();
+
+	unsigned long start = get_cycle_count();
+	for (int i = 0; i < BENCH_ITERATIONS; i++) {
+		hv_version();
+	}
+	unsigned long fast = get_cycle_count() - start;
+
+	start = get_cycle_count();
+	for (int i = 0; i < BENCH_ITERATIONS; i++) {
+		hv_pv_irq_ack(0);
+	}
+	unsigned long slow = get_cycle_count() - start;
+
+	printf("hvc round trip (%d iterations):\n", BENCH_ITERATIONS);
+	printf("  fast path: %u cycles\n", (unsigned int)(fast / BENCH_ITERATIONS));
+	printf("  slow path: %u cycles\n", (unsigned int)(slow / BENCH_ITERATIONS));
+}
+
 void execute_command(char *buf) {
 	char *command = buf;
 	char *arg = 0;
@@ -54,6 +78,14 @@ void execute_command(char *buf) {
 	}
 	else if (EQUAL(command, "shutdown")) {
 	}
+	else if (EQUAL(command, "bench")) {
+		if (EQUAL(arg, "hvc")) {
+			bench_hvc();
+		}
+		else {
+			printf("unknown benchmark: %s\n", arg);
+		}
+	}
 	else {
 		printf("command error: %s\n", command);
 	}
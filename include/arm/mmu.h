@@ -40,9 +40,13 @@
 #define MT_NORMAL_CACHEABLE         0x1
 
 #define MT_DEVICE_nGnRnE_FLAGS      0x00
-// todo: いったんキャッシュを無効にする
-// #define MT_NORMAL_CACHEABLE_FLAGS   0xff
+// EL2_CACHE(Makefile)が 1 なら inner/outer write-back(read/write-allocate)
+// 0 なら inner/outer non-cacheable
+#if EL2_CACHE
+#define MT_NORMAL_CACHEABLE_FLAGS   0xff
+#else
 #define MT_NORMAL_CACHEABLE_FLAGS   0x44
+#endif
 
 #define MAIR_VALUE \
     (MT_DEVICE_nGnRnE_FLAGS << (8 * MT_DEVICE_nGnRnE)) | \
@@ -50,8 +54,9 @@
 
 // 以下2つのページ属性用のフラグは boot.S で EL2 の
 // ページテーブル設定に使っているので、Stage 2 のエントリ用のはず
+// キャッシュを有効にしたとき、コア間でキャッシュの一貫性が保たれるよう inner shareable にする
 #define MMU_FLAGS \
-    (MM_TYPE_BLOCK | (MT_NORMAL_CACHEABLE << 2) | MM_nG | MM_ACCESS)
+    (MM_TYPE_BLOCK | (MT_NORMAL_CACHEABLE << 2) | MM_nG | MM_SH | MM_ACCESS)
 #define MMU_DEVICE_FLAGS \
     (MM_TYPE_BLOCK | (MT_DEVICE_nGnRnE << 2) | MM_nG | MM_ACCESS)
 
@@ -84,9 +89,12 @@
 #define MM_STAGE2_ACCESS    (1 << 10)
 #define MM_STAGE2_SH        (3 << 8)    // inner shareable
 #define MM_STAGE2_AP        (3 << 6)    // read/write
-// todo: いったんキャッシュを無効にする
-//#define MM_STAGE2_MEMATTR   (0xf << 2)  // Write-back cacheable
-#define MM_STAGE2_MEMATTR   (0x5 << 2)  // Write-back cacheable
+// ゲストから見た最終的な属性は、ゲストの Stage 1 の属性と組み合わせた弱い方になる
+#if EL2_CACHE
+#define MM_STAGE2_MEMATTR   (0xf << 2)  // Inner/Outer write-back cacheable
+#else
+#define MM_STAGE2_MEMATTR   (0x5 << 2)  // Inner/Outer non-cacheable
+#endif
 
 // todo:
 // MMU_STAGE2_PAGE_FLAGS/MMU_STAGE2_MMIO_FLAGS は
@@ -111,6 +119,12 @@
 
 #define TCR_T0SZ			(64 - 48)
 #define TCR_TG0_4K			(0 << 14)
-#define TCR_VALUE			(TCR_T0SZ | TCR_TG0_4K)
+// テーブルウォークの属性(SH0, ORGN0, IRGN0)
+#if EL2_CACHE
+#define TCR_WALK_ATTRS		((3 << 12) | (1 << 10) | (1 << 8))	// inner shareable, write-back
+#else
+#define TCR_WALK_ATTRS		0
+#endif
+#define TCR_VALUE			(TCR_T0SZ | TCR_TG0_4K | TCR_WALK_ATTRS)
 
 #endif
@@ -20,13 +20,25 @@
 //   0b1: 有効
 #define SCTLR_EE                    (0 << 25)
 #define SCTLR_I_CACHE_DISABLED      (0 << 12)
+#define SCTLR_I_CACHE_ENABLED       (1 << 12)
 #define SCTLR_D_CACHE_DISABLED      (0 << 2)
+#define SCTLR_D_CACHE_ENABLED       (1 << 2)
 #define SCTLR_MMU_DISABLED          (0 << 0)
 #define SCTLR_MMU_ENABLED           (1 << 0)
 
 #define SCTLR_VALUE_MMU_DISABLED \
 	(SCTLR_EE | SCTLR_I_CACHE_DISABLED | SCTLR_D_CACHE_DISABLED | SCTLR_MMU_DISABLED)
 
+// MMU を有効にするときに SCTLR_EL2 に書く値
+// EL2_CACHE(Makefile)が 1 ならデータキャッシュと命令キャッシュも有効にする
+#if EL2_CACHE
+#define SCTLR_VALUE_MMU_ENABLED \
+	(SCTLR_EE | SCTLR_I_CACHE_ENABLED | SCTLR_D_CACHE_ENABLED | SCTLR_MMU_ENABLED)
+#else
+#define SCTLR_VALUE_MMU_ENABLED \
+	(SCTLR_EE | SCTLR_I_CACHE_DISABLED | SCTLR_D_CACHE_DISABLED | SCTLR_MMU_ENABLED)
+#endif
+
 // ***************************************
 // HCR_EL2, Hypervisor Configuration Register (EL2), Page 1923 of AArch64-Reference-Manual.
 // ***************************************
@@ -160,8 +172,13 @@
 #define HCR_SWIO        (1 << 1)
 #define HCR_VM          (1 << 0)    // stage 2 translation enable
 
+// ID レジスタ(TID1/TID2/TID3)はトラップしない
+//   MIDR_EL1/MPIDR_EL1 は VPIDR_EL2/VMPIDR_EL2 に設定した値がゲストに見え、
+//   それ以外の ID レジスタや CTR_EL0, CCSIDR_EL1, CLIDR_EL1 は実機の値をそのまま見せる
+//   CSSELR_EL1 はゲストが直接書くので、VM の切り替え時に退避・復帰する
+// ACTLR_EL1 は実装依存の動作を変えられるので、TACR でトラップして書き込みを VM 内に閉じ込める
 #define HCR_VALUE \
-   ( HCR_TACR | HCR_TID3 | HCR_TID2 | HCR_TID1 | \
+   ( HCR_TACR | \
      HCR_TWE | HCR_TWI | HCR_E2H | HCR_RW | HCR_TGE | HCR_AMO | \
      HCR_IMO | HCR_FMO | HCR_SWIO | HCR_VM)
 
@@ -274,8 +291,14 @@
 #define VTCR_PS         (2 << 16)   // 40bit, 1TB
 #define VTCR_TG0        (0 << 14)   // 4KB
 #define VTCR_SH0        (3 << 12)   // Inner shareable
-#define VTCR_ORGN0      (0 << 10)   // outer write-back ...
-#define VTCR_IRGN0      (0 << 8)    // inner write-back ...
+// ハイパーバイザは Stage2 のテーブルをキャッシュを通して書くので、テーブルウォークもキャッシュを通す
+#if EL2_CACHE
+#define VTCR_ORGN0      (1 << 10)   // outer write-back read-allocate write-allocate
+#define VTCR_IRGN0      (1 << 8)    // inner write-back read-allocate write-allocate
+#else
+#define VTCR_ORGN0      (0 << 10)   // outer non-cacheable
+#define VTCR_IRGN0      (0 << 8)    // inner non-cacheable
+#endif
 #define VTCR_SL0        (1 << 6)    // start at level1?
 #define VTCR_T0SZ       (64 - 38)   // 仮想アドレスのサイズは 2^38 = 256GB
 #define VTCR_VALUE \
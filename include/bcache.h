@@ -0,0 +1,13 @@
+#ifndef _BCACHE_H
+#define _BCACHE_H
+
+// SD カードのブロック(512 バイト)を保持するキャッシュ
+// FAT やディレクトリといったファイルシステムのメタデータや、準仮想ブロックデバイスの読み書きに使う
+#define BCACHE_BLOCK_SIZE   512
+#define BCACHE_NUM_BLOCKS   64
+
+void bcache_init(void);
+int bcache_read(unsigned int lba, void *buf);
+int bcache_write(unsigned int lba, void *buf, unsigned int num);
+
+#endif
@@ -11,8 +11,8 @@ struct board_ops {
     void (*mmio_write)(struct vm_struct *,unsigned long, unsigned long);
     void (*entering_vm)(struct vm_struct *);
     void (*leaving_vm)(struct vm_struct *);
-    int (*is_irq_asserted)(struct vm_struct *);
-    int (*is_fiq_asserted)(struct vm_struct *);
+    // コンソールの FIFO の中身が変わったときに呼ばれる(割込みの状態を更新する)
+    void (*console_updated)(struct vm_struct *);
     void (*debug)(struct vm_struct *);
 };
 
@@ -16,6 +16,12 @@ struct cpu_core_struct {
     // 全員が割込み禁止を解除したら、本当に割込みを許可する
     int number_of_off;
     int interrupt_enable;
+
+    // この CPU コアの時間の内訳(CNTPCT のティック数)
+    // 残り(経過時間 - guest_ticks - idle_ticks)がハイパーバイザの時間になる
+    unsigned long start_ticks;      // 計測を始めた時刻
+    unsigned long guest_ticks;      // IDLE VM 以外のゲストを実行していた時間
+    unsigned long idle_ticks;       // IDLE VM を実行していた時間
 };
 
 void init_cpu_core_struct(unsigned long cpuid);
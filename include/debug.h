@@ -8,6 +8,7 @@
 #include "spinlock.h"
 #include "irq.h"
 #include "cpu_core.h"
+#include "log.h"
 
 // ログレベルの定義
 #define LOG_LEVEL_NONE  0
@@ -21,22 +22,9 @@
 #define LOG_LEVEL LOG_LEVEL_INFO  // デフォルトは警告まで表示
 #endif
 
-// todo: debug.c 的なソースを用意して隠蔽する
-extern struct spinlock log_lock;
-
-#define _LOG_COMMON(level, fmt, ...) do { \
-    acquire_lock(&log_lock); \
-    unsigned long cpuid = get_cpuid(); \
-    struct vm_struct *vm = current_cpu_core()->current_vm; \
-    if (vm) { \
-        printf("<cpu:%d>[vmid:%d] %s: ", cpuid, vm->vmid, level); \
-    } \
-    else { \
-        printf("<cpu:%d> %s: ", cpuid, level); \
-    } \
-    printf(fmt "\n", ##__VA_ARGS__); \
-    release_lock(&log_lock); \
-} while (0)
+// ログは CPU コアごとのリングバッファに記録するだけで、UART への出力は log_drain で後から行う
+// 出力の完了を待たないので、ホットパスから呼んでもコアを止めない
+#define _LOG_COMMON(level, fmt, ...) log_write(level, fmt, ##__VA_ARGS__)
 
 #if LOG_LEVEL >= LOG_LEVEL_DEBUG
 #define DEBUG(fmt, ...) _LOG_COMMON("\x1b[39m" "DEBUG" "\x1b[39m", fmt, ##__VA_ARGS__)
@@ -59,6 +47,8 @@ extern struct spinlock log_lock;
 // panic 後も割り込みが入ると普通に動いてしまうので割り込みを禁止する
 #define PANIC(fmt, ...) do { \
     _LOG_COMMON("PANIC", fmt, ##__VA_ARGS__); \
+    /* 停止する前に溜まっているログを出し切る */ \
+    log_flush(); \
     struct vm_struct *vm = current_cpu_core()->current_vm; \
     if (vm) { \
         exit_vm(); \
@@ -0,0 +1,26 @@
+#ifndef _DMA_H
+#define _DMA_H
+
+// DMA コントローラが読み込むコントロールブロック
+// 32 バイト境界に置く必要がある
+struct dma_control_block {
+    unsigned int ti;            // Transfer Information
+    unsigned int source_ad;     // 転送元のバスアドレス
+    unsigned int dest_ad;       // 転送先のバスアドレス
+    unsigned int txfr_len;      // 転送サイズ(バイト)
+    unsigned int stride;        // 2D モードでのみ使う
+    unsigned int nextconbk;     // 次のコントロールブロックのバスアドレス(0 なら終了)
+    unsigned int reserved[2];
+} __attribute__((aligned(32)));
+
+void dma_init_channel(int ch);
+void dma_start(int ch, struct dma_control_block *cb);
+int dma_is_done(int ch);
+int dma_has_error(int ch);
+void dma_clear(int ch);
+void dma_abort(int ch);
+
+unsigned int dma_bus_addr_memory(void *addr);
+unsigned int dma_bus_addr_peripheral(unsigned long addr);
+
+#endif
@@ -5,6 +5,11 @@
 #define S_FRAME_SIZE            272     // size of all saved registers
 #define S_X0                    0       // offset of x0 register in saved stack frame
 
+// 高速パスのハイパーコールで退避するレジスタ(x0~x18, x30 の 20 個)
+// x19~x29 は呼び出し先の C の関数が保存するので退避しなくてよい
+#define S_FAST_FRAME_SIZE       160
+#define S_FAST_X8               64      // offset of x8 register in fast path frame
+
 #define SYNC_INVALID_EL2        0
 #define IRQ_INVALID_EL2         1
 #define FIQ_INVALID_EL2         2
@@ -3,6 +3,9 @@
 
 #include <stddef.h>
 #include <inttypes.h>
+#include "sleeplock.h"
+
+#define FAT32_MAX_FILENAME_LEN  255
 
 // the BIOS Parameter Block (in Volume Boot Record)
 // https://wiki.osdev.org/FAT#FAT_32
@@ -57,12 +60,47 @@ struct fat32_fsi {
     uint32_t    FSI_TrailSig;       // 0xaa550000
 } __attribute__((__packed__));
 
+// ファイル内で連続しているクラスタの並び(エクステント)
+// 長さは次のエクステントの file_cluster との差で表す
+struct fat32_extent {
+    uint32_t    file_cluster;       // ファイル先頭から数えたクラスタのインデックス
+    uint32_t    disk_cluster;       // ディスク上のクラスタ番号
+};
+
+// 1ページに収まるエクステントの数
+#define FAT32_MAX_EXTENTS   (4096 / sizeof(struct fat32_extent))
+
 // ファイルを表す構造体
 struct fat32_file {
     struct      fat32_fs *fat32;    // このファイルが所属するファイルシステム
     uint8_t     attr;               // ファイル属性
     uint32_t    size;               // ファイルサイズ
     uint32_t    cluster;            // ファイルの先頭クラスタ
+
+    // クラスタチェインから作ったエクステントの表(最初のアクセス時に作る)
+    struct      fat32_extent *extents;
+    uint32_t    nr_extents;
+    uint32_t    nr_clusters;        // エクステントの表でカバーしているクラスタ数
+    uint8_t     extents_truncated;  // 表に入り切らず、nr_clusters 以降は FAT をたどる必要がある
+};
+
+// ディレクトリエントリのキャッシュ
+//   ディレクトリごとに一度だけ全エントリを読み、名前のハッシュで引けるようにしておく
+#define FAT32_DIRCACHE_BUCKETS  64
+#define FAT32_DIRCACHE_DIRS     8
+
+struct fat32_cached_dent {
+    struct      fat32_cached_dent *next;
+    uint32_t    hash;
+    uint8_t     attr;
+    uint32_t    size;
+    uint32_t    cluster;
+    char        name[FAT32_MAX_FILENAME_LEN + 1];
+};
+
+struct fat32_dircache {
+    uint32_t    cluster;            // キャッシュしているディレクトリのクラスタ(0 なら未使用)
+    struct      fat32_cached_dent *buckets[FAT32_DIRCACHE_BUCKETS];
 };
 
 // ファイルシステムを表す構造体
@@ -77,11 +115,20 @@ struct fat32_fs {
     uint32_t    datasectors;        //
     uint32_t    volume_first;       // FAT32 パーティションの開始セクタ番号
     struct      fat32_file root;    // ルートディレクトリ
+
+    // ディレクトリエントリのキャッシュと、その検索・構築を守るロック
+    struct      sleeplock lock;     // ディレクトリをたどる間は SD カードの読み込みを待つので、スリープロックにする
+    struct      fat32_dircache dircache[FAT32_DIRCACHE_DIRS];
+    uint8_t     *dent_pool;         // キャッシュのエントリを切り出すページ
+    uint32_t    dent_pool_used;
 };
 
-int fat32_get_handle(struct fat32_fs *);
+int fat32_mount(void);
+struct fat32_fs *fat32_get_fs(void);
 int fat32_lookup(struct fat32_fs *, const char *, struct fat32_file *);
 int fat32_read(struct fat32_file *, void *, unsigned long, size_t);
+long fat32_file_lba(struct fat32_file *, uint32_t, uint32_t *);
+void fat32_close(struct fat32_file *);
 int fat32_file_size(struct fat32_file *);
 int fat32_is_directory(struct fat32_file *);
 
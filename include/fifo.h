@@ -1,14 +1,26 @@
 #ifndef _FIFO_H
 #define _FIFO_H
 
+// バイト単位の single-producer/single-consumer リングバッファ
+//   書き込み側と読み出し側がそれぞれ 1 つずつなら、別々のコアからロックなしで使える
+//   書き込み側・読み出し側が複数になる場合は、呼び出し側で排他すること
+
+// 容量は 2 のべき乗で、管理領域と合わせて 1 ページに収まる範囲で指定する
+#define FIFO_DEFAULT_CAPACITY   1024
+#define FIFO_MAX_CAPACITY       2048
+
 struct fifo;
 
 int is_empty_fifo(struct fifo *);
 int is_full_fifo(struct fifo *);
 struct fifo *create_fifo(void);
+struct fifo *create_fifo_with_capacity(unsigned int);
 void clear_fifo(struct fifo *);
 int enqueue_fifo(struct fifo *, unsigned long);
 int dequeue_fifo(struct fifo *, unsigned long *);
+int enqueue_fifo_n(struct fifo *, const char *, int);
+int dequeue_fifo_n(struct fifo *, char *, int);
 int used_of_fifo(struct fifo *);
+int free_of_fifo(struct fifo *);
 
 #endif
@@ -2,5 +2,6 @@
 #define _HYPERCALL_H
 
 void hypercall(unsigned long hvc_nr, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3);
+int hypercall_fast(unsigned long hvc_nr, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3, unsigned long *x8);
 
 #endif
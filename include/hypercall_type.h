@@ -9,7 +9,64 @@
 #define HYPERCALL_TYPE_INFO_LX_LX_LX_LX     4   // 第1,2,3,4引数負整数をデバッグ出力
 #define HYPERCALL_TYPE_INFO_STR             10  // 第1引数の文字列をデバッグ出力
 
+// ABI のバージョンと機能の問い合わせ用
+#define HYPERCALL_TYPE_VERSION              20  // HYPERCALL_ABI_VERSION を返す
+#define HYPERCALL_TYPE_FEATURES             21  // 使える機能(HYPERCALL_FEATURE_*)を返す
+#define HYPERCALL_TYPE_QUERY                22  // 第1引数の番号のハイパーコールの HYPERCALL_F_* を返す(なければ 0)
+#define HYPERCALL_TYPE_MULTICALL            23  // 第1引数の struct hypercall_multicall_entry の配列から第2引数の数だけ実行する
+
 // 仮想マシン操作用
 #define HYPERCALL_TYPE_CREATE_VM_FROM_ELF   100 // VM を作成する
 
+// PV コンソール用
+//   第1引数にバッファの仮想アドレス、第2引数に長さを渡す
+//   処理したバイト数が x8 に返る(アドレスが不正な場合は -1)
+#define HYPERCALL_TYPE_CONSOLE_WRITE        200 // バッファの内容をまとめてコンソールに出力する
+#define HYPERCALL_TYPE_CONSOLE_READ         201 // コンソールの入力をまとめて読み出す(待たない)
+
+// virtqueue 用(include/virtq.h)
+#define HYPERCALL_TYPE_VIRTQ_SETUP          300 // 第1引数の struct virtq_setup(仮想アドレス)で virtqueue を登録する
+#define HYPERCALL_TYPE_VIRTQ_NOTIFY         301 // 第1引数の番号の virtqueue に積まれたリクエストを処理させる
+#define HYPERCALL_TYPE_PV_IRQ_ACK           302 // 第1引数のビットの準仮想割込みを落とし、残りを返す
+#define HYPERCALL_TYPE_VBLK_ATTACH          310 // 第1引数のファイル名のイメージをブロックデバイスとして接続し、セクタ数を返す
+
+// VM 間の共有メモリ用(include/shm.h)
+#define HYPERCALL_TYPE_SHM_MAP              320 // 第1引数の名前の共有メモリを第2引数の IPA から第3引数のバイト数分マッピングし、領域の番号を返す
+#define HYPERCALL_TYPE_SHM_NOTIFY           321 // 第1引数の番号の領域をマッピングしている他の VM に通知し、通知した数を返す
+#define HYPERCALL_TYPE_SHM_ACK              322 // 通知があった領域のビットを返し、通知の割込みを落とす
+
+// ABI のバージョン(上位 16 ビットがメジャー、下位 16 ビットがマイナー)
+//   v1: 引数は x8~x11、戻り値は x8
+//   v2: v1 に加えて、バージョン・機能の問い合わせと multicall
+#define HYPERCALL_ABI_VERSION               0x00020000
+
+#define HYPERCALL_FEATURE_MULTICALL         (1 << 0)
+#define HYPERCALL_FEATURE_PV_CONSOLE        (1 << 1)
+#define HYPERCALL_FEATURE_VIRTQ             (1 << 2)
+#define HYPERCALL_FEATURE_VBLK              (1 << 3)
+#define HYPERCALL_FEATURE_SHM               (1 << 4)
+
+// HYPERCALL_TYPE_QUERY が返すフラグ
+#define HYPERCALL_F_EXIST                   (1 << 0)    // 実装されている
+#define HYPERCALL_F_RESULT                  (1 << 1)    // 戻り値を x8 に返す(立っていなければ x8 は変わらない)
+#define HYPERCALL_F_BATCH                   (1 << 2)    // multicall から呼べる
+#define HYPERCALL_F_FAST                    (1 << 3)    // ゲストの状態を退避せずにその場で処理される(往復が速い)
+
+// multicall の 1 エントリ
+//   ゲストは op と args を埋め、実行後の戻り値が result に入る
+//   (存在しないか multicall から呼べないハイパーコールの場合は -1)
+//   配列は HYPERCALL_MULTICALL_ENTRY_SIZE にアラインして置くこと(エントリがページをまたがないように)
+//   1 回で実行されるのは HYPERCALL_MULTICALL_MAX 個までで、実行した数が x8 に返る
+#define HYPERCALL_MULTICALL_ENTRY_SIZE      64
+#define HYPERCALL_MULTICALL_MAX             64
+
+#ifndef __ASSEMBLER__
+struct hypercall_multicall_entry {
+    unsigned long op;
+    unsigned long args[4];
+    long result;
+    unsigned long reserved[2];
+};
+#endif
+
 #endif
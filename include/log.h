@@ -0,0 +1,34 @@
+#ifndef _LOG_H
+#define _LOG_H
+
+// ログは CPU コアごとのリングバッファにいったん記録し、UART への出力は後からまとめて行う
+//   書き込み側はロックを取らず、自コアの割込みを禁止するだけで済む
+//   読み出し(UART への出力)は log_drain を呼んだコアが一つだけ担当する
+
+// 1 レコードのメッセージ部分の最大長(超えた分は切り捨てる)
+#define LOG_MSG_LEN         96
+// CPU コアごとのレコード数(2 のべき乗にすること)
+#define LOG_RING_ENTRIES    64
+
+struct log_record {
+    unsigned long timestamp;    // 記録した時点の cntpct_el0
+    const char *level;          // "INFO" などのリテラル文字列
+    int cpuid;
+    int vmid;                   // VM 外で記録された場合は -1
+    char msg[LOG_MSG_LEN];
+};
+
+struct log_ring {
+    // head は書き込み側(その CPU コア)だけ、tail は読み出し側だけが更新する
+    volatile unsigned long head;
+    volatile unsigned long tail;
+    // リングが一杯で捨てたレコードの数
+    volatile unsigned long dropped;
+    struct log_record records[LOG_RING_ENTRIES];
+};
+
+void log_write(const char *level, char *fmt, ...);
+int log_drain(int budget);
+void log_flush(void);
+
+#endif
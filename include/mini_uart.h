@@ -1,10 +1,16 @@
 #ifndef	_MINI_UART_H
 #define	_MINI_UART_H
 
+// 送信リングのサイズ(2 のべき乗にすること)
+#define UART_TX_RING_SIZE   4096
+
 void uart_init(void);
 void handle_uart_irq(void);
 char uart_recv(void);
 void uart_send(char c);
 void putc(void *p, char c);
+int uart_write(const char *buf, int len);
+int uart_tx_free(void);
+void uart_tx_flush(void);
 
 #endif  /*_MINI_UART_H */
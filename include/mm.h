@@ -52,17 +52,27 @@
 void mm_init();
 
 unsigned long get_free_page();
+unsigned long get_free_page_nozero();
 void free_page(void *p);
 void map_stage2_page(struct vm_struct *vm, unsigned long ipa,
                      unsigned long page, unsigned long flags);
 unsigned long allocate_page();
 unsigned long allocate_vm_page(struct vm_struct *vm, unsigned long ipa);
+unsigned long allocate_vm_page_nozero(struct vm_struct *vm, unsigned long ipa);
+unsigned long get_vm_page(struct vm_struct *vm, unsigned long ipa);
+unsigned long get_or_allocate_vm_page(struct vm_struct *vm, unsigned long ipa);
+int is_vm_page_unmapped(struct vm_struct *vm, unsigned long ipa);
 void set_vm_page_notaccessable(struct vm_struct *vm, unsigned long va);
+void flush_vm_tlb(struct vm_struct *vm);
+void free_vm_memory(struct vm_struct *vm);
 
 int handle_mem_abort(unsigned long addr, unsigned long esr);
 
 unsigned long get_ipa(unsigned long va);
 unsigned long get_pa_2nd(unsigned long va);
+unsigned long get_guest_va_host_addr(unsigned long va);
+int copy_string_from_guest(unsigned long va, char *dst, int size);
+void sync_guest_memory(void *addr, unsigned long len);
 extern unsigned long pg_dir;
 
 #endif
@@ -0,0 +1,72 @@
+#ifndef	_P_DMA_H
+#define	_P_DMA_H
+
+#include "peripherals/base.h"
+
+// BCM2837-ARM-Peripherals.-.Revised.-.V2-1.pdf
+// 4. DMA Controller
+// チャネル 0~14 のレジスタは 0x100 ずつずれて並んでいる(チャネル 15 は別の場所にある)
+#define DMA_BASE                (PBASE+0x00007000)
+#define DMA_CHANNEL_BASE(ch)    (DMA_BASE + (ch) * 0x100)
+
+#define DMA_CS(ch)              (DMA_CHANNEL_BASE(ch) + 0x00)
+#define DMA_CONBLK_AD(ch)       (DMA_CHANNEL_BASE(ch) + 0x04)
+#define DMA_TI(ch)              (DMA_CHANNEL_BASE(ch) + 0x08)
+#define DMA_SOURCE_AD(ch)       (DMA_CHANNEL_BASE(ch) + 0x0C)
+#define DMA_DEST_AD(ch)         (DMA_CHANNEL_BASE(ch) + 0x10)
+#define DMA_TXFR_LEN(ch)        (DMA_CHANNEL_BASE(ch) + 0x14)
+#define DMA_STRIDE(ch)          (DMA_CHANNEL_BASE(ch) + 0x18)
+#define DMA_NEXTCONBK(ch)       (DMA_CHANNEL_BASE(ch) + 0x1C)
+#define DMA_DEBUG(ch)           (DMA_CHANNEL_BASE(ch) + 0x20)
+
+// 全チャネル共通のレジスタ
+#define DMA_INT_STATUS          (DMA_BASE + 0xFE0)
+#define DMA_ENABLE              (DMA_BASE + 0xFF0)
+
+// CS: Control and Status
+#define DMA_CS_ACTIVE           (1 << 0)    // 1 を書くと転送を開始する
+#define DMA_CS_END              (1 << 1)    // 転送完了(1 を書いてクリア)
+#define DMA_CS_INT              (1 << 2)    // 割込み発生中(1 を書いてクリア)
+#define DMA_CS_DREQ             (1 << 3)
+#define DMA_CS_PAUSED           (1 << 4)
+#define DMA_CS_ERROR            (1 << 8)    // DEBUG レジスタにエラー要因が入る
+#define DMA_CS_PRIORITY(x)      (((x) & 0xf) << 16)
+#define DMA_CS_PANIC_PRIORITY(x) (((x) & 0xf) << 20)
+#define DMA_CS_WAIT_FOR_OUTSTANDING_WRITES (1 << 28)
+#define DMA_CS_DISDEBUG         (1 << 29)
+#define DMA_CS_ABORT            (1 << 30)
+#define DMA_CS_RESET            (1 << 31)
+
+// TI: Transfer Information
+//   コントロールブロックの ti に入れる値
+#define DMA_TI_INTEN            (1 << 0)    // 転送完了時に割込みを発生させる
+#define DMA_TI_WAIT_RESP        (1 << 3)    // 書き込みごとに AXI の応答を待つ
+#define DMA_TI_DEST_INC         (1 << 4)
+#define DMA_TI_DEST_WIDTH       (1 << 5)    // 0: 32bit, 1: 128bit
+#define DMA_TI_DEST_DREQ        (1 << 6)
+#define DMA_TI_SRC_INC          (1 << 8)
+#define DMA_TI_SRC_WIDTH        (1 << 9)
+#define DMA_TI_SRC_DREQ         (1 << 10)
+#define DMA_TI_BURST_LENGTH(x)  (((x) & 0xf) << 12)
+#define DMA_TI_PERMAP(x)        (((x) & 0x1f) << 16)
+#define DMA_TI_NO_WIDE_BURSTS   (1 << 26)
+
+// DEBUG レジスタのエラービット(1 を書いてクリア)
+#define DMA_DEBUG_READ_LAST_NOT_SET_ERROR   (1 << 0)
+#define DMA_DEBUG_FIFO_ERROR                (1 << 1)
+#define DMA_DEBUG_READ_ERROR                (1 << 2)
+#define DMA_DEBUG_ERROR_MASK                0x7
+
+// DREQ の番号(TI の PERMAP に設定する)
+#define DMA_DREQ_EMMC           11
+
+// DMA チャネル n の割込みは IRQ 16+n として IRQ_PENDING_1 に現れる
+#define DMA_IRQ_BIT(ch)         (1 << (16 + (ch)))
+
+// DMA から見たアドレス(バスアドレス)
+//   ペリフェラルは 0x7E000000 から始まる
+//   DRAM は L2 キャッシュを経由しない 0xC0000000 のエイリアスを使う
+#define DMA_PERIPHERAL_BUS_BASE 0x7E000000
+#define DMA_MEMORY_BUS_BASE     0xC0000000
+
+#endif  /*_P_DMA_H */
@@ -110,6 +110,14 @@
 #define MBOX_CORE3_RD_CLR_2     (MBOX_CORE3_RD_CLR_BASE + 0x8)  // Core3 -> Core2
 #define MBOX_CORE3_RD_CLR_3     (MBOX_CORE3_RD_CLR_BASE + 0xC)  // Core3 -> Core3
 
+// コア間割込み(IPI)
+// 各コアの Mailbox 0 をコア間割込みに使い、書き込むビットで要求の種類を表す
+// Mailbox の SET レジスタへの書き込みはビットごとの OR になるので、複数の要求が重なっても失われない
+// VM の切り替えは IPI_CALL で smp_send_reschedule の呼び出しとして送る(smp.h)
+#define IPI_VIRQ                (1 << 1)    // 実行中の VM の仮想割込みの状態を反映させる
+#define IPI_CALL                (1 << 2)    // smp_call_function で積まれた関数を実行する(smp.h)
+
+void send_ipi(unsigned long cpuid, unsigned int ipi);
 void handle_mailbox_irq(unsigned long cpuid);
 
 #endif
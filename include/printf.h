@@ -92,15 +92,20 @@ regs Kusti, 23.10.2004
 #define __TFP_PRINTF__
 
 #include <stdarg.h>
+#include <stddef.h>
 
 void init_printf(void* putp,void (*putf) (void*,char));
 
 void tfp_printf(char *fmt, ...);
 void tfp_sprintf(char* s,char *fmt, ...);
+void tfp_snprintf(char* s,size_t n,char *fmt, ...);
+void tfp_vsnprintf(char* s,size_t n,char *fmt, va_list va);
 
 void tfp_format(void* putp,void (*putf) (void*,char),char *fmt, va_list va);
 
 #define printf tfp_printf
 #define sprintf tfp_sprintf
+#define snprintf tfp_snprintf
+#define vsnprintf tfp_vsnprintf
 
 #endif
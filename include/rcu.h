@@ -0,0 +1,24 @@
+#ifndef _RCU_H
+#define _RCU_H
+
+// RCU(read-copy-update)
+//   読む側はロックを取らずに rcu_dereference でポインタを読むだけ
+//   書く側はポインタを付け替えた後、古いものを call_rcu に渡して、
+//   読んでいた側が全員いなくなってから(猶予期間の後に)解放する
+//   CPU コアがスケジューラのループに戻ってきたところを静止状態(どの参照も持っていない状態)とし、
+//   全コアが静止状態を通過したら 1 回の猶予期間が終わったものとする
+//   読む側は参照を持ったまま CPU を譲ってはいけない(sleep_on や yield をまたいで使わない)
+
+#define rcu_dereference(p)          __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_assign_pointer(p, v)    __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+struct rcu_head {
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *);
+    unsigned long seq;              // この番号の猶予期間が終われば func を呼べる
+};
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *));
+void rcu_quiescent(void);
+
+#endif
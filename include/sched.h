@@ -7,6 +7,10 @@
 
 #include "spinlock.h"
 #include "loader.h"
+#include "sysreg.h"
+#include "virq.h"
+#include "wait.h"
+#include "rcu.h"
 
 #define THREAD_SIZE     4096
 #define NUMBER_OF_VMS   64
@@ -15,12 +19,11 @@ enum VM_STATE {
     VM_RUNNING = 0,
     VM_RUNNABLE,
     VM_ZOMBIE,
+    VM_BLOCKED,                     // 待ち行列(wait.h)で待っている
 };
 
 struct board_ops;
 
-extern struct vm_struct *vms[NUMBER_OF_VMS];
-extern int current_number_of_vms;
 
 // 控えないといけないレジスタ値を保存する
 // vm が切り替わるときは必ず cpu_switch_to 関数が呼ばれるため
@@ -61,8 +64,8 @@ struct cpu_sysregs {
     unsigned long elr_el1;
     unsigned long fpcr;
     unsigned long fpsr;
-    unsigned long midr_el1;     // todo: vpidr_el2 では？
-    unsigned long mpidr_el1;    // todo: vmpidr_el2 では？
+    unsigned long vpidr_el2;    // ゲストが MIDR_EL1 を読んだときの値
+    unsigned long vmpidr_el2;   // ゲストが MPIDR_EL1 を読んだときの値
     unsigned long par_el1;
     unsigned long sp_el0;
     unsigned long sp_el1;
@@ -71,47 +74,12 @@ struct cpu_sysregs {
     unsigned long tpidr_el1;
     unsigned long tpidrro_el0;
     unsigned long vbar_el1;
+    unsigned long csselr_el1;
 
     // HCR_EL2.TACR がセットされている場合にトラップされる
+    // 実機には書き込まず、ここに保持した値をゲストに見せる
     unsigned long actlr_el1;        // rw
 
-    // HCR_EL2.TID3 がセットされている場合にトラップされる
-    unsigned long id_pfr0_el1;      // r
-    unsigned long id_pfr1_el1;      // r
-    unsigned long id_mmfr0_el1;     // r
-    unsigned long id_mmfr1_el1;     // r
-    unsigned long id_mmfr2_el1;     // r
-    unsigned long id_mmfr3_el1;     // r
-    unsigned long id_isar0_el1;     // r
-    unsigned long id_isar1_el1;     // r
-    unsigned long id_isar2_el1;     // r
-    unsigned long id_isar3_el1;     // r
-    unsigned long id_isar4_el1;     // r
-    unsigned long id_isar5_el1;     // r
-    unsigned long mvfr0_el1;        // r
-    unsigned long mvfr1_el1;        // r
-    unsigned long mvfr2_el1;        // r
-    unsigned long id_aa64pfr0_el1;  // r
-    unsigned long id_aa64pfr1_el1;  // r
-    unsigned long id_aa64dfr0_el1;  // r
-    unsigned long id_aa64dfr1_el1;  // r
-    unsigned long id_aa64isar0_el1; // r
-    unsigned long id_aa64isar1_el1; // r
-    unsigned long id_aa64mmfr0_el1; // r
-    unsigned long id_aa64mmfr1_el1; // r
-    unsigned long id_aa64afr0_el1;  // r
-    unsigned long id_aa64afr1_el1;  // r
-
-    // HCR_EL2.TID2 がセットされている場合にトラップされる
-    unsigned long ctr_el0;          // r
-    unsigned long ccsidr_el1;       // r
-    unsigned long clidr_el1;        // r
-    unsigned long csselr_el1;       // rw
-
-    // HCR_EL2.TID1 がセットされている場合にトラップされる
-    unsigned long aidr_el1;         // r
-    unsigned long revidr_el1;       // r
-
     // system timer
     // physical timers
     unsigned long cntkctl_el1;
@@ -139,11 +107,54 @@ struct vm_stat {
     long mmio_trap_count;           // VM が mmio 領域にアクセスした回数
 };
 
+// VM exit の要因(vm_exit_stats.reasons の添字)
+enum vm_exit_reason {
+    VM_EXIT_IRQ = 0,                // 物理割込み(他の要因が設定されなかった場合もここに入る)
+    VM_EXIT_WFX,
+    VM_EXIT_HVC,
+    VM_EXIT_HVC_FAST,               // 高速パスのハイパーコール(ハンドラの実行時間のみ)
+    VM_EXIT_SYSREGS,
+    VM_EXIT_PF,
+    VM_EXIT_MMIO,
+    NR_VM_EXIT_REASONS,
+};
+
+// VM exit にかかった時間のヒストグラムのビン数
+// ビン n には CNTPCT のティック数が [2^n, 2^(n+1)) のものが入る(最後のビンはそれ以上すべて)
+#define VM_EXIT_HIST_BUCKETS    16
+
+struct vm_exit_stat {
+    unsigned long count;
+    unsigned long ticks;            // 合計時間(CNTPCT のティック数)
+    unsigned long hist[VM_EXIT_HIST_BUCKETS];
+};
+
+// VM ごとの時間の内訳
+// vm_struct と同じページに置くとスタックが足りなくなるので、別のページに確保する
+struct vm_exit_stats {
+    unsigned long guest_ticks;      // ゲストを実行していた時間
+    unsigned long hv_ticks;         // ハイパーバイザが VM exit を処理していた時間
+    struct vm_exit_stat reasons[NR_VM_EXIT_REASONS];
+    unsigned long sysreg_traps[NR_SYSREGS + 1];     // システムレジスタごとのトラップ回数(sysreg.h)
+};
+
+// in_fifo: UART 割込み(コア 0)が書き込み、VM が読み出す
+// out_fifo: VM が書き込み、flush_vm_console が読み出す
+//   flush_vm_console は VM を動かしているコアとコア 0 の両方から呼ばれるので、
+//   読み出し側を out_lock で 1 つに絞る
 struct vm_console {
     struct fifo *in_fifo;
     struct fifo *out_fifo;
+    struct spinlock out_lock;
 };
 
+// 準仮想デバイスからゲストへの割込み(vm_struct.pv_irq_pending のビット)
+// ゲストからは BCM2837 の割込みコントローラの ARM Doorbell として見える
+#define PV_IRQ_VIRTQ    (1 << 0)    // virtqueue の完了通知(ARM Doorbell 0)
+#define PV_IRQ_SHM      (1 << 1)    // 共有メモリの相手からの通知(ARM Doorbell 1)
+
+struct virtio_state;
+
 struct vm_struct {
     // cpu_context はアセンブラで位置指定でアクセスされるので、構造体の先頭に置く
     // THREAD_CPU_CONTEXT がアセンブラでのオフセット
@@ -167,16 +178,41 @@ struct vm_struct {
     struct vm_console console;
     struct spinlock lock;
     struct loader_args loader_args;	            // ローダの引数
+    struct virq_state virq;                     // 仮想割込みコントローラの状態
+    volatile unsigned long pv_irq_pending;      // 準仮想デバイスからの割込み(PV_IRQ_*)
+    struct virtio_state *virtio;                // virtqueue の状態(最初に登録されたときに確保)
+    volatile unsigned long shm_pending;         // 通知があった共有メモリの領域(ビット番号が領域の番号)
+    struct vm_exit_stats *exit_stats;           // VM exit ごとの時間(確保できなかった場合は NULL)
+    unsigned long enter_ticks;                  // 最後に VM に復帰した時刻
+    unsigned long exit_ticks;                   // 処理中の VM exit が始まった時刻
+    int exit_reason;                            // 処理中の VM exit の要因(VM_EXIT_*)
+    volatile int boosted;                       // 入力などで起こされ、次のスケジューリングで優先される
+    struct vm_struct *wait_next;                // 同じ待ち行列で待っている次の VM
+    volatile int killed;                        // kill_vm された(次に VM に復帰するときに終了する)
+    struct rcu_head rcu;                        // VM 表から外した後、猶予期間を待って解放するため
 };
 
 void sched_init(void);
 void timer_tick(void);
 void set_cpu_virtual_interrupt(struct vm_struct *);
+void raise_pv_irq(struct vm_struct *, unsigned long);
+unsigned long ack_pv_irq(struct vm_struct *, unsigned long);
+void kick_vm(struct vm_struct *);
 void set_cpu_sysregs(struct vm_struct *);
 void switch_to(struct vm_struct*);
 void cpu_switch_to(struct vm_struct* prev, struct vm_struct* next);
 void exit_vm(void);
+void kill_vm(struct vm_struct *);
+struct vm_struct *vm_get(int vmid);
+int number_of_vm_slots(void);
+int register_vm(struct vm_struct *, int vmid);
+int find_cpu_which_runs(struct vm_struct *);
 void show_vm_list(void);
+void show_vm_exit_stats(void);
+void run_el2_bench(void);
+void account_fast_vm_exit(struct vm_struct *, unsigned long start);
+unsigned long ticks_to_ns(unsigned long ticks, unsigned long freq);
+unsigned long ticks_to_us(unsigned long ticks, unsigned long freq);
 
 void yield();
 void scheduler(unsigned long);
@@ -23,9 +23,39 @@
  *
  */
 
+#ifndef _SD_H
+#define _SD_H
+
 #define SD_OK                0
 #define SD_TIMEOUT          -1
 #define SD_ERROR            -2
 
+// SD カードの読み込みに使う DMA チャネル
+//   チャネル 0~6 がフル機能のチャネルで、そのうちファームウェアが使っていないものを選ぶ
+#define SD_DMA_CHANNEL       5
+
+// 非同期に処理されるブロック読み込み・書き込み要求
+//   sd_submit でキューにつなぎ、DMA の完了割込み(もしくは sd_poll)で完了する
+//   status は完了するまで SD_REQ_PENDING のまま
+#define SD_REQ_PENDING       1
+
+struct sd_request {
+    unsigned int lba;
+    unsigned char *buffer;
+    unsigned int num;
+    int write;              // 1 なら書き込み(PIO でその場で処理される)
+    volatile int status;
+    struct sd_request *next;
+};
+
 int sd_init();
 int sd_readblock(unsigned int lba, unsigned char *buffer, unsigned int num);
+int sd_writeblock(unsigned int lba, unsigned char *buffer, unsigned int num);
+
+void sd_init_request(struct sd_request *req, unsigned int lba, unsigned char *buffer, unsigned int num);
+void sd_submit(struct sd_request *req);
+int sd_wait(struct sd_request *req);
+void sd_poll(void);
+void handle_sd_dma_irq(void);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef _SHM_H
+#define _SHM_H
+
+// VM 間の共有メモリ
+//   名前をつけた領域を作り、同じ名前を指定した VM の Stage2 テーブルに同じページをマッピングする
+//   データはハイパーバイザを経由せずにゲスト同士で直接読み書きする
+//   相手への通知は HYPERCALL_TYPE_SHM_NOTIFY で行い、相手には ARM Doorbell 1 の割込みとして見える
+//   どの領域から通知されたかは HYPERCALL_TYPE_SHM_ACK で取得する(ビット番号が領域の番号)
+
+#define SHM_MAX_REGIONS     16  // 領域の数(vm_struct.shm_pending のビットに収まること)
+#define SHM_MAX_PAGES       64  // 1 つの領域の最大ページ数(256KB)
+#define SHM_MAX_PEERS       8   // 1 つの領域をマッピングできる VM の数
+#define SHM_NAME_LEN        16  // 終端の '\0' を含む
+
+struct vm_struct;
+
+long shm_map(struct vm_struct *vm, unsigned long name_va, unsigned long ipa, unsigned long size);
+long shm_notify(struct vm_struct *vm, unsigned long id);
+unsigned long shm_ack(struct vm_struct *vm);
+void shm_detach_vm(struct vm_struct *vm);
+int shm_owns_page(unsigned long pa);
+
+#endif
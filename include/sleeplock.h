@@ -0,0 +1,22 @@
+#ifndef _SLEEPLOCK_H
+#define _SLEEPLOCK_H
+
+#include "wait.h"
+
+// スリープロック
+//   SD カードの読み込みを待つなど、長い間持つロックに使う
+//   ロックが取れなければ、スピンロックのように回るのではなく VM を BLOCKED にして待つ
+//   持っている間に眠ってもよい(持ったままスピンロックを取ることもできる)
+//   眠れない場面(can_sleep が 0)では、空くまで回って待つ
+struct sleeplock {
+    struct wait_queue wq;           // locked と owner は wq.lock で守る
+    int locked;
+    struct vm_struct *owner;        // ロックを持っている VM(ハイパーバイザ自身の処理なら NULL)
+    char *name;
+};
+
+void init_sleeplock(struct sleeplock *lock, char *name);
+void acquire_sleeplock(struct sleeplock *lock);
+void release_sleeplock(struct sleeplock *lock);
+
+#endif
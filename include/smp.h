@@ -0,0 +1,26 @@
+#ifndef _SMP_H
+#define _SMP_H
+
+// 他のコアで関数を実行させる(コア間呼び出し)
+//   呼び出し要求をコアごとのキューに積み、Mailbox の IPI_CALL で相手のコアに割込みをかける
+//   相手のコアは割込みハンドラ(EL2、割込み禁止)の中で関数を実行する
+//     関数の中で yield や VM の切り替え(exit_vm など)をしてはいけない
+//     handle_smp_calls のループを抜けてしまい、後に積まれた呼び出しと wait で待っている側が取り残される
+//     VM を切り替えたいときは印だけつけて、handle_mailbox_irq が呼び出しを処理し終えてから切り替える
+//   wait が 1 なら実行が終わるまで待つ
+//     待っている間も自分宛ての呼び出しは処理するので、互いに呼び合ってもデッドロックしない
+//   wait が 0 なら実行を待たずに戻るので、arg は実行が終わるまで有効なものを渡すこと
+
+// 呼び出し要求のキューの大きさ(コアごと)
+#define SMP_CALL_QUEUE_SIZE 16
+
+typedef void (*smp_call_func_t)(void *arg);
+
+void smp_init(void);
+int smp_call_function_single(unsigned long cpuid, smp_call_func_t func, void *arg, int wait);
+void smp_call_function(smp_call_func_t func, void *arg, int wait);
+void handle_smp_calls(unsigned long cpuid);
+void smp_send_reschedule(unsigned long cpuid);
+int smp_take_reschedule(unsigned long cpuid);
+
+#endif
@@ -1,16 +1,34 @@
 #ifndef _SPINLOCK_H
 #define _SPINLOCK_H
 
+// ロックの競合の統計
+// 同じ名前のロックはまとめて数える(VM ごとの vm->lock などは 1 つになる)
+struct lock_stat {
+    const char *name;
+    unsigned long acquired;         // ロックを取った回数
+    unsigned long contended;        // 他の CPU が持っていたため待った回数
+    unsigned long spin_ticks;       // 待った時間の合計(CNTPCT のティック数)
+};
+
+// 統計を取るロックの名前の数
+#define NR_LOCK_STATS   32
+
 struct spinlock {
-    unsigned long locked;
+    unsigned int ticket;            // チケットロック(spinlock.S)
     char *name;
-    // todo: もう少し情報を追加して構造体にする
     long cpuid;
+    struct lock_stat *stat;         // 最初にロックを取ったときに name から引く
 };
 
+// 静的に確保するロックの初期値
+#define SPINLOCK_INIT(name) {0, (name), -1, 0}
+
 void init_lock(struct spinlock *lock, char *name);
 void acquire_lock(struct spinlock *lock);
+int try_acquire_lock(struct spinlock *lock);
 void release_lock(struct spinlock *lock);
+int holding_lock(struct spinlock *lock);
+void show_lock_stats(void);
 
 void push_disable_irq();
 void pop_disable_irq();
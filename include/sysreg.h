@@ -0,0 +1,49 @@
+#ifndef _SYSREG_H
+#define _SYSREG_H
+
+// トラップされたシステムレジスタ(MSR/MRS)のエミュレーション
+//   エミュレートするレジスタは SYSREG_LIST に 1 行ずつ並べる
+//   X(name, op0, op1, crn, crm, op2, read, write)
+//     name:  レジスタ名(sysreg_read_saved/sysreg_write_saved を使う場合は struct cpu_sysregs のメンバ名)
+//     read:  MRS のハンドラ(NULL なら読み出しは未対応)
+//     write: MSR のハンドラ(NULL なら書き込みは未対応)
+//   どのレジスタがトラップされるかは sysregs.h の HCR_VALUE で決まる
+#define SYSREG_LIST(X) \
+    X(actlr_el1, 3, 0, 1, 0, 1, sysreg_read_saved, sysreg_write_saved)
+
+// SYSREG_LIST での順番(VM ごとのトラップ回数の添字)
+enum sysreg_id {
+#define SYSREG_ENUM(name, op0, op1, crn, crm, op2, read, write) SYSREG_##name,
+    SYSREG_LIST(SYSREG_ENUM)
+#undef SYSREG_ENUM
+    NR_SYSREGS,
+};
+
+// SYSREG_LIST にないレジスタへのアクセスも数える
+#define SYSREG_UNHANDLED    NR_SYSREGS
+
+struct vm_struct;
+struct sysreg_desc;
+
+// ハンドラ
+//   成功したら 0、ゲストに見せられない値やアクセスなら -1 を返す
+typedef int (*sysreg_read_t)(struct vm_struct *, const struct sysreg_desc *, unsigned long *);
+typedef int (*sysreg_write_t)(struct vm_struct *, const struct sysreg_desc *, unsigned long);
+
+struct sysreg_desc {
+    const char *name;
+    unsigned int enc;           // ESR_EL2.ISS から Rt と Direction を除いたもの
+    unsigned long offset;       // struct cpu_sysregs の同じ名前のメンバの位置
+    sysreg_read_t read;
+    sysreg_write_t write;
+};
+
+// struct cpu_sysregs に保持した値を読み書きするハンドラ
+int sysreg_read_saved(struct vm_struct *, const struct sysreg_desc *, unsigned long *);
+int sysreg_write_saved(struct vm_struct *, const struct sysreg_desc *, unsigned long);
+
+void sysreg_init(void);
+void handle_sysreg_trap(struct vm_struct *vm, unsigned long esr);
+const char *sysreg_name(int id);
+
+#endif
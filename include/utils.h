@@ -23,11 +23,20 @@ extern unsigned long get_ttbr0_el2();
 extern unsigned long get_vttbr_el2();
 extern unsigned long get_cpuid();
 extern unsigned long get_sp();
+extern unsigned long get_cntpct();
+extern unsigned long get_cntfrq();
+
+// データキャッシュ・命令キャッシュの保守操作(アドレスはハイパーバイザの仮想アドレス)
+extern void dcache_clean_range(void *, unsigned long);
+extern void dcache_invalidate_range(void *, unsigned long);
+extern void dcache_flush_range(void *, unsigned long);
+extern void icache_invalidate_all(void);
 
 // Stage2 変換テーブルをセットしてアドレス空間(VTTBR_EL2)を切り替え、つまり IPA -> PA の変換テーブルを切り替える
 //   テーブル自体の準備は VM がロードされた初期化時やメモリアボート時に行う
 // VM ごとにアドレスの上位8ビットが異なるようになっている
 extern void set_stage2_pgd(unsigned long pgd, unsigned long vmid);
+extern void flush_stage2_tlb(unsigned long pgd, unsigned long vmid);
 // x0 が指すメモリアドレスに保存された値を各システムレジスタに復元する
 extern void restore_sysregs(struct cpu_sysregs *);
 // 各システムレジスタの値を取り出し、x0 が指すメモリアドレスに保存する
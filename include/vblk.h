@@ -0,0 +1,28 @@
+#ifndef _VBLK_H
+#define _VBLK_H
+
+#include <stdint.h>
+#include "fat32.h"
+#include "virtq.h"
+
+// 1 回の SD カードへの転送でまとめて扱うブロック数の上限
+#define VBLK_MAX_BLOCKS_PER_IO  128
+
+// FAT32 ボリューム上のイメージファイルをバックエンドにした準仮想ブロックデバイス
+//   リクエストは virtqueue(VIRTQ_DEV_BLOCK)で受け取る
+//   ファイルのサイズは変えずに、その中身を直接読み書きする
+struct vblk_device {
+    struct fat32_file file;
+    uint64_t nr_sectors;                // デバイスの容量(VBLK_SECTOR_SIZE 単位)
+    // ゲストのバッファがブロック境界で区切れていないときに使う
+    // SD カードからの DMA の転送先になるので、キャッシュラインに揃えておく
+    uint8_t bounce[VBLK_SECTOR_SIZE] __attribute__((aligned(64)));
+};
+
+struct vm_struct;
+
+long vblk_attach(struct vm_struct *vm, unsigned long filename_va);
+int vblk_handler(struct vm_struct *vm, struct virtq *vq, struct virtq_req *req);
+void vblk_release(struct vblk_device *blk);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef _VIRQ_H
+#define _VIRQ_H
+
+// VM ごとの仮想割込みコントローラ
+//   割込みソースの番号は BCM2837 の FIQ control で選べる番号に合わせる
+//     0-63:  GPU 割込み(IRQ pending 1/2 のビット)
+//     64-71: ARM 割込み(IRQ basic pending の 0-7 ビット)
+//   デバイスは自分の状態が変わったときに virq_set_level で割込み線のレベルを更新する
+//   ゲストは割込みコントローラのレジスタを通して enabled を操作する
+//   VM に復帰する直前は pending & enabled を見るだけで、デバイスの状態は読み直さない
+#define VIRQ_NR_SOURCES     72
+#define VIRQ_WORDS          ((VIRQ_NR_SOURCES + 63) / 64)
+#define VIRQ_NONE           (-1)
+
+// 割込みソースの番号
+#define VIRQ_SYSTIMER(n)    (n)     // System Timer の比較レジスタ n の一致
+#define VIRQ_AUX            57      // Mini UART(AUX)
+#define VIRQ_ARM_TIMER      64
+#define VIRQ_ARM_MAILBOX    65
+#define VIRQ_DOORBELL0      66
+#define VIRQ_DOORBELL1      67
+
+struct virq_state {
+    // デバイスが割込みを要求しているソース(他のコアからも更新されるのでアトミックに操作する)
+    volatile unsigned long pending[VIRQ_WORDS];
+    // ゲストが有効にしているソース(VM 自身のコアでだけ更新する)
+    volatile unsigned long enabled[VIRQ_WORDS];
+    // FIQ として通知するソース(VIRQ_NONE なら FIQ は使わない)
+    volatile int fiq_source;
+};
+
+struct vm_struct;
+
+void virq_init(struct virq_state *virq);
+void virq_set_level(struct vm_struct *vm, int irq, int level);
+int virq_is_pending(struct vm_struct *vm, int irq);
+unsigned long virq_pending_word(struct vm_struct *vm, int word);
+void virq_enable(struct vm_struct *vm, int word, unsigned long mask);
+void virq_disable(struct vm_struct *vm, int word, unsigned long mask);
+void virq_set_fiq(struct vm_struct *vm, int irq);
+int virq_irq_asserted(struct vm_struct *vm);
+int virq_fiq_asserted(struct vm_struct *vm);
+
+#endif
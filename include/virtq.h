@@ -0,0 +1,145 @@
+#ifndef _VIRTQ_H
+#define _VIRTQ_H
+
+#include <stdint.h>
+
+// virtio の split virtqueue と同じ形式のリングを使った、ゲストとハイパーバイザ間の転送路
+//   ディスクリプタテーブル・available リング・used リングはゲストのメモリ上に置く
+//   ゲストは available リングにリクエストを積んで HYPERCALL_TYPE_VIRTQ_NOTIFY を発行(doorbell)し、
+//   ハイパーバイザは処理したものを used リングに返して仮想割込み(ARM Doorbell 0)で通知する
+// このヘッダはゲストからもインクルードされる
+// ゲストからは VIRTQ_GUEST を定義してインクルードし、ハイパーバイザ側の定義を除く
+
+// ディスクリプタの flags
+#define VIRTQ_DESC_F_NEXT       1   // next が有効
+#define VIRTQ_DESC_F_WRITE      2   // デバイス(ハイパーバイザ)が書き込むバッファ
+
+// available リングの flags
+#define VIRTQ_AVAIL_F_NO_INTERRUPT  1   // used リングを更新しても割込みを発生させない
+
+struct virtq_desc {
+    uint64_t addr;      // バッファの IPA
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct virtq_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+};
+
+struct virtq_used_elem {
+    uint32_t id;        // 処理したディスクリプタチェーンの先頭の番号
+    uint32_t len;       // デバイスが書き込んだバイト数
+};
+
+struct virtq_used {
+    uint16_t flags;
+    uint16_t idx;
+    struct virtq_used_elem ring[];
+};
+
+// デバイスの種類
+#define VIRTQ_DEV_CONSOLE_TX    1   // ゲスト -> コンソール
+#define VIRTQ_DEV_CONSOLE_RX    2   // コンソール -> ゲスト
+#define VIRTQ_DEV_BLOCK         3   // ブロックデバイス(HYPERCALL_TYPE_VBLK_ATTACH で接続したもの)
+
+// ブロックデバイスへのリクエスト(virtio-blk と同じ形式)
+//   読み込み用: ヘッダ(+ 書き込むデータ)
+//   書き込み用: (読み込んだデータ +) 1 バイトのステータス
+#define VBLK_SECTOR_SIZE        512
+
+#define VBLK_T_IN               0   // 読み込み
+#define VBLK_T_OUT              1   // 書き込み
+#define VBLK_T_FLUSH            4   // ライトスルーなので何もしない
+
+#define VBLK_S_OK               0
+#define VBLK_S_IOERR            1
+#define VBLK_S_UNSUPP           2
+
+struct vblk_req_hdr {
+    uint32_t type;      // VBLK_T_*
+    uint32_t reserved;
+    uint64_t sector;    // 512 バイト単位の位置
+};
+
+// 1 VM あたりの virtqueue の数と、1 つの virtqueue のエントリ数の上限
+#define VIRTQ_MAX_QUEUES        8
+#define VIRTQ_MAX_SIZE          256
+
+// HYPERCALL_TYPE_VIRTQ_SETUP の引数
+//   desc, avail, used は IPA で、それぞれページ境界をまたがないように置くこと
+struct virtq_setup {
+    uint32_t index;     // virtqueue の番号(0 ~ VIRTQ_MAX_QUEUES-1)
+    uint32_t type;      // VIRTQ_DEV_*
+    uint32_t num;       // エントリ数(2 のべき乗)
+    uint32_t reserved;
+    uint64_t desc;
+    uint64_t avail;
+    uint64_t used;
+};
+
+#ifndef VIRTQ_GUEST
+
+#include "spinlock.h"
+
+struct vm_struct;
+
+// ディスクリプタチェーンをページ単位に分割した、ハイパーバイザから見たバッファ
+#define VIRTQ_MAX_SEGS          16
+
+struct virtq_seg {
+    char *buf;          // ハイパーバイザからアクセスできるアドレス
+    uint32_t len;
+    int write;          // デバイスが書き込むバッファなら 1
+};
+
+struct virtq_req {
+    uint16_t head;      // チェーンの先頭のディスクリプタ番号
+    int nr_segs;
+    struct virtq_seg segs[VIRTQ_MAX_SEGS];
+};
+
+struct virtq;
+
+// デバイスごとのリクエスト処理関数
+//   req を処理し、書き込んだバイト数を返す
+//   今は処理できない(出力先が一杯など)場合は -1 を返すと、そのリクエストは次回に回される
+typedef int (*virtq_handler_t)(struct vm_struct *, struct virtq *, struct virtq_req *);
+
+struct virtq {
+    uint32_t type;
+    uint32_t num;
+    // ハイパーバイザからアクセスできるアドレス(0 なら未設定)
+    struct virtq_desc *desc;
+    struct virtq_avail *avail;
+    struct virtq_used *used;
+    // 次に処理する available リングの位置
+    uint16_t last_avail_idx;
+    virtq_handler_t handler;
+    void *dev;          // デバイス固有のデータ
+};
+
+struct vblk_device;
+
+struct virtio_state {
+    struct spinlock lock;
+    struct virtq queues[VIRTQ_MAX_QUEUES];
+    struct vblk_device *blk;    // 接続されているブロックデバイス
+    // 処理関数が lock を外した回数(外している間に変わったかもしれない状態を読み直すのに使う)
+    unsigned long unlock_gen;
+};
+
+struct virtio_state *get_virtio_state(struct vm_struct *vm);
+long virtq_setup(struct vm_struct *vm, unsigned long setup_va);
+long virtq_notify(struct vm_struct *vm, unsigned long index);
+void virtio_poll(struct vm_struct *vm);
+void free_virtio_state(struct vm_struct *vm);
+void virtq_unlock_for_io(struct vm_struct *vm);
+void virtq_relock_after_io(struct vm_struct *vm);
+
+#endif
+
+#endif
@@ -19,10 +19,15 @@ struct pt_regs *vm_pt_regs(struct vm_struct *);
 
 int create_idle_vm(unsigned long cpuid);
 int create_vm_with_loader(loader_func_t, void *);
+void destroy_vm(struct vm_struct *);
 
 void init_vm_console(struct vm_struct *);
+void notify_vm_console(struct vm_struct *);
 int is_uart_forwarded_vm(struct vm_struct *);
 void flush_vm_console(struct vm_struct *);
+void clear_vm_console_out(struct vm_struct *);
+long write_vm_console(struct vm_struct *, unsigned long, unsigned long);
+long read_vm_console(struct vm_struct *, unsigned long, unsigned long);
 void increment_current_pc(int);
 
 // PSTATE
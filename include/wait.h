@@ -0,0 +1,26 @@
+#ifndef _WAIT_H
+#define _WAIT_H
+
+#include "spinlock.h"
+
+struct vm_struct;
+
+// 待ち行列
+//   条件が満たされるまで、VM は BLOCKED になって CPU を他の VM に譲る
+//   条件を満たした側が wake_up を呼ぶと、待っている VM がすべて RUNNABLE に戻り、条件を見直す
+//   VM として実行中で、スピンロックを持っていないときだけ眠れる(can_sleep)
+//   眠れない場面(初期化中のハイパーバイザや、スピンロックを持っているとき)は呼び出し側で回って待つこと
+struct wait_queue {
+    struct spinlock lock;
+    struct vm_struct *head;         // 待っている VM(vm_struct.wait_next でつなぐ)
+};
+
+// 待ち行列の lock を取った状態で呼ばれ、待つのをやめてよければ 0 以外を返す
+typedef int (*wait_cond_t)(void *arg);
+
+void init_wait_queue(struct wait_queue *wq, char *name);
+int can_sleep(void);
+void sleep_on(struct wait_queue *wq, wait_cond_t cond, void *arg);
+void wake_up(struct wait_queue *wq);
+
+#endif
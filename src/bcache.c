@@ -0,0 +1,119 @@
+#include "bcache.h"
+#include "mm.h"
+#include "sd.h"
+#include "utils.h"
+#include "debug.h"
+#include "spinlock.h"
+
+// キャッシュしているブロックの情報
+struct bcache_entry {
+    unsigned int lba;
+    int valid;
+    unsigned long last_used;    // LRU で追い出すブロックを決めるための時刻
+    unsigned char *data;
+};
+
+static struct bcache_entry bcache[BCACHE_NUM_BLOCKS];
+static unsigned long bcache_clock;
+// bcache_write のたびに増える世代番号
+// 読み込み中に書き込みがあった場合、読んだ古いデータをキャッシュに入れないために使う
+static unsigned long bcache_write_gen;
+
+// キャッシュの表を守るロック
+// SD カードからの読み込み中は保持しないので、ヒットしたブロックは他のコアの読み込みを待たずに返せる
+static struct spinlock bcache_lock;
+
+void bcache_init() {
+    init_lock(&bcache_lock, "bcache_lock");
+
+    // 1ページに 8 ブロック分を詰めて確保する
+    unsigned char *page = NULL;
+    for (int i = 0; i < BCACHE_NUM_BLOCKS; i++) {
+        if (i % (PAGE_SIZE / BCACHE_BLOCK_SIZE) == 0) {
+            page = (unsigned char *)allocate_page();
+        }
+        bcache[i].lba = 0;
+        bcache[i].valid = 0;
+        bcache[i].last_used = 0;
+        bcache[i].data = page + (i % (PAGE_SIZE / BCACHE_BLOCK_SIZE)) * BCACHE_BLOCK_SIZE;
+    }
+    bcache_clock = 0;
+}
+
+static struct bcache_entry *bcache_lookup(unsigned int lba) {
+    for (int i = 0; i < BCACHE_NUM_BLOCKS; i++) {
+        if (bcache[i].valid && bcache[i].lba == lba) {
+            return &bcache[i];
+        }
+    }
+    return NULL;
+}
+
+// 指定されたブロックを buf(512 バイト)に読み込む
+// キャッシュになければ SD カードから読み込み、一番長く使われていないブロックと入れ替える
+int bcache_read(unsigned int lba, void *buf) {
+    acquire_lock(&bcache_lock);
+    struct bcache_entry *entry = bcache_lookup(lba);
+    if (entry) {
+        memcpy(buf, entry->data, BCACHE_BLOCK_SIZE);
+        entry->last_used = ++bcache_clock;
+        release_lock(&bcache_lock);
+        return 0;
+    }
+    unsigned long gen = bcache_write_gen;
+    release_lock(&bcache_lock);
+
+    if (sd_readblock(lba, buf, 1) == 0) {
+        WARN("failed to read block %d", lba);
+        return -1;
+    }
+
+    acquire_lock(&bcache_lock);
+    if (gen != bcache_write_gen) {
+        // 読み込み中に書き込みがあったので、読んだデータは古いかもしれない
+        release_lock(&bcache_lock);
+        return 0;
+    }
+    // 読み込み中に他のコアが同じブロックを入れているかもしれない
+    entry = bcache_lookup(lba);
+    if (!entry) {
+        entry = &bcache[0];
+        for (int i = 0; i < BCACHE_NUM_BLOCKS; i++) {
+            if (!bcache[i].valid) {
+                entry = &bcache[i];
+                break;
+            }
+            if (bcache[i].last_used < entry->last_used) {
+                entry = &bcache[i];
+            }
+        }
+        memcpy(entry->data, buf, BCACHE_BLOCK_SIZE);
+        entry->lba = lba;
+        entry->valid = 1;
+    }
+    entry->last_used = ++bcache_clock;
+    release_lock(&bcache_lock);
+
+    return 0;
+}
+
+// buf から num ブロックを SD カードに書き込む(ライトスルー)
+// キャッシュしているブロックは書き込んだ内容で更新する
+int bcache_write(unsigned int lba, void *buf, unsigned int num) {
+    if (sd_writeblock(lba, buf, num) == 0) {
+        WARN("failed to write block %d", lba);
+        return -1;
+    }
+
+    acquire_lock(&bcache_lock);
+    bcache_write_gen++;
+    for (unsigned int i = 0; i < num; i++) {
+        struct bcache_entry *entry = bcache_lookup(lba + i);
+        if (entry) {
+            memcpy(entry->data, (unsigned char *)buf + i * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE);
+        }
+    }
+    release_lock(&bcache_lock);
+
+    return 0;
+}
@@ -6,6 +6,8 @@
 #include "fifo.h"
 #include "systimer.h"
 #include "utils.h"
+#include "virq.h"
+#include "spinlock.h"
 #include "peripherals/mini_uart.h"
 #include "peripherals/systimer.h"
 #include "peripherals/irq.h"
@@ -32,13 +34,9 @@ struct bcm2837_state {
     //     70     : Illegal access type-1 interrupt
     //     71     : Illegal access type-0 interrupt
     //     72-127 : Do Not Use
+    // 割込みの有効・保留の状態は vm->virq に持つ(ソースの番号は FIQ の番号と同じ)
     struct intctrl_regs {
-        // Arm peripherals interrupt table(IRQ 0-64, Timer, Mailbox...)
-        uint8_t irq_enabled[72];
         uint8_t fiq_control;
-        uint8_t irqs_1_enabled;
-        uint8_t irqs_2_enabled;
-        uint8_t basic_irqs_enabled;
     } intctrl;
 
     // todo: ローカルペリフェラルの仮想化のための構造体
@@ -65,6 +63,9 @@ struct bcm2837_state {
         uint8_t  aux_mu_scratch;
         uint8_t  aux_mu_cntl;
         uint16_t aux_mu_baud;
+        // aux_mu_ier とコンソールの FIFO から割込み線のレベルを決めて更新する間に取る
+        // FIFO は UART 割込み(コア 0)や他のコアからも操作されるので、古いレベルで上書きしないようにする
+        struct spinlock irq_lock;
     } aux;
 
     // BCM2837-ARM-Peripherals.-.Revised.-.V2-1.pdf
@@ -161,9 +162,6 @@ struct bcm2837_state {
 const struct bcm2837_state initial_state = {
     .intctrl = {
         .fiq_control         = 0x0,
-        .irqs_1_enabled       = 0x0,
-        .irqs_2_enabled       = 0x0,
-        .basic_irqs_enabled   = 0x0,
     },
     .aux = {
         // fifo の初期化は bcm2837_initialize で行う
@@ -196,6 +194,7 @@ static void bcm2837_initialize(struct vm_struct *vm) {
     struct bcm2837_state *state = (struct bcm2837_state *)allocate_page();
 
     *state = initial_state;
+    init_lock(&state->aux.irq_lock, "aux_irq");
 
     state->systimer.last_physical_count = get_physical_systimer_count();
 
@@ -239,48 +238,38 @@ static void bcm2837_initialize(struct vm_struct *vm) {
 // GPU pending 2 register (IRQ pending register?)
 //   [31:0] IRQ pending source 63:32 (See IRQ table above)
 
-static unsigned long handle_aux_read(struct vm_struct *vm, unsigned long addr);
-#define BIT(v, n) ((v) & (1 << (n)))
 static unsigned long handle_intctrl_read(struct vm_struct *vm, unsigned long addr) {
     struct bcm2837_state *state = (struct bcm2837_state *)vm->board_data;
+    // GPU 割込み 0-63 は 0 番目のワード、ARM 割込みは 1 番目のワードの下位 8 ビット
+    unsigned long gpu_pending = virq_pending_word(vm, 0);
 
     switch (addr) {
     case IRQ_BASIC_PENDING: {
-        // todo: 8,9 ビット目以外のフィールドの実装が必要
-        int pending1 = handle_intctrl_read(vm, IRQ_PENDING_1) != 0;
-        int pending2 = handle_intctrl_read(vm, IRQ_PENDING_2) != 0;
+        // todo: 10~20 ビット目(GPU 割込みのショートカット)の実装が必要
+        // 準仮想デバイスからの割込みは ARM Doorbell 0、共有メモリの相手からの通知は Doorbell 1 として見える
         // todo: ゲスト向けに mailbox を仮想化する
-        return (pending1 << 8) | (pending2 << 9);
-    }
-    case IRQ_PENDING_1: {
-        unsigned long systimer_match1 =
-            BIT(state->intctrl.irqs_1_enabled, 1) && (state->systimer.cs & TIMER_CS_M1);
-        unsigned long systimer_match3 =
-            BIT(state->intctrl.irqs_1_enabled, 3) && (state->systimer.cs & TIMER_CS_M3);
-        return (systimer_match1 << 1) | (systimer_match3 << 3);
-    }
-    case IRQ_PENDING_2: {
-        // IRQ 64個あるがは32ビットずつに分けてある
-        // UART の irq 番号は 57 なので、後半は 57-32 ビットに対応
-        // AUXIRQ レジスタの0ビット目が UART
-        unsigned long uart_int =
-            BIT(state->intctrl.irqs_1_enabled, (57 - 32)) && (handle_aux_read(vm, AUX_IRQ) &  0x01);
-        return (uart_int << (57 - 32));
-    }
+        int pending1 = (gpu_pending & 0xffffffff) != 0;
+        int pending2 = (gpu_pending >> 32) != 0;
+        return (virq_pending_word(vm, 1) & 0xff) | (pending1 << 8) | (pending2 << 9);
+    }
+    case IRQ_PENDING_1:
+        return gpu_pending & 0xffffffff;
+    case IRQ_PENDING_2:
+        return gpu_pending >> 32;
     case FIQ_CONTROL:
         return state->intctrl.fiq_control;
     case ENABLE_IRQS_1:
-        return state->intctrl.irqs_1_enabled;
+        return vm->virq.enabled[0] & 0xffffffff;
     case ENABLE_IRQS_2:
-        return state->intctrl.irqs_2_enabled;
+        return vm->virq.enabled[0] >> 32;
     case ENABLE_BASIC_IRQS:
-        return state->intctrl.basic_irqs_enabled;
+        return vm->virq.enabled[1] & 0xff;
     case DISABLE_IRQS_1:
-        return ~state->intctrl.irqs_1_enabled;
+        return ~vm->virq.enabled[0] & 0xffffffff;
     case DISABLE_IRQS_2:
-        return ~state->intctrl.irqs_2_enabled;
+        return ~vm->virq.enabled[0] >> 32;
     case DISABLE_BASIC_IRQS:
-        return ~state->intctrl.basic_irqs_enabled;
+        return ~vm->virq.enabled[1] & 0xff;
     }
 
     return 0;
@@ -293,30 +282,56 @@ static void handle_intctrl_write(struct vm_struct *vm, unsigned long addr, unsig
     switch (addr) {
     case FIQ_CONTROL:
         state->intctrl.fiq_control = val;
+        virq_set_fiq(vm, (val & 0x80) ? (int)(val & 0x7f) : VIRQ_NONE);
         break;
     case ENABLE_IRQS_1:
-        state->intctrl.irqs_1_enabled |= val;
+        virq_enable(vm, 0, val & 0xffffffff);
         break;
     case ENABLE_IRQS_2:
-        state->intctrl.irqs_2_enabled |= val;
+        virq_enable(vm, 0, (val & 0xffffffff) << 32);
         break;
     case ENABLE_BASIC_IRQS:
-        state->intctrl.basic_irqs_enabled |= val;
+        virq_enable(vm, 1, val & 0xff);
         break;
     case DISABLE_IRQS_1:
-        state->intctrl.irqs_1_enabled &= ~val;
+        virq_disable(vm, 0, val & 0xffffffff);
         break;
     case DISABLE_IRQS_2:
-        state->intctrl.irqs_2_enabled &= ~val;
+        virq_disable(vm, 0, (val & 0xffffffff) << 32);
         break;
     case DISABLE_BASIC_IRQS:
-        state->intctrl.basic_irqs_enabled &= ~val;
+        virq_disable(vm, 1, val & 0xff);
         break;
     }
 }
 
 #define LCR_DLAB 0x80
 
+// AUX_MU_IIR_REG の Interrupt ID(0: 割込みなし, 1: 送信 FIFO が空, 2: 受信データあり)
+static int aux_mu_int_id(struct vm_struct *vm) {
+    struct bcm2837_state *state = (struct bcm2837_state *)vm->board_data;
+
+    int tx_int = (state->aux.aux_mu_ier & 0x2) && is_empty_fifo(vm->console.out_fifo);
+    int rx_int = (state->aux.aux_mu_ier & 0x1) && !is_empty_fifo(vm->console.in_fifo);
+    int int_id = (tx_int << 0) | (rx_int << 1);
+    if (int_id == 0x3) {
+        // 仕様上 tx/rx の両方の割込みありで返すことはないので tx だけ割込みありとする
+        int_id = 0x1;
+    }
+    return int_id;
+}
+
+// Mini UART の割込み線(VIRQ_AUX)のレベルを、今のレジスタとコンソールの FIFO の状態に合わせる
+// ゲストが UART のレジスタを操作したときと、コンソールの FIFO が変わったとき(bcm2837_console_updated)に呼ぶ
+static void update_aux_irq(struct vm_struct *vm) {
+    struct bcm2837_state *state = (struct bcm2837_state *)vm->board_data;
+
+    acquire_lock(&state->aux.irq_lock);
+    int level = (state->aux.aux_enables & 0x1) && aux_mu_int_id(vm) != 0;
+    virq_set_level(vm, VIRQ_AUX, level);
+    release_lock(&state->aux.irq_lock);
+}
+
 static unsigned long handle_aux_read(struct vm_struct *vm, unsigned long addr) {
     struct bcm2837_state *state = (struct bcm2837_state *)vm->board_data;
 
@@ -331,12 +346,9 @@ static unsigned long handle_aux_read(struct vm_struct *vm, unsigned long addr) {
     }
 
     switch (addr) {
-    case AUX_IRQ: {
+    case AUX_IRQ:
         // 0 ビット目の UART だけ設定。1,2ビット目の SPI1,2 は未実装
-        int mu_pending = (state->aux.aux_enables & 0x1) &&
-                          ~(handle_aux_read(vm, AUX_MU_IIR_REG) & 0x1);
-        return mu_pending;
-    }
+        return aux_mu_int_id(vm) != 0;
     case AUX_ENABLES:
         return state->aux.aux_enables;
     case AUX_MU_IO_REG:
@@ -347,8 +359,9 @@ static unsigned long handle_aux_read(struct vm_struct *vm, unsigned long addr) {
             return state->aux.aux_mu_baud & 0xff;
         }
         else {
-            unsigned long data;
+            unsigned long data = 0;
             dequeue_fifo(vm->console.in_fifo, &data);
+            update_aux_irq(vm);
             return data & 0xff;
         }
     case AUX_MU_IER_REG:
@@ -360,13 +373,7 @@ static unsigned long handle_aux_read(struct vm_struct *vm, unsigned long addr) {
             return state->aux.aux_mu_ier;
         }
     case AUX_MU_IIR_REG: {
-        int tx_int = (state->aux.aux_mu_ier & 0x2) && is_empty_fifo(vm->console.out_fifo);
-        int rx_int = (state->aux.aux_mu_ier & 0x1) && !is_empty_fifo(vm->console.in_fifo);
-        int int_id = (tx_int << 0) | (rx_int << 1);
-        if (int_id == 0x3) {
-            // 仕様上 tx/rx の両方の割込みありで返すことはないので tx だけ割込みありとする
-            int_id = 0x1;
-        }
+        int int_id = aux_mu_int_id(vm);
         // 0x3 << 6 なので IIR[7:6] FIFO enables は常に有効 
         return (!int_id) | (int_id << 1) | (0x3 << 6);
     }
@@ -431,6 +438,7 @@ static void handle_aux_write(struct vm_struct *vm, unsigned long addr, unsigned
     if ((state->aux.aux_enables & 0x1) == 0) {
         if (addr == AUX_ENABLES) {
             state->aux.aux_enables = val;
+            update_aux_irq(vm);
         }
 
         return;
@@ -467,7 +475,7 @@ static void handle_aux_write(struct vm_struct *vm, unsigned long addr, unsigned
             clear_fifo(vm->console.in_fifo);
         }
         if (val & 0x4) {
-            clear_fifo(vm->console.out_fifo);
+            clear_vm_console_out(vm);
         }
         break;
     case AUX_MU_LCR_REG:
@@ -486,6 +494,9 @@ static void handle_aux_write(struct vm_struct *vm, unsigned long addr, unsigned
         state->aux.aux_mu_baud = val;
         break;
     }
+
+    // 送信データ・割込みの有効化・FIFO のクリアで割込みの状態が変わる
+    update_aux_irq(vm);
 }
 
 // virtual count は、実際に VM が動いている間に進んだ時間(カウント数)を表す
@@ -493,6 +504,14 @@ static void handle_aux_write(struct vm_struct *vm, unsigned long addr, unsigned
 // physical count は、VM が動いていない間の時間も含めた時間(カウント数)を表す
 #define TO_PHYSICAL_COUNT(s, v) (v + (s)->systimer.offset)
 
+// System Timer の割込み線のレベルを CS レジスタに合わせる
+// 比較レジスタ 0 と 2 は GPU が使うので、ゲストには 1 と 3 だけを見せる
+static void update_systimer_irq(struct vm_struct *vm) {
+    struct bcm2837_state *state = (struct bcm2837_state *)vm->board_data;
+    virq_set_level(vm, VIRQ_SYSTIMER(1), state->systimer.cs & TIMER_CS_M1);
+    virq_set_level(vm, VIRQ_SYSTIMER(3), state->systimer.cs & TIMER_CS_M3);
+}
+
 // VM からタイマカウントを読み取る(VM が実際に実行された時間だけを返す)
 static unsigned long handle_systimer_read(struct vm_struct *vm, unsigned long addr) {
     struct bcm2837_state *state = (struct bcm2837_state *)vm->board_data;
@@ -531,6 +550,7 @@ static void handle_systimer_write(struct vm_struct *vm, unsigned long addr, unsi
     case TIMER_CS:
         // クリアしたいビットに1をセットするとクリアされるとドキュメントに書かれているため、正しい
         state->systimer.cs &= ~val;
+        update_systimer_irq(vm);
         break;
     case TIMER_C0:
         // 比較値をセットしたとき、次の tick までの残り時間を expire に保持しておく
@@ -644,7 +664,10 @@ void bcm2837_entering_vm(struct vm_struct *vm) {
     // (~state->systimer.cs) & matched: 今回始めて発火したタイマのビットが立っている
     // todo: 結局 or を取っているだけでは？
     int fired = (~state->systimer.cs) & matched;
-    state->systimer.cs |= fired;
+    if (fired) {
+        state->systimer.cs |= fired;
+        update_systimer_irq(vm);
+    }
 }
 
 // VM での処理を抜けてハイパーバイザに処理に入るときに呼ばれる
@@ -654,33 +677,9 @@ void bcm2837_leaving_vm(struct vm_struct *vm) {
     state->systimer.last_physical_count = get_physical_systimer_count();
 }
 
-static int bcm2837_is_irq_asserted(struct vm_struct *vm) {
-    return handle_intctrl_read(vm, IRQ_BASIC_PENDING) != 0;
-}
-
-static int bcm2837_is_fiq_asserted(struct vm_struct *vm) {
-    struct bcm2837_state *state = (struct bcm2837_state *)vm->board_data;
-
-    // FIQ が有効でない場合は常に 0 を返す
-    if ((state->intctrl.fiq_control & 0x80) == 0) {
-        return 0;
-    }
-
-    int source = state->intctrl.fiq_control & 0x7f;
-    if (0 <= source && source <= 31) {
-        int pending = handle_intctrl_read(vm, IRQ_PENDING_1);
-        return (pending & (1 << source)) != 0;
-    }
-    else if (32 <= source && source <=63) {
-        int pending = handle_intctrl_read(vm, IRQ_PENDING_2);
-        return (pending & (1 << (source - 32))) != 0;
-    }
-    else if (64 <= source && source <= 71) {
-        int pending = handle_intctrl_read(vm, IRQ_BASIC_PENDING);
-        return (pending & (1 << (source - 64))) != 0;
-    }
-
-    return 0;
+// コンソールの FIFO が UART 割込みや他のコアから操作されたときに呼ばれる
+static void bcm2837_console_updated(struct vm_struct *vm) {
+    update_aux_irq(vm);
 }
 
 void bcm2837_debug(struct vm_struct *vm) {
@@ -692,7 +691,6 @@ const struct board_ops bcm2837_board_ops = {
     .mmio_write = bcm2837_mmio_write,
     .entering_vm = bcm2837_entering_vm,
     .leaving_vm = bcm2837_leaving_vm,
-    .is_irq_asserted = bcm2837_is_irq_asserted,
-    .is_fiq_asserted = bcm2837_is_fiq_asserted,
+    .console_updated = bcm2837_console_updated,
     .debug = bcm2837_debug,
 };
@@ -11,6 +11,9 @@ void init_cpu_core_struct(unsigned long cpuid) {
     cpu_cores[cpuid].id = cpuid;
     cpu_cores[cpuid].number_of_off = 0;
     cpu_cores[cpuid].interrupt_enable = 0;
+    cpu_cores[cpuid].start_ticks = get_cntpct();
+    cpu_cores[cpuid].guest_ticks = 0;
+    cpu_cores[cpuid].idle_ticks = 0;
 }
 
 struct cpu_core_struct *current_cpu_core() {
@@ -0,0 +1,61 @@
+#include "dma.h"
+#include "peripherals/dma.h"
+#include "utils.h"
+#include "delays.h"
+
+// DMA チャネルを使える状態にする
+// GPU のファームウェアも一部のチャネルを使っているので、空いているチャネルを選んで使うこと
+void dma_init_channel(int ch) {
+    put32(DMA_ENABLE, get32(DMA_ENABLE) | (1 << ch));
+    put32(DMA_CS(ch), DMA_CS_RESET);
+    wait_cycles(150);
+    put32(DMA_CS(ch), DMA_CS_END | DMA_CS_INT);
+    put32(DMA_DEBUG(ch), DMA_DEBUG_ERROR_MASK);
+}
+
+// コントロールブロックを設定して転送を開始する
+// 完了は dma_is_done でポーリングするか、TI_INTEN を立てて割込みで待つ
+void dma_start(int ch, struct dma_control_block *cb) {
+    // 前回の完了・エラー状態を消しておく
+    put32(DMA_CS(ch), DMA_CS_END | DMA_CS_INT);
+    put32(DMA_DEBUG(ch), DMA_DEBUG_ERROR_MASK);
+
+    // DMA はキャッシュを見ないので、コントロールブロックをメモリに書き出しておく
+    dcache_clean_range(cb, sizeof(*cb));
+    put32(DMA_CONBLK_AD(ch), dma_bus_addr_memory(cb));
+    put32(DMA_CS(ch), DMA_CS_ACTIVE | DMA_CS_WAIT_FOR_OUTSTANDING_WRITES |
+                      DMA_CS_PRIORITY(8) | DMA_CS_PANIC_PRIORITY(15));
+}
+
+int dma_is_done(int ch) {
+    return (get32(DMA_CS(ch)) & DMA_CS_END) != 0;
+}
+
+int dma_has_error(int ch) {
+    return (get32(DMA_CS(ch)) & DMA_CS_ERROR) ||
+           (get32(DMA_DEBUG(ch)) & DMA_DEBUG_ERROR_MASK);
+}
+
+// 完了フラグと割込みをクリアする
+void dma_clear(int ch) {
+    put32(DMA_CS(ch), DMA_CS_END | DMA_CS_INT);
+}
+
+// 実行中の転送を中断してチャネルをリセットする
+void dma_abort(int ch) {
+    put32(DMA_CS(ch), DMA_CS_ABORT);
+    wait_cycles(150);
+    put32(DMA_CS(ch), DMA_CS_RESET);
+    wait_cycles(150);
+    put32(DMA_CS(ch), DMA_CS_END | DMA_CS_INT);
+    put32(DMA_DEBUG(ch), DMA_DEBUG_ERROR_MASK);
+}
+
+// ARM から見た物理アドレスを DMA から見たバスアドレスに変換する
+unsigned int dma_bus_addr_memory(void *addr) {
+    return (unsigned int)((unsigned long)addr - VA_START) | DMA_MEMORY_BUS_BASE;
+}
+
+unsigned int dma_bus_addr_peripheral(unsigned long addr) {
+    return (unsigned int)(addr - PBASE) + DMA_PERIPHERAL_BUS_BASE;
+}
@@ -1,4 +1,5 @@
 #include "sd.h"
+#include "bcache.h"
 #include "mm.h"
 #include "debug.h"
 #include "utils.h"
@@ -25,8 +26,9 @@
 //   ファイルが大きい場合は、複数のクラスタを使ってひとつのファイルを表すようになっている
 //   https://zenn.dev/hidenori3/articles/3ce349c02e79fa
 
-#define FAT32_MAX_FILENAME_LEN  255
 #define BLOCKSIZE               512
+// 1回の SD カードへの要求でまとめて読むブロック数の上限
+#define FAT32_MAX_BLOCKS_PER_READ   256
 
 // DIR_attribute
 #define ATTR_READ_ONLY   0x01
@@ -107,7 +109,7 @@ struct fat32_lfnentry {
 // 空きページを確保して、指定された LBA から 1ブロック分のデータを読み込む
 static uint8_t *alloc_and_readblock(unsigned int lba) {
     uint8_t *buf = (uint8_t *)allocate_page();
-    if (sd_readblock(lba, buf, 1) < 0) {
+    if (sd_readblock(lba, buf, 1) == 0) {
         PANIC("sd_readblock() failed.");
     }
     return buf;
@@ -137,10 +139,14 @@ static void fat32_file_init(struct fat32_fs *fat32, struct fat32_file *fatfile,
     fatfile->attr = attr;
     fatfile->size = size;
     fatfile->cluster = cluster;
+    fatfile->extents = NULL;
+    fatfile->nr_extents = 0;
+    fatfile->nr_clusters = 0;
+    fatfile->extents_truncated = 0;
 }
 
 // ストレージから先頭の1ブロック(BPB)を読み込み、ルートディレクトリのエントリを初期化する
-int fat32_get_handle(struct fat32_fs *fat32) {
+static int fat32_read_bpb(struct fat32_fs *fat32) {
     // 先頭の BPB を含むブロック(セクタ)をメモリ上に読み込む
     uint8_t *bbuf = alloc_and_readblock(0);
 
@@ -148,11 +154,13 @@ int fat32_get_handle(struct fat32_fs *fat32) {
 
     if (mbr->bootsig[0] != 0x55 || mbr->bootsig[1] != 0xaa) {
         WARN("invalid boot signature in MBR");
+        free_page(bbuf);
         return -1;
     }
 
     if (mbr->partitiontable[0].type != 0x0c) {
         WARN("not a FAT32 partition");
+        free_page(bbuf);
         return -1;
     }
 
@@ -202,63 +210,114 @@ int fat32_get_handle(struct fat32_fs *fat32) {
     return 0;
 }
 
-// ファイルシステム fs の index 番目の FAT エントリを読み込む
-static uint32_t fatentry_read(struct fat32_fs *fat32, uint32_t index) {
-    struct fat32_boot *boot = &fat32->boot;
-    // FAT 領域も当然セクタで管理されているので、読みたい FAT エントリが入っているセクタを計算する
-    // FAT32 ではエントリ1つが4バイトなので、セクタあたりのバイト数で割ることで
-    // FAT 領域内のどのセクタに入っているかを計算できる
-    // そこに FAT 領域自体が入っているセクタ数(fatstart)を足すことで読み込むべきセクタ番号がわかる
-    uint32_t sector = fat32->fatstart + (index * 4 / boot->BPB_BytsPerSec);
-    // 見つけたセクタ内でのエントリの位置は、上記の計算式の剰余
-    uint32_t offset = index * 4 % boot->BPB_BytsPerSec;
-
-    // まずストレージからセクタを1つ分読み取る
-    uint8_t *bbuf = alloc_and_readblock(sector + fat32->volume_first);
-    // セクタ内のオフセットを考慮し、狙ったエントリを読み取る
-    // ただし FAT32 では上位4ビットは予約されており 0 にする必要があるので 0x0fffffff でマスクする
-    uint32_t entry = *((uint32_t *)(bbuf + offset)) & 0x0fffffff;
-    free_page(bbuf);
-    return entry;
+// FAT のセクタを1つだけ手元に置きながらクラスタチェインをたどるためのカーソル
+// 同じセクタに入っている FAT エントリを続けて読むときに SD カードを読み直さずに済む
+struct fat32_fat_cursor {
+    struct fat32_fs *fat32;
+    uint8_t *buf;
+    uint32_t sector;                // buf に読み込んであるセクタ(FAT 領域内のオフセット)
+};
+
+static void fat_cursor_init(struct fat32_fat_cursor *cur, struct fat32_fs *fat32) {
+    cur->fat32 = fat32;
+    cur->buf = NULL;
+    cur->sector = 0;
 }
 
-// クラスタのリンクリストをたどって、指定されたオフセット位置に対応するクラスタ番号を返す
-static uint32_t walk_cluster_chain(struct fat32_fs *fat32, uint32_t offset, uint32_t cluster) {
-    // オフセット位置が何クラスタ目にあるか(何回クラスタをたどらなくてはいけないか)を計算
-    int clusters_to_traverse =
-        offset / (fat32->boot.BPB_SecPerClus * fat32->boot.BPB_BytsPerSec);
+static void fat_cursor_release(struct fat32_fat_cursor *cur) {
+    if (cur->buf) {
+        free_page(cur->buf);
+        cur->buf = NULL;
+    }
+}
 
+// cluster の次のクラスタ番号を返す(読み込みに失敗したら BAD_CLUSTER)
+static uint32_t fat_cursor_next(struct fat32_fat_cursor *cur, uint32_t cluster) {
+    struct fat32_fs *fat32 = cur->fat32;
     struct fat32_boot *boot = &fat32->boot;
-    uint8_t *bbuf = NULL;
-    uint32_t prevsector = 0;
-
-    for (int i = 0; i < clusters_to_traverse; i++) {
-        // 今見ているクラスタの FAT エントリが含まれるクラスタ番号と、その中でのオフセットを計算
-        uint32_t sector = fat32->fatstart + (cluster * 4 / boot->BPB_BytsPerSec);
-        uint32_t offset = cluster * 4 % boot->BPB_BytsPerSec;
-
-        if (prevsector != sector) {
-            // 直前に見ていたセクタと異なる場合は、新たにセクタを読み込む
-            if (bbuf) {
-                free_page(bbuf);
-            }
-            bbuf = alloc_and_readblock(sector + fat32->volume_first);
+    // 今見ているクラスタの FAT エントリが含まれるセクタ番号と、その中でのオフセットを計算
+    uint32_t sector = fat32->fatstart + (cluster * 4 / boot->BPB_BytsPerSec);
+    uint32_t offset = cluster * 4 % boot->BPB_BytsPerSec;
+
+    if (!cur->buf || cur->sector != sector) {
+        // 手元にあるセクタと異なる場合は、新たにセクタを読み込む
+        if (!cur->buf) {
+            cur->buf = (uint8_t *)allocate_page();
+        }
+        if (bcache_read(sector + fat32->volume_first, cur->buf) < 0) {
+            return BAD_CLUSTER;
         }
+        cur->sector = sector;
+    }
+    return *((uint32_t *)(cur->buf + offset)) & 0x0fffffff;
+}
+
+// クラスタのリンクリストを cluster から count 回たどった先のクラスタ番号を返す
+static uint32_t walk_cluster_chain(struct fat32_fs *fat32, uint32_t cluster, uint32_t count) {
+    struct fat32_fat_cursor cur;
+    fat_cursor_init(&cur, fat32);
 
-        // 次のクラスタ番号を取得
-        cluster = *((uint32_t *)(bbuf + offset)) & 0x0fffffff;
+    for (uint32_t i = 0; i < count; i++) {
+        cluster = fat_cursor_next(&cur, cluster);
         if (!is_active_cluster(cluster)) {
             cluster = BAD_CLUSTER;
-            goto exit;
+            break;
         }
     }
-exit:
-    if (bbuf) {
-        free_page(bbuf);
-    }
+
+    fat_cursor_release(&cur);
     return cluster;
 }
 
+// ファイルのクラスタチェインを一度だけたどって、連続したクラスタの並び(エクステント)の表を作る
+// 以降のオフセットからブロック番号への変換は FAT を読まずに表の二分探索で済む
+static int fat32_build_extents(struct fat32_file *fatfile) {
+    if (fatfile->extents) {
+        return 0;
+    }
+    if (!is_active_cluster(fatfile->cluster)) {
+        // サイズ 0 のファイルなどはクラスタを持たない
+        return -1;
+    }
+
+    struct fat32_extent *extents = (struct fat32_extent *)allocate_page();
+    struct fat32_fat_cursor cur;
+    fat_cursor_init(&cur, fatfile->fat32);
+
+    uint32_t cluster = fatfile->cluster;
+    uint32_t nr_extents = 1;
+    uint32_t index = 1;
+    extents[0].file_cluster = 0;
+    extents[0].disk_cluster = cluster;
+
+    while (1) {
+        uint32_t next = fat_cursor_next(&cur, cluster);
+        if (!is_active_cluster(next)) {
+            break;
+        }
+        if (next != cluster + 1) {
+            // 不連続になったところで新しいエクステントを始める
+            if (nr_extents == FAT32_MAX_EXTENTS) {
+                // 表があふれた場合、ここから先は必要になったときに FAT をたどる
+                fatfile->extents_truncated = 1;
+                break;
+            }
+            extents[nr_extents].file_cluster = index;
+            extents[nr_extents].disk_cluster = next;
+            nr_extents++;
+        }
+        cluster = next;
+        index++;
+    }
+
+    fat_cursor_release(&cur);
+
+    fatfile->extents = extents;
+    fatfile->nr_extents = nr_extents;
+    fatfile->nr_clusters = index;
+    return 0;
+}
+
 // クラスタ番号を受け取り、セクタ番号(ストレージ上の物理アドレス)を返す
 // クラスタ番号とセクタ番号は線形に対応しているので単純な計算式になる
 // (ファイルは複数の不連続なクラスタにまたがって作られる)
@@ -404,7 +463,8 @@ static uint32_t fat32_firstblk(struct fat32_fs *fat32, uint32_t cluster, size_t
 
 // 次のブロック(セクタ)番号を返す
 // 次のクラスタに続く場合は、そのクラスタの最初のブロック(セクタ)番号を返す
-static int fat32_nextblk(struct fat32_fs *fat32, int prevblk, uint32_t *cluster) {
+static int fat32_nextblk(struct fat32_fat_cursor *cur, int prevblk, uint32_t *cluster) {
+  struct fat32_fs *fat32 = cur->fat32;
   uint32_t secs_per_clus = fat32->boot.BPB_SecPerClus;
   if (prevblk % secs_per_clus != secs_per_clus - 1) {
       // prevblk がクラスタ内の最後のブロック(セクタ)でない場合は、次のブロック(セクタ)番号を返す
@@ -413,30 +473,128 @@ static int fat32_nextblk(struct fat32_fs *fat32, int prevblk, uint32_t *cluster)
     // クラスタをまたぐときは、次のクラスタを cluster 変数に読み込み
     // そして、そのクラスタの最初のブロック(セクタ)番号を返す
     // go over a cluster boundary
-    *cluster = fatentry_read(fat32, *cluster);
+    *cluster = fat_cursor_next(cur, *cluster);
     return fat32_firstblk(fat32, *cluster, 0);
   }
 }
 
-// 指定されたディレクトリ(fatfile)ないから特定のファイル名(name)を探す
-// 子ディレクトリに対して再帰的に探索することはしない
-static int fat32_lookup_main(struct fat32_file *fatfile, const char *name,
-                             struct fat32_file *found) {
+// ファイル内のオフセット file_off を含むブロック(セクタ)番号を返す
+// *contig には、そのブロックからディスク上で連続して読めるブロック数を入れる
+static int fat32_file_block(struct fat32_file *fatfile, uint32_t file_off, uint32_t *contig) {
     struct fat32_fs *fat32 = fatfile->fat32;
-    // fatfile がディレクトリでない場合はエラー終了
-    if (!(fatfile->attr & ATTR_DIRECTORY)) {
+    uint32_t secs_per_clus = fat32->boot.BPB_SecPerClus;
+
+    if (fat32_build_extents(fatfile) < 0) {
+        return -1;
+    }
+
+    uint32_t clus_index = file_off / (secs_per_clus * BLOCKSIZE);
+    uint32_t inclus_blk = file_off % (secs_per_clus * BLOCKSIZE) / BLOCKSIZE;
+    uint32_t disk_cluster, run;
+
+    if (clus_index < fatfile->nr_clusters) {
+        // file_cluster <= clus_index となる最後のエクステントを二分探索する
+        struct fat32_extent *extents = fatfile->extents;
+        uint32_t lo = 0, hi = fatfile->nr_extents - 1;
+        while (lo < hi) {
+            uint32_t mid = (lo + hi + 1) / 2;
+            if (extents[mid].file_cluster <= clus_index) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        uint32_t end = lo + 1 < fatfile->nr_extents ? extents[lo + 1].file_cluster : fatfile->nr_clusters;
+        disk_cluster = extents[lo].disk_cluster + (clus_index - extents[lo].file_cluster);
+        run = end - clus_index;
+    }
+    else if (fatfile->extents_truncated) {
+        // 表に入り切らなかった部分は、表の最後のクラスタから FAT をたどる
+        struct fat32_extent *last = &fatfile->extents[fatfile->nr_extents - 1];
+        uint32_t last_cluster = last->disk_cluster + (fatfile->nr_clusters - 1 - last->file_cluster);
+        disk_cluster = walk_cluster_chain(fat32, last_cluster, clus_index - (fatfile->nr_clusters - 1));
+        if (!is_active_cluster(disk_cluster)) {
+            return -1;
+        }
+        run = 1;
+    }
+    else {
         return -1;
     }
 
+    *contig = run * secs_per_clus - inclus_blk;
+    return cluster_to_sector(fat32, disk_cluster) + inclus_blk;
+}
+
+// ファイル名のハッシュ値(FNV-1a)
+static uint32_t fat32_name_hash(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// 長さ len の name と、ヌル終端された dent_name が一致するかを返す
+static int fat32_name_equal(const char *dent_name, const char *name, size_t len) {
+    return strncmp(dent_name, name, len) == 0 && dent_name[len] == '\0';
+}
+
+// ディレクトリエントリのキャッシュにエントリを追加する
+// エントリはページから切り出して使い、ファイルシステムが生きている間は解放しない
+static void fat32_dircache_insert(struct fat32_fs *fat32, struct fat32_dircache *cache,
+                                  const char *name, struct fat32_direntry *dent, uint32_t cluster) {
+    if (!fat32->dent_pool || fat32->dent_pool_used + sizeof(struct fat32_cached_dent) > PAGE_SIZE) {
+        fat32->dent_pool = (uint8_t *)allocate_page();
+        fat32->dent_pool_used = 0;
+    }
+    struct fat32_cached_dent *cdent = (struct fat32_cached_dent *)(fat32->dent_pool + fat32->dent_pool_used);
+    fat32->dent_pool_used += sizeof(struct fat32_cached_dent);
+
+    size_t len = strnlen(name, FAT32_MAX_FILENAME_LEN);
+    strncpy(cdent->name, name, len);
+    cdent->name[len] = '\0';
+    cdent->hash = fat32_name_hash(name, len);
+    cdent->attr = dent->DIR_Attr;
+    cdent->size = dent->DIR_FileSize;
+    cdent->cluster = cluster;
+
+    uint32_t bucket = cdent->hash % FAT32_DIRCACHE_BUCKETS;
+    cdent->next = cache->buckets[bucket];
+    cache->buckets[bucket] = cdent;
+}
+
+// 指定されたディレクトリ(dir)のエントリを先頭から順に見ていく
+// 子ディレクトリに対して再帰的に探索することはしない
+//   cache が指定されていれば、すべてのエントリをキャッシュに登録する
+//   name が指定されていれば、名前が一致したエントリを found に入れて 0 を返す
+//   見つからなければ -1、ディレクトリを読み切れなかった場合は -2 を返す
+// get_lfn/get_sfn がスタティック変数を使うので、fat32->lock を取った状態で呼ぶこと
+static int fat32_scan_dir(struct fat32_file *dir, struct fat32_dircache *cache,
+                          const char *name, size_t namelen, struct fat32_file *found) {
+    struct fat32_fs *fat32 = dir->fat32;
+    int ret = -1;
+
+    // 1ページを前半と後半に分け、今読んでいるブロックと直前のブロックを交互に置く
+    uint8_t *page = (uint8_t *)allocate_page();
+    if (!page) {
+        return -2;
+    }
     uint8_t *prevbuf = NULL;
-    uint8_t *bbuf = NULL;
-    uint32_t current_cluster = fatfile->cluster;
+    uint8_t *bbuf = page;
+    uint32_t current_cluster = dir->cluster;
+    struct fat32_fat_cursor cur;
+    fat_cursor_init(&cur, fat32);
 
     // ディレクトリの中身を保持するブロック(セクタ)番号を取得
     int blkno = fat32_firstblk(fat32, current_cluster, 0);
     while (is_active_cluster(current_cluster)) {
         // ディレクトリの中身を読み込む
-        bbuf = alloc_and_readblock(blkno + fat32->volume_first);
+        if (bcache_read(blkno + fat32->volume_first, bbuf) < 0) {
+            ret = -2;
+            break;
+        }
 
         // ブロックを先頭から順番に見ていく
         for (uint32_t i = 0; i < BLOCKSIZE; i += sizeof(struct fat32_direntry)) {
@@ -450,7 +608,7 @@ static int fat32_lookup_main(struct fat32_file *fatfile, const char *name,
                 //   The special 0 value, rather than the 0xE5 value, indicates to FAT file system
                 //   driver code that the rest of the entries in this directory do not need to be
                 //   examined because they are all free.
-                break;
+                goto exit;
             }
             if (dent->DIR_Name[0] == 0xe5) {
                 // 削除済みエントリ
@@ -472,52 +630,151 @@ static int fat32_lookup_main(struct fat32_file *fatfile, const char *name,
                 dent_name = get_sfn(dent);
             }
 
-            if (strncmp(name, dent_name, FAT32_MAX_FILENAME_LEN) == 0) {
-                // ファイル名が一致した場合は、そのファイルのクラスタ番号を計算
-                uint32_t dent_clus =
-                    (dent->DIR_FstClusHI << 16) | dent->DIR_FstClusLO;
-                if (dent_clus == 0) {
-                    // root directory
-                    dent_clus = fat32->boot.BPB_RootClus;
-                }
-                // 見つけたエントリに対し fat32_file 構造体を準備して終了
+            // エントリのクラスタ番号を計算
+            uint32_t dent_clus = dir_cluster(dent);
+            if (dent_clus == 0) {
+                // root directory
+                dent_clus = fat32->boot.BPB_RootClus;
+            }
+
+            if (cache) {
+                fat32_dircache_insert(fat32, cache, dent_name, dent, dent_clus);
+            }
+
+            if (name && ret < 0 && fat32_name_equal(dent_name, name, namelen)) {
+                // 見つけたエントリに対し fat32_file 構造体を準備する
                 fat32_file_init(fat32, found, dent->DIR_Attr,
                                 dent->DIR_FileSize, dent_clus);
-                goto file_found;
+                ret = 0;
+                if (!cache) {
+                    goto exit;
+                }
             }
         }
-        // ブロックを読み切ったが見つからなかった場合は次のブロックに移動して繰り返す
-        if (prevbuf != NULL) {
-            free_page(prevbuf);
-        }
+        // ブロックを読み切ったら次のブロックに移動して繰り返す
         prevbuf = bbuf;
-        bbuf = NULL;
-        blkno = fat32_nextblk(fat32, blkno, &current_cluster);
+        bbuf = (bbuf == page) ? page + BLOCKSIZE : page;
+        blkno = fat32_nextblk(&cur, blkno, &current_cluster);
+    }
+
+exit:
+    fat_cursor_release(&cur);
+    free_page(page);
+    return ret;
+}
+
+// ディレクトリ(cluster)のエントリのキャッシュを返す
+// まだなければディレクトリを一度だけ走査して作る(空きがないか読み込みに失敗したら NULL)
+static struct fat32_dircache *fat32_get_dircache(struct fat32_file *dir) {
+    struct fat32_fs *fat32 = dir->fat32;
+    struct fat32_dircache *unused = NULL;
+
+    for (int i = 0; i < FAT32_DIRCACHE_DIRS; i++) {
+        struct fat32_dircache *cache = &fat32->dircache[i];
+        if (cache->cluster == dir->cluster) {
+            return cache;
+        }
+        if (!unused && cache->cluster == 0) {
+            unused = cache;
+        }
+    }
+    if (!unused) {
+        return NULL;
     }
 
-    // ファイルが見つからなかった場合はエラー終了
-    if (prevbuf != NULL) {
-        free_page(prevbuf);
+    if (fat32_scan_dir(dir, unused, NULL, 0, NULL) == -2) {
+        // 途中までしか読めなかったエントリはキャッシュせず、次の検索で読み直す
+        for (int i = 0; i < FAT32_DIRCACHE_BUCKETS; i++) {
+            unused->buckets[i] = NULL;
+        }
+        return NULL;
     }
-    if (bbuf != NULL) {
-        free_page(bbuf);
+    unused->cluster = dir->cluster;
+    return unused;
+}
+
+// 指定されたディレクトリ(dir)から特定のファイル名(長さ namelen の name)を探す
+static int fat32_lookup_main(struct fat32_file *dir, const char *name, size_t namelen,
+                             struct fat32_file *found) {
+    struct fat32_fs *fat32 = dir->fat32;
+    // dir がディレクトリでない場合はエラー終了
+    if (!(dir->attr & ATTR_DIRECTORY)) {
+        return -1;
+    }
+
+    struct fat32_dircache *cache = fat32_get_dircache(dir);
+    if (!cache) {
+        // キャッシュに空きがないときや、キャッシュを作れなかったときはディレクトリを直接走査する
+        return fat32_scan_dir(dir, NULL, name, namelen, found);
+    }
+
+    uint32_t hash = fat32_name_hash(name, namelen);
+    struct fat32_cached_dent *cdent = cache->buckets[hash % FAT32_DIRCACHE_BUCKETS];
+    for (; cdent; cdent = cdent->next) {
+        if (cdent->hash == hash && fat32_name_equal(cdent->name, name, namelen)) {
+            fat32_file_init(fat32, found, cdent->attr, cdent->size, cdent->cluster);
+            return 0;
+        }
     }
     return -1;
+}
+
+// ルートディレクトリからパス(区切りは '/')をたどってファイルを探す
+int fat32_lookup(struct fat32_fs *fat32, const char *path,
+                 struct fat32_file *fatfile) {
+    struct fat32_file dir = fat32->root;
+    int ret = -1;
 
-file_found:
-    if (prevbuf != NULL) {
-        free_page(prevbuf);
+    acquire_sleeplock(&fat32->lock);
+    while (1) {
+        while (*path == '/') {
+            path++;
+        }
+        const char *end = path;
+        while (*end && *end != '/') {
+            end++;
+        }
+        if (end == path || end - path > FAT32_MAX_FILENAME_LEN) {
+            break;
+        }
+        if (fat32_lookup_main(&dir, path, end - path, fatfile) < 0) {
+            break;
+        }
+        path = end;
+        while (*path == '/') {
+            path++;
+        }
+        if (*path == '\0') {
+            ret = 0;
+            break;
+        }
+        dir = *fatfile;
     }
-    if (bbuf != NULL) {
-        free_page(bbuf);
+    release_sleeplock(&fat32->lock);
+
+    return ret;
+}
+
+// マウント済みのファイルシステム
+static struct fat32_fs mounted_fs;
+static int fat32_mounted = 0;
+
+// SD カード上のファイルシステムを一度だけ読み込み、BPB などを保持しておく
+int fat32_mount() {
+    struct fat32_fs *fat32 = &mounted_fs;
+
+    memzero(fat32, sizeof(struct fat32_fs));
+    init_sleeplock(&fat32->lock, "fat32_lock");
+    if (fat32_read_bpb(fat32) < 0) {
+        return -1;
     }
+    fat32_mounted = 1;
     return 0;
 }
 
-// ルートディレクトリからファイルを探す
-int fat32_lookup(struct fat32_fs *fat32, const char *name,
-                 struct fat32_file *fatfile) {
-    return fat32_lookup_main(&fat32->root, name, fatfile);
+// マウント済みのファイルシステムを返す
+struct fat32_fs *fat32_get_fs() {
+    return fat32_mounted ? &mounted_fs : NULL;
 }
 
 // 指定されたファイル(fatfile)から buf にデータを読み込む
@@ -529,31 +786,80 @@ int fat32_read(struct fat32_file *fatfile, void *buf, unsigned long offset,
     }
 
     uint32_t tail = MIN(count + offset, fatfile->size);
-    uint32_t remain = tail - offset;
     if (tail <= offset) {
         return 0;
     }
+    uint32_t start = offset;
+    uint32_t remain = tail - offset;
 
-    uint32_t current_cluster =
-        walk_cluster_chain(fat32, offset, fatfile->cluster);
-    uint32_t inblk_off = offset % BLOCKSIZE;
+    uint8_t *dst = (uint8_t *)buf;
+    uint8_t *bbuf = NULL;
 
-    for (int blkno = fat32_firstblk(fat32, current_cluster, offset);
-         remain > 0 && is_active_cluster(current_cluster);
-         blkno = fat32_nextblk(fat32, blkno, &current_cluster)) {
-        uint8_t *bbuf = alloc_and_readblock(blkno + fat32->volume_first);
-        uint32_t copylen = MIN(BLOCKSIZE - inblk_off, remain);
-        memcpy(buf, bbuf + inblk_off, copylen);
-        free_page(bbuf);
+    while (remain > 0) {
+        uint32_t contig;
+        int blkno = fat32_file_block(fatfile, offset, &contig);
+        if (blkno < 0) {
+            break;
+        }
+
+        uint32_t inblk_off = offset % BLOCKSIZE;
+        uint32_t copylen;
+        if (inblk_off == 0 && remain >= BLOCKSIZE && ((unsigned long)dst & 0x3) == 0) {
+            // ブロック境界から始まる部分は、ディスク上で連続しているブロックをまとめて直接読み込む
+            uint32_t nblk = MIN(MIN(contig, remain / BLOCKSIZE), FAT32_MAX_BLOCKS_PER_READ);
+            if (sd_readblock(blkno + fat32->volume_first, dst, nblk) == 0) {
+                break;
+            }
+            copylen = nblk * BLOCKSIZE;
+        } else {
+            // ブロックの途中から、もしくは途中までの部分は一度ブロック全体を読み込んでからコピーする
+            if (!bbuf) {
+                bbuf = (uint8_t *)allocate_page();
+            }
+            if (sd_readblock(blkno + fat32->volume_first, bbuf, 1) == 0) {
+                break;
+            }
+            copylen = MIN(BLOCKSIZE - inblk_off, remain);
+            memcpy(dst, bbuf + inblk_off, copylen);
+        }
 
-        buf += copylen;
+        dst += copylen;
+        offset += copylen;
         remain -= copylen;
-        inblk_off = 0;
     }
-    uint32_t read_bytes = (tail - offset) - remain;
+
+    if (bbuf) {
+        free_page(bbuf);
+    }
+    uint32_t read_bytes = (tail - start) - remain;
     return read_bytes;
 }
 
+// ファイル内のオフセット file_off を含むブロックの、SD カード上の LBA を返す(範囲外なら -1)
+// *contig には、そのブロックからディスク上で連続しているブロック数を入れる
+// ファイルの中身を直接読み書きする場合(準仮想ブロックデバイスなど)に使う
+long fat32_file_lba(struct fat32_file *fatfile, uint32_t file_off, uint32_t *contig) {
+    if (file_off >= fatfile->size) {
+        return -1;
+    }
+    int blkno = fat32_file_block(fatfile, file_off, contig);
+    if (blkno < 0) {
+        return -1;
+    }
+    // ファイルサイズを超えた部分のブロックは含めない
+    uint32_t remain = (fatfile->size - file_off + BLOCKSIZE - 1) / BLOCKSIZE;
+    *contig = MIN(*contig, remain);
+    return blkno + fatfile->fat32->volume_first;
+}
+
+// ファイルを使い終わったら、読み込み用に作った表を解放する
+void fat32_close(struct fat32_file *fatfile) {
+    if (fatfile->extents) {
+        free_page(fatfile->extents);
+        fatfile->extents = NULL;
+    }
+}
+
 // 指定したファイルのファイルサイズを返す
 int fat32_file_size(struct fat32_file *fatfile) {
     return fatfile->size;
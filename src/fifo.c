@@ -1,74 +1,126 @@
 #include "fifo.h"
 #include "mm.h"
+#include "utils.h"
 
-#define FIFO_SIZE 256   // warning: DO NOT exceed page size
-
+// head は書き込み側だけ、tail は読み出し側だけが更新する
+// どちらも単調増加させ、添字にするときに mask をかける
 struct fifo {
-    unsigned int head;
-    unsigned int tail;
-    unsigned int used;
-    unsigned long buf[FIFO_SIZE];
+    volatile unsigned int head;
+    volatile unsigned int tail;
+    unsigned int capacity;
+    unsigned int mask;
+    char buf[];
 };
 
-#define NEXT_INDEX(i) (((i) + 1) == FIFO_SIZE ? 0 : ((i) + 1))
+// 相手側が更新するインデックスは acquire で読み、
+// バッファの読み書きが終わってから自分側のインデックスを release で書く
+#define LOAD_ACQUIRE(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
 
 int is_empty_fifo(struct fifo *fifo)
 {
-    return fifo->used == 0;
+    return used_of_fifo(fifo) == 0;
 }
 
 int is_full_fifo(struct fifo *fifo)
 {
-    return fifo->used == FIFO_SIZE;
+    return used_of_fifo(fifo) == fifo->capacity;
 }
 
 struct fifo *create_fifo()
 {
+    return create_fifo_with_capacity(FIFO_DEFAULT_CAPACITY);
+}
+
+// capacity が 2 のべき乗でない、または 1 ページに収まらない場合は NULL を返す
+struct fifo *create_fifo_with_capacity(unsigned int capacity)
+{
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0 || capacity > FIFO_MAX_CAPACITY) {
+        return NULL;
+    }
+
     struct fifo *fifo = (struct fifo *)allocate_page();
+    if (!fifo) {
+        return NULL;
+    }
     fifo->head = 0;
     fifo->tail = 0;
-    fifo->used = 0;
+    fifo->capacity = capacity;
+    fifo->mask = capacity - 1;
 
     return fifo;
 }
 
+// 溜まっているデータを捨てる
+// tail を進めるので読み出し側から呼ぶこと
 void clear_fifo(struct fifo *fifo)
 {
-    fifo->head = 0;
-    fifo->tail = 0;
-    fifo->used = 0;
+    STORE_RELEASE(&fifo->tail, LOAD_ACQUIRE(&fifo->head));
 }
 
 int enqueue_fifo(struct fifo *fifo, unsigned long val)
 {
-    if (is_full_fifo(fifo)) {
+    char c = val;
+    return enqueue_fifo_n(fifo, &c, 1) == 1 ? 0 : -1;
+}
+
+int dequeue_fifo(struct fifo *fifo, unsigned long *val)
+{
+    char c;
+    if (dequeue_fifo_n(fifo, &c, 1) != 1) {
         return -1;
     }
-
-    fifo->buf[fifo->head] = val;
-    fifo->head = NEXT_INDEX(fifo->head);
-    fifo->used++;
-
+    if (val) {
+        *val = (unsigned char)c;
+    }
     return 0;
 }
 
-int dequeue_fifo(struct fifo *fifo, unsigned long *val)
+// 空いている分だけ書き込み、書き込んだバイト数を返す
+int enqueue_fifo_n(struct fifo *fifo, const char *src, int len)
 {
-    if (is_empty_fifo(fifo)) {
-        return -1;
+    unsigned int head = fifo->head;
+    unsigned int tail = LOAD_ACQUIRE(&fifo->tail);
+    unsigned int n = MIN((unsigned int)len, fifo->capacity - (head - tail));
+    if (n == 0) {
+        return 0;
     }
 
-    if (val) {
-        *val = fifo->buf[fifo->tail];
+    // リングの末尾で折り返す場合は 2 回に分けてコピーする
+    unsigned int off = head & fifo->mask;
+    unsigned int first = MIN(n, fifo->capacity - off);
+    memcpy(&fifo->buf[off], src, first);
+    memcpy(&fifo->buf[0], src + first, n - first);
+
+    STORE_RELEASE(&fifo->head, head + n);
+    return n;
+}
+
+// 最大 len バイト読み出し、読み出したバイト数を返す
+int dequeue_fifo_n(struct fifo *fifo, char *dst, int len)
+{
+    unsigned int tail = fifo->tail;
+    unsigned int head = LOAD_ACQUIRE(&fifo->head);
+    unsigned int n = MIN((unsigned int)len, head - tail);
+    if (n == 0) {
+        return 0;
     }
 
-    fifo->tail = NEXT_INDEX(fifo->tail);
-    fifo->used--;
+    unsigned int off = tail & fifo->mask;
+    unsigned int first = MIN(n, fifo->capacity - off);
+    memcpy(dst, &fifo->buf[off], first);
+    memcpy(dst + first, &fifo->buf[0], n - first);
 
-    return 0;
+    STORE_RELEASE(&fifo->tail, tail + n);
+    return n;
 }
 
 int used_of_fifo(struct fifo *fifo)
 {
-    return fifo->used;
+    return LOAD_ACQUIRE(&fifo->head) - LOAD_ACQUIRE(&fifo->tail);
+}
+
+int free_of_fifo(struct fifo *fifo)
+{
+    return fifo->capacity - used_of_fifo(fifo);
 }
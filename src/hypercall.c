@@ -2,51 +2,223 @@
 #include "loader.h"
 #include "hypercall.h"
 #include "hypercall_type.h"
+#include "virtq.h"
+#include "vblk.h"
+#include "shm.h"
+#include "utils.h"
 #include "debug.h"
 
-void hypercall(unsigned long hvc_nr, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
-    struct pt_regs *regs = vm_pt_regs(current_cpu_core()->current_vm);
-
-    switch (hvc_nr) {
-	case HYPERCALL_TYPE_WARN_LU: {
-		WARN("HVC #%lu(%lu)", hvc_nr, a0);
-		break;
-    }
-	case HYPERCALL_TYPE_INFO_LX: {
-		INFO("HVC #%d: 0x%lx(%ld)", hvc_nr, a0, a0);
-		break;
-    }
-	case HYPERCALL_TYPE_INFO_LX_LX: {
-		INFO("HVC #%d: 0x%lx(%ld), 0x%lx(%ld)", hvc_nr, a0, a0, a1, a1);
-		break;
-    }
-	case HYPERCALL_TYPE_INFO_LX_LX_LX: {
-		INFO("HVC #%d: 0x%lx(%ld), 0x%lx(%ld), 0x%lx(%ld)", hvc_nr, a0, a0, a1, a1, a2, a2);
-		break;
-    }
-	case HYPERCALL_TYPE_INFO_LX_LX_LX_LX: {
-		INFO("HVC #%d: 0x%lx(%ld), 0x%lx(%ld), 0x%lx(%ld), 0x%lx(%ld)", hvc_nr, a0, a0, a1, a1, a2, a2, a3, a3);
-		break;
-    }
-
-	case HYPERCALL_TYPE_INFO_STR: {
-		INFO("HVC #%d: %s", hvc_nr, (const char *)get_pa_2nd(a0));
-		break;
+// デバッグ出力用
+//   戻り値は返さない(x8 はそのまま残るので、続けて同じ引数で別のハイパーコールを呼べる)
+static long hc_warn_lu(struct vm_struct *vm, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
+	WARN("HVC #%lu(%lu)", HYPERCALL_TYPE_WARN_LU, a0);
+	return 0;
+}
+
+static long hc_info_lx(struct vm_struct *vm, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
+	INFO("HVC #%d: 0x%lx(%ld)", HYPERCALL_TYPE_INFO_LX, a0, a0);
+	return 0;
+}
+
+static long hc_info_lx_lx(struct vm_struct *vm, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
+	INFO("HVC #%d: 0x%lx(%ld), 0x%lx(%ld)", HYPERCALL_TYPE_INFO_LX_LX, a0, a0, a1, a1);
+	return 0;
+}
+
+static long hc_info_lx_lx_lx(struct vm_struct *vm, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
+	INFO("HVC #%d: 0x%lx(%ld), 0x%lx(%ld), 0x%lx(%ld)", HYPERCALL_TYPE_INFO_LX_LX_LX, a0, a0, a1, a1, a2, a2);
+	return 0;
+}
+
+static long hc_info_lx_lx_lx_lx(struct vm_struct *vm, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
+	INFO("HVC #%d: 0x%lx(%ld), 0x%lx(%ld), 0x%lx(%ld), 0x%lx(%ld)", HYPERCALL_TYPE_INFO_LX_LX_LX_LX, a0, a0, a1, a1, a2, a2, a3, a3);
+	return 0;
+}
+
+static long hc_info_str(struct vm_struct *vm, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
+	const char *str = (const char *)get_pa_2nd(a0);
+	// 文字列はページ内に収まっている前提なので、ページの終わりまでをメモリと揃える
+	sync_guest_memory((void *)str, PAGE_SIZE - (a0 & (PAGE_SIZE - 1)));
+	INFO("HVC #%d: %s", HYPERCALL_TYPE_INFO_STR, str);
+	return 0;
+}
+
+static long hc_version(struct vm_struct *vm, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
+	return HYPERCALL_ABI_VERSION;
+}
+
+static long hc_features(struct vm_struct *vm, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
+	return HYPERCALL_FEATURE_MULTICALL | HYPERCALL_FEATURE_PV_CONSOLE | HYPERCALL_FEATURE_VIRTQ |
+		   HYPERCALL_FEATURE_VBLK | HYPERCALL_FEATURE_SHM;
+}
+
+static long hc_query(struct vm_struct *, unsigned long, unsigned long, unsigned long, unsigned long);
+static long hc_multicall(struct vm_struct *, unsigned long, unsigned long, unsigned long, unsigned long);
+
+static long hc_create_vm_from_elf(struct vm_struct *vm, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
+	// 最初にこの VM に CPU 時間が割当たったタイミングで arg が使用される
+	// よってゲストのメモリに依存しないようハイパーバイザ側にコピーしておく
+	struct loader_args *guest_args = (struct loader_args *)get_pa_2nd(a0);
+	sync_guest_memory(guest_args, sizeof(struct loader_args));
+	struct loader_args args = *guest_args;
+
+	INFO("Prepare VM(%s) by hypercall", args.filename);
+	return create_vm_with_loader(elf_binary_loader, &args);
+}
+
+static long hc_console_write(struct vm_struct *vm, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
+	return write_vm_console(vm, a0, a1);
+}
+
+static long hc_console_read(struct vm_struct *vm, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
+	return read_vm_console(vm, a0, a1);
+}
+
+static long hc_virtq_setup(struct vm_struct *vm, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
+	return virtq_setup(vm, a0);
+}
+
+static long hc_virtq_notify(struct vm_struct *vm, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
+	return virtq_notify(vm, a0);
+}
+
+static long hc_pv_irq_ack(struct vm_struct *vm, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
+	return ack_pv_irq(vm, a0);
+}
+
+static long hc_vblk_attach(struct vm_struct *vm, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
+	return vblk_attach(vm, a0);
+}
+
+static long hc_shm_map(struct vm_struct *vm, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
+	return shm_map(vm, a0, a1, a2);
+}
+
+static long hc_shm_notify(struct vm_struct *vm, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
+	return shm_notify(vm, a0);
+}
+
+static long hc_shm_ack(struct vm_struct *vm, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
+	return shm_ack(vm);
+}
+
+typedef long (*hypercall_handler_t)(struct vm_struct *, unsigned long, unsigned long, unsigned long, unsigned long);
+
+struct hypercall_entry {
+	unsigned long nr;
+	hypercall_handler_t handler;
+	unsigned long flags;    // HYPERCALL_F_*
+};
+
+// 登録されているハイパーコール
+// 新しいハイパーコールを追加するときは、ここに 1 行追加する
+// HYPERCALL_F_FAST をつけてよいのは、ブロックせず、自分の VM の仮想割込みの状態や
+// システムレジスタを変更せず、コンソールの出力も行わないものだけ
+// 高速パスでは EL1 のシステムレジスタを退避しないので、ゲストのアドレスを at 命令で変換するもの
+// (get_pa_2nd など、PAR_EL1 を書き換える)もつけてはいけない
+static const struct hypercall_entry hypercall_table[] = {
+	{ HYPERCALL_TYPE_WARN_LU,           hc_warn_lu,             HYPERCALL_F_BATCH | HYPERCALL_F_FAST },
+	{ HYPERCALL_TYPE_INFO_LX,           hc_info_lx,             HYPERCALL_F_BATCH | HYPERCALL_F_FAST },
+	{ HYPERCALL_TYPE_INFO_LX_LX,        hc_info_lx_lx,          HYPERCALL_F_BATCH | HYPERCALL_F_FAST },
+	{ HYPERCALL_TYPE_INFO_LX_LX_LX,     hc_info_lx_lx_lx,       HYPERCALL_F_BATCH | HYPERCALL_F_FAST },
+	{ HYPERCALL_TYPE_INFO_LX_LX_LX_LX,  hc_info_lx_lx_lx_lx,    HYPERCALL_F_BATCH | HYPERCALL_F_FAST },
+	{ HYPERCALL_TYPE_INFO_STR,          hc_info_str,            HYPERCALL_F_BATCH },
+	{ HYPERCALL_TYPE_VERSION,           hc_version,             HYPERCALL_F_RESULT | HYPERCALL_F_BATCH | HYPERCALL_F_FAST },
+	{ HYPERCALL_TYPE_FEATURES,          hc_features,            HYPERCALL_F_RESULT | HYPERCALL_F_BATCH | HYPERCALL_F_FAST },
+	{ HYPERCALL_TYPE_QUERY,             hc_query,               HYPERCALL_F_RESULT | HYPERCALL_F_BATCH | HYPERCALL_F_FAST },
+	{ HYPERCALL_TYPE_MULTICALL,         hc_multicall,           HYPERCALL_F_RESULT },
+	{ HYPERCALL_TYPE_CREATE_VM_FROM_ELF, hc_create_vm_from_elf, HYPERCALL_F_RESULT | HYPERCALL_F_BATCH },
+	{ HYPERCALL_TYPE_CONSOLE_WRITE,     hc_console_write,       HYPERCALL_F_RESULT | HYPERCALL_F_BATCH },
+	{ HYPERCALL_TYPE_CONSOLE_READ,      hc_console_read,        HYPERCALL_F_RESULT | HYPERCALL_F_BATCH },
+	{ HYPERCALL_TYPE_VIRTQ_SETUP,       hc_virtq_setup,         HYPERCALL_F_RESULT | HYPERCALL_F_BATCH },
+	{ HYPERCALL_TYPE_VIRTQ_NOTIFY,      hc_virtq_notify,        HYPERCALL_F_RESULT | HYPERCALL_F_BATCH },
+	{ HYPERCALL_TYPE_PV_IRQ_ACK,        hc_pv_irq_ack,          HYPERCALL_F_RESULT | HYPERCALL_F_BATCH },
+	{ HYPERCALL_TYPE_VBLK_ATTACH,       hc_vblk_attach,         HYPERCALL_F_RESULT | HYPERCALL_F_BATCH },
+	{ HYPERCALL_TYPE_SHM_MAP,           hc_shm_map,             HYPERCALL_F_RESULT | HYPERCALL_F_BATCH },
+	{ HYPERCALL_TYPE_SHM_NOTIFY,        hc_shm_notify,          HYPERCALL_F_RESULT | HYPERCALL_F_BATCH | HYPERCALL_F_FAST },
+	{ HYPERCALL_TYPE_SHM_ACK,           hc_shm_ack,             HYPERCALL_F_RESULT | HYPERCALL_F_BATCH },
+};
+
+#define NR_HYPERCALLS (sizeof(hypercall_table) / sizeof(hypercall_table[0]))
+
+static const struct hypercall_entry *find_hypercall(unsigned long nr) {
+	for (unsigned long i = 0; i < NR_HYPERCALLS; i++) {
+		if (hypercall_table[i].nr == nr) {
+			return &hypercall_table[i];
+		}
+	}
+	return NULL;
+}
+
+// 第1引数の番号のハイパーコールの HYPERCALL_F_* を返す(存在しなければ 0)
+static long hc_query(struct vm_struct *vm, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
+	const struct hypercall_entry *hc = find_hypercall(a0);
+	return hc ? (long)(hc->flags | HYPERCALL_F_EXIST) : 0;
+}
+
+// ゲストのメモリ上に並べた struct hypercall_multicall_entry を順に実行し、実行した数を返す
+//   a0: 配列の仮想アドレス(HYPERCALL_MULTICALL_ENTRY_SIZE にアラインすること), a1: 要素数
+// 1 エントリは 1 ページに収まるので、エントリごとに 1 回アドレス変換すればよい
+// 実行中は割込みが禁止されているので、1 回で実行する数は HYPERCALL_MULTICALL_MAX までにする
+// 残りがあればゲストは続きから再度呼び出すこと
+static long hc_multicall(struct vm_struct *vm, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
+	if (a0 & (HYPERCALL_MULTICALL_ENTRY_SIZE - 1)) {
+		return -1;
 	}
+	unsigned long count = MIN(a1, HYPERCALL_MULTICALL_MAX);
 
-	case HYPERCALL_TYPE_CREATE_VM_FROM_ELF: {
-		// 最初にこの VM に CPU 時間が割当たったタイミングで arg が使用される
-		// よってゲストのメモリに依存しないようハイパーバイザ側にコピーしておく
-		struct loader_args args = *(struct loader_args *)get_pa_2nd(a0);
+	for (unsigned long i = 0; i < count; i++) {
+		struct hypercall_multicall_entry *e =
+			(struct hypercall_multicall_entry *)get_guest_va_host_addr(a0 + i * HYPERCALL_MULTICALL_ENTRY_SIZE);
+		if (!e) {
+			return i;
+		}
+		sync_guest_memory(e, sizeof(*e));
+		const struct hypercall_entry *hc = find_hypercall(e->op);
+		if (!hc || !(hc->flags & HYPERCALL_F_BATCH)) {
+			e->result = -1;
+		}
+		else {
+			e->result = hc->handler(vm, e->args[0], e->args[1], e->args[2], e->args[3]);
+		}
+		sync_guest_memory(e, sizeof(*e));
+	}
+	return count;
+}
 
-		INFO("Prepare VM(%s) by hypercall", args.filename);
-        int vmid = create_vm_with_loader(elf_binary_loader, &args);
-        regs->regs[8] = vmid;
-		break;
-    }
+void hypercall(unsigned long hvc_nr, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
+	struct vm_struct *vm = current_cpu_core()->current_vm;
 
-    default:
+	const struct hypercall_entry *hc = find_hypercall(hvc_nr);
+	if (!hc) {
 		WARN("uncaught hvc64 exception: %ld", hvc_nr);
-		break;
+		return;
+	}
+
+	long ret = hc->handler(vm, a0, a1, a2, a3);
+	if (hc->flags & HYPERCALL_F_RESULT) {
+		vm_pt_regs(vm)->regs[8] = ret;
 	}
 }
+
+// entry.S の el01_sync から kernel_entry の前に呼ばれる
+// HYPERCALL_F_FAST のハイパーコールならその場で処理して 1 を返す(戻り値はスタック上の x8 に書く)
+// それ以外は 0 を返し、通常の経路(kernel_entry → handle_sync_exception_hvc64)で処理される
+int hypercall_fast(unsigned long hvc_nr, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3, unsigned long *x8) {
+	const struct hypercall_entry *hc = find_hypercall(hvc_nr);
+	if (!hc || !(hc->flags & HYPERCALL_F_FAST)) {
+		return 0;
+	}
+
+	struct vm_struct *vm = current_cpu_core()->current_vm;
+	unsigned long start = get_cntpct();
+	vm->stat.hvc_trap_count++;
+
+	long ret = hc->handler(vm, a0, a1, a2, a3);
+	if (hc->flags & HYPERCALL_F_RESULT) {
+		*x8 = ret;
+	}
+
+	account_fast_vm_exit(vm, start);
+	return 1;
+}
@@ -3,10 +3,12 @@
 #include "entry.h"
 #include "peripherals/irq.h"
 #include "peripherals/mailbox.h"
+#include "peripherals/dma.h"
 #include "arm/sysregs.h"
 #include "sched.h"
 #include "debug.h"
 #include "mini_uart.h"
+#include "sd.h"
 
 const char *entry_error_messages[] = {
 	"SYNC_INVALID_EL2",
@@ -34,13 +36,14 @@ const char *entry_error_messages[] = {
 //   #define ENABLE_IRQS_2		(PBASE+0x0000B214)
 //   #define ENABLE_BASIC_IRQS	(PBASE+0x0000B218)
 //   BASIC IRQS はローカル割込み用
-// この関数では全割込みのうちタイマ1,3と UART を有効化する
+// この関数では全割込みのうちタイマ1,3と UART、SD カード用 DMA の完了を有効化する
 //   ちなみにタイマは4個あるが 0 と 2 は GPU で使われる
 void enable_interrupt_controller()
 {
 	put32(ENABLE_IRQS_1, SYSTEM_TIMER_IRQ_1_BIT);
 	put32(ENABLE_IRQS_1, SYSTEM_TIMER_IRQ_3_BIT);
 	put32(ENABLE_IRQS_1, AUX_IRQ_BIT);
+	put32(ENABLE_IRQS_1, DMA_IRQ_BIT(SD_DMA_CHANNEL));
 
 	// Mailbox 割込みを有効化
 	put32(ENABLE_BASIC_IRQS, MBOX_IRQ_BIT);
@@ -52,11 +55,15 @@ void show_invalid_entry_message(int type, unsigned long esr, unsigned long elr,
 		  entry_error_messages[type], esr, elr, far, mpidr);
 }
 
-// メインコアの割込みハンドラは Mailbox 以外の割込みを処理する
+// メインコアの割込みハンドラは外部割込みと、他のコアからの Mailbox の割込みを処理する
 static void handle_irq_maincore() {
 	// todo: daifset で割込みを止めてもシステムタイマによる割込みが発生してしまう、なぜ？
 	unsigned long basic_pending = get32(IRQ_BASIC_PENDING);
 
+	if (get32(CORE0_IRQ_SOURCE) & IRQ_SOURCE_MBOX_0_BIT) {
+		handle_mailbox_irq(0);
+	}
+
 	if (basic_pending & PENDING_REGISTER_1_BIT) {
 		unsigned int irq = get32(IRQ_PENDING_1);
 		if (irq & SYSTEM_TIMER_IRQ_1_BIT) {
@@ -71,6 +78,10 @@ static void handle_irq_maincore() {
 			irq &= ~AUX_IRQ_BIT;
 			handle_uart_irq();
 		}
+		if (irq & DMA_IRQ_BIT(SD_DMA_CHANNEL)) {
+			irq &= ~DMA_IRQ_BIT(SD_DMA_CHANNEL);
+			handle_sd_dma_irq();
+		}
 		if (irq) {
 			WARN("unknown pending irq: %x", irq);
 		}
@@ -88,16 +99,12 @@ static void handle_irq_subcore(unsigned long cpuid) {
 	static unsigned int mbox_sources[] = {
 		CORE0_IRQ_SOURCE, CORE1_IRQ_SOURCE, CORE2_IRQ_SOURCE, CORE3_IRQ_SOURCE
 	};
-	static unsigned int mbox_rd_clrs[] = {
-		MBOX_CORE0_RD_CLR_0, MBOX_CORE1_RD_CLR_0, MBOX_CORE2_RD_CLR_0, MBOX_CORE3_RD_CLR_0
-	};
 
 	// mailbox が割込みを発生させると basic_irq のビットが立つはずだが、そうなっていない
 	// よって mailbox のソースを直接確認する
 	unsigned long source = get32(mbox_sources[cpuid]);
 
 	if (source & IRQ_SOURCE_MBOX_0_BIT) {
-		put32(mbox_rd_clrs[cpuid], 0x1);
 		handle_mailbox_irq(cpuid);
 	}
 }
@@ -6,66 +6,120 @@
 #include "debug.h"
 #include "elf.h"
 #include "arm/mmu.h"
-#include "spinlock.h"
 #include "cpu_core.h"
 
-// todo: 初期化処理を呼んで初期化するようにする
-struct spinlock loader_lock = {0, 0, -1};
+// ローダ全体を守るロックは持たない
+// 複数のコアで同時に VM をロードできるよう、共有するものはそれぞれが自前のロックで守っている
+//   ファイルシステムのディレクトリキャッシュ: fat32_fs.lock(スリープロック)
+//   FAT などのブロックキャッシュ: bcache_lock
+//   SD カードへの要求キュー: sd_lock
+//   ページの割り当て: mm_lock
+// ロード先の Stage2 テーブルやファイルのエクステント表は、ロード中の VM だけが触る
+// SD カードの読み込みを待つ間は VM が眠るので(sd_wait)、その間コアは他の VM を実行できる
 
 // 指定された EL2 のメモリ上のプログラムコードを VM のメモリにロードする
 // ハイパーバイザに埋め込まれた EL1 コードを VM にコピーするために使う
-void copy_code_to_memory(struct vm_struct *vm, unsigned long va, unsigned long from, unsigned long size) {
+// ページが確保できなかった場合は -1 を返す
+int copy_code_to_memory(struct vm_struct *vm, unsigned long va, unsigned long from, unsigned long size) {
     unsigned long current_va = va & PAGE_MASK;
 
     while (size > 0) {
         uint8_t *buf = (uint8_t *)allocate_vm_page(vm, current_va);
+        if (!buf) {
+            return -1;
+        }
         int readsize = MIN(PAGE_SIZE, size);
         memcpy(buf, (void*)from, readsize);
+        sync_guest_memory(buf, readsize);
 
         size -= readsize;
         from += readsize;
         current_va += PAGE_SIZE;
     }
+    return 0;
 }
 
-int load_file_to_memory(struct vm_struct *vm, const char *name, unsigned long va) {
-    // todo: ロックの単位が大きいのでもっと細分化する
-    acquire_lock(&loader_lock);
+// ファイルの file_offset から file_size バイトを、VM の ipa から memory_size バイトの領域にロードする
+// file_size を超えた部分(BSS)は get_free_page でゼロクリアされたページのまま残る
+// ファイルの内容で全体が埋まるページはゼロクリアせずに確保し、
+// ホスト上で物理的に連続したページが続く間は1回の fat32_read でまとめて読み込む
+static int load_file_range(struct vm_struct *vm, struct fat32_file *file, unsigned long ipa,
+                           unsigned long file_offset, unsigned long file_size, unsigned long memory_size) {
+    unsigned long file_end = ipa + file_size;
+    unsigned long mem_end = ipa + memory_size;
+
+    // まとめて読み込む範囲
+    uint8_t *run_dst = NULL;
+    unsigned long run_offset = 0;
+    unsigned long run_len = 0;
+
+    for (unsigned long page_ipa = ipa & PAGE_MASK; page_ipa < mem_end; page_ipa += PAGE_SIZE) {
+        unsigned long from = MAX(page_ipa, ipa);
+        unsigned long to = MIN(page_ipa + PAGE_SIZE, file_end);
+
+        // 隣のセグメントと同じページを共有している場合は、既にあるページに書き込む
+        uint8_t *page = (uint8_t *)get_vm_page(vm, page_ipa);
+        if (!page) {
+            if (from == page_ipa && to == page_ipa + PAGE_SIZE) {
+                page = (uint8_t *)allocate_vm_page_nozero(vm, page_ipa);
+            } else {
+                page = (uint8_t *)allocate_vm_page(vm, page_ipa);
+            }
+            if (!page) {
+                WARN("failed to allocate a page for IPA 0x%lx", page_ipa);
+                return -1;
+            }
+        }
+        if (to <= from) {
+            // BSS だけのページ
+            continue;
+        }
 
-    struct fat32_fs hfat;
-    if (fat32_get_handle(&hfat) < 0) {
+        uint8_t *dst = page + (from - page_ipa);
+        unsigned long offset = file_offset + (from - ipa);
+        unsigned long len = to - from;
+        if (run_len && run_dst + run_len == dst && run_offset + run_len == offset) {
+            run_len += len;
+            continue;
+        }
+        if (run_len && fat32_read(file, run_dst, run_offset, run_len) != run_len) {
+            return -1;
+        }
+        sync_guest_memory(run_dst, run_len);
+        run_dst = dst;
+        run_offset = offset;
+        run_len = len;
+    }
+
+    if (run_len && fat32_read(file, run_dst, run_offset, run_len) != run_len) {
+        return -1;
+    }
+    sync_guest_memory(run_dst, run_len);
+    return 0;
+}
+
+int load_file_to_memory(struct vm_struct *vm, const char *name, unsigned long va) {
+    struct fat32_fs *hfat = fat32_get_fs();
+    if (!hfat) {
         WARN("failed to find fat32 file system");
         return -1;
     }
 
     struct fat32_file file;
-    if (fat32_lookup(&hfat, name, &file) < 0) {
+    if (fat32_lookup(hfat, name, &file) < 0) {
         WARN("requested file (%s) is not found", name);
         return -1;
     }
 
-    int remain = fat32_file_size(&file);
-    int offset = 0;
-    unsigned long current_va = va & PAGE_MASK;
-
-    while (remain > 0) {
-        uint8_t *buf = (uint8_t *)allocate_vm_page(vm, current_va);
-        int readsize = MIN(PAGE_SIZE, remain);
-        int actualsize = fat32_read(&file, buf, offset, readsize);
-
-        if (readsize != actualsize) {
-            WARN("failed to read raw file");
-            return -1;
-        }
-
-        remain -= readsize;
-        offset += readsize;
-        current_va += PAGE_SIZE;
+    int size = fat32_file_size(&file);
+    if (load_file_range(vm, &file, va, 0, size, size) < 0) {
+        WARN("failed to read raw file");
+        fat32_close(&file);
+        return -1;
     }
 
     vm->name = name;
-
-    release_lock(&loader_lock);
+    fat32_close(&file);
     return 0;
 }
 
@@ -73,100 +127,95 @@ int load_file_to_memory(struct vm_struct *vm, const char *name, unsigned long va
 int elf_binary_loader(void *args, unsigned long *pc, unsigned long *sp) {
     struct loader_args *loader_args = (struct loader_args *)args;
     struct vm_struct *vm = current_cpu_core()->current_vm;
+    int ret = -1;
 
-    struct fat32_fs hfat;
-    if (fat32_get_handle(&hfat) < 0) {
+    struct fat32_fs *hfat = fat32_get_fs();
+    if (!hfat) {
         WARN("failed to find fat32 file system");
         return -1;
     }
 
     struct fat32_file file;
-    if (fat32_lookup(&hfat, loader_args->filename, &file) < 0) {
+    if (fat32_lookup(hfat, loader_args->filename, &file) < 0) {
         WARN("requested file (%s) is not found", loader_args->filename);
         return -1;
     }
 
     // ハイパーバイザのメモリ空間に ELF ヘッダ分を読み込む(1ページで十分)
     uint8_t *buf = (uint8_t *)allocate_page();
-    int readsize = MIN(PAGE_SIZE, sizeof(struct elf_header));
-    int actualsize = fat32_read(&file, buf, 0, readsize);
-
-    if (readsize != actualsize) {
+    int readsize = sizeof(struct elf_header);
+    if (fat32_read(&file, buf, 0, readsize) != readsize) {
         WARN("failed to read elf file");
-        return -1;
+        goto out;
     }
 
     // ELF ヘッダのチェック
     struct elf_header *header = (struct elf_header *)buf;
     if (elf_check(header) < 0) {
         WARN("wrong ELF format");
-        free_page(buf);
-        return -1;
+        goto out;
     }
 
-    // ELF ヘッダを格納したメモリは別用途で使ってしまうので、必要な情報を退避する
+    // ELF ヘッダを格納したメモリはプログラムヘッダの読み込みに使うので、必要な情報を退避する
     uint16_t program_header_num = header->program_header_num;
     uint64_t program_header_offset = header->program_header_offset;
     uint16_t program_header_size = header->program_header_size;
     *pc = header->entry_point & 0xffffffffffff;
 
-    // セグメントを順番にロード
-    for (int i = 0; i < program_header_num; i++) {
-        // ハイパーバイザのメモリ空間にプログラムヘッダを読み込む(1ページで十分)
-        // todo: ここを関数として抜き出し
-        int readsize = MIN(PAGE_SIZE, program_header_size);
-        int actualsize = fat32_read(&file, buf, program_header_offset + program_header_size * i, readsize);
-
-        if (readsize != actualsize) {
-            WARN("failed to read file (program header)");
-            return -1;
-        }
-
-        struct elf_program_header *phdr = (struct elf_program_header *)buf;
+    // プログラムヘッダテーブルを一度にまとめて読み込む
+    readsize = program_header_num * program_header_size;
+    if (program_header_size < sizeof(struct elf_program_header) || readsize > PAGE_SIZE) {
+        WARN("unsupported program header table (%d x %d bytes)", program_header_num, program_header_size);
+        goto out;
+    }
+    if (fat32_read(&file, buf, program_header_offset, readsize) != readsize) {
+        WARN("failed to read file (program header)");
+        goto out;
+    }
 
+    // ロードする前にすべてのセグメントの配置を確認しておく
+    // 途中で壊れたセグメントが見つかって、中途半端にロードされた状態にならないようにする
+    int loadable = 0;
+    unsigned long total_size = 0;
+    for (int i = 0; i < program_header_num; i++) {
+        struct elf_program_header *phdr = (struct elf_program_header *)(buf + program_header_size * i);
         // ロード可能なセグメントかを確認
         if (phdr->type != 1) {
-            INFO("skipping unloadable segment %d", i);
             continue;
         }
-        INFO("loading segment %d", i);
-
-        // プログラムヘッダを格納したメモリは別用途で使ってしまうので、必要な情報を退避する
-        uint64_t offset = phdr->offset;
-        uint64_t virtual_addr = phdr->virtual_addr;
-        // uint64_t physical_addr = phdr->physical_addr;
-        uint64_t file_size = phdr->file_size;
-        uint64_t memory_size = phdr->memory_size;
-        INFO("file_size/memory_size: 0x%lx/0x%lx", file_size, memory_size);
-
-        // 指定されたアドレスにセグメントをコピーする(ページ単位のコピーをループする)
-        // todo: 関数化
-        while (memory_size > 0) {
-            // コピー先となるゲストのメモリ空間にページを確保する
-            // allocate_vm_page の中の map_stage2_page で stage2 テーブルを更新している
-            // todo: 中途半端なアドレスな場合、うまく動かないかも
-            uint8_t *vm_buf = (uint8_t *)allocate_vm_page(vm, virtual_addr);
-
-            // コピー元のデータをハイパーバイザのメモリ空間に読み込む
-            int actualsize = fat32_read(&file, vm_buf, offset, PAGE_SIZE);
-            // ゼロクリアする領域があるので、file_size より memory_size のほうが大きい
-            // file からコピーするデータがなくなったら、残りは 0 で埋める
-            if (actualsize != PAGE_SIZE) {
-                memzero(vm_buf + actualsize, PAGE_SIZE - actualsize);
-            }
+        if (phdr->file_size > phdr->memory_size ||
+            phdr->offset + phdr->file_size > fat32_file_size(&file)) {
+            WARN("broken segment %d (offset: 0x%lx, file_size: 0x%lx, memory_size: 0x%lx)",
+                 i, phdr->offset, phdr->file_size, phdr->memory_size);
+            goto out;
+        }
+        loadable++;
+        total_size += phdr->memory_size;
+    }
+    INFO("loading %d segments (0x%lx bytes)", loadable, total_size);
 
-            memory_size = memory_size < PAGE_SIZE ? 0 : memory_size - PAGE_SIZE;
-            virtual_addr += PAGE_SIZE;
-            offset += PAGE_SIZE;
+    // セグメントをファイルから直接ゲストのページに流し込む
+    for (int i = 0; i < program_header_num; i++) {
+        struct elf_program_header *phdr = (struct elf_program_header *)(buf + program_header_size * i);
+        if (phdr->type != 1) {
+            continue;
+        }
+        if (load_file_range(vm, &file, phdr->virtual_addr, phdr->offset,
+                            phdr->file_size, phdr->memory_size) < 0) {
+            WARN("failed to load segment %d", i);
+            goto out;
         }
     }
 
     *sp = loader_args->sp;
     INFO("pc: 0x%lx in 48bit, sp: 0x%lx(0x%lx in 48bit)", *pc & 0xffffffffffff, *sp, *sp & 0xffffffffffff);
     vm->name = loader_args->filename;
+    ret = 0;
 
+out:
+    fat32_close(&file);
     free_page(buf);
-    return 0;
+    return ret;
 }
 
 int raw_binary_loader(void *args, unsigned long *pc, unsigned long *sp) {
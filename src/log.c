@@ -0,0 +1,142 @@
+#include <stdarg.h>
+#include "log.h"
+#include "printf.h"
+#include "utils.h"
+#include "spinlock.h"
+#include "cpu_core.h"
+#include "sched.h"
+#include "mini_uart.h"
+
+// CPU コアごとのログ用リングバッファ
+// 書き込みは各コアが自分のリングにだけ行うので、コア間のロックは不要
+static struct log_ring log_rings[NUMBER_OF_CPU_CORES];
+
+// UART への出力を担当するコアを一つに絞るためのロック
+// 書き込み側はこのロックを取らない
+static struct spinlock log_drain_lock = SPINLOCK_INIT("log_drain");
+
+// 1 レコードを出力したときの最大バイト数(プレフィックス込み)
+// 送信リングにこれだけの空きがなければ出力をやめ、送信割込みで空いたときに続きを出す
+#define LOG_LINE_MAX    (LOG_MSG_LEN + 64)
+
+// 読み出し側が最後に報告した dropped の値
+static unsigned long reported_dropped[NUMBER_OF_CPU_CORES];
+
+// ログを1件記録する
+// 自コアの割込みだけを禁止してリングに書き込むので、UART の送信完了は待たない
+void log_write(const char *level, char *fmt, ...) {
+    unsigned long cpuid = get_cpuid();
+    struct log_ring *ring = &log_rings[cpuid];
+    va_list va;
+
+    // 同じコアの割込みハンドラからの書き込みと混ざらないようにする
+    push_disable_irq();
+
+    unsigned long head = ring->head;
+    unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= LOG_RING_ENTRIES) {
+        // 出力が追いついていないときは待たずに捨てる
+        ring->dropped++;
+        pop_disable_irq();
+        return;
+    }
+
+    struct log_record *rec = &ring->records[head & (LOG_RING_ENTRIES - 1)];
+    struct vm_struct *vm = current_cpu_core()->current_vm;
+
+    rec->timestamp = get_cntpct();
+    rec->level = level;
+    rec->cpuid = cpuid;
+    rec->vmid = vm ? vm->vmid : -1;
+    va_start(va, fmt);
+    tfp_vsnprintf(rec->msg, LOG_MSG_LEN, fmt, va);
+    va_end(va);
+
+    // レコードを書き終えてから head を進める(読み出し側は head を acquire で読む)
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    pop_disable_irq();
+}
+
+static void print_record(struct log_record *rec, unsigned long freq) {
+    unsigned int sec = rec->timestamp / freq;
+    unsigned int usec = (rec->timestamp % freq) * 1000000 / freq;
+
+    if (rec->vmid >= 0) {
+        printf("[%u.%06u] <cpu:%d>[vmid:%d] %s: %s\n",
+               sec, usec, rec->cpuid, rec->vmid, rec->level, rec->msg);
+    }
+    else {
+        printf("[%u.%06u] <cpu:%d> %s: %s\n",
+               sec, usec, rec->cpuid, rec->level, rec->msg);
+    }
+}
+
+// 全コアのリングから最も古いレコードを選ぶ(なければ -1)
+static int oldest_ring(void) {
+    int found = -1;
+    unsigned long oldest = 0;
+
+    for (int i = 0; i < NUMBER_OF_CPU_CORES; i++) {
+        struct log_ring *ring = &log_rings[i];
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (ring->tail == head) {
+            continue;
+        }
+        struct log_record *rec = &ring->records[ring->tail & (LOG_RING_ENTRIES - 1)];
+        if (found < 0 || rec->timestamp < oldest) {
+            found = i;
+            oldest = rec->timestamp;
+        }
+    }
+    return found;
+}
+
+// リングに溜まったログを古い順に最大 budget 件 UART の送信リングに移し、移した件数を返す
+// 他のコアが出力中であれば何もせずに戻る
+// 送信リングが埋まりそうなときも、送信完了を待たずに戻る
+int log_drain(int budget) {
+    int count = 0;
+
+    if (!try_acquire_lock(&log_drain_lock)) {
+        return 0;
+    }
+
+    unsigned long freq = get_cntfrq();
+
+    for (int i = 0; i < NUMBER_OF_CPU_CORES; i++) {
+        unsigned long dropped = log_rings[i].dropped;
+        if (dropped != reported_dropped[i]) {
+            printf("<cpu:%d> %d log records dropped\n", i, dropped - reported_dropped[i]);
+            reported_dropped[i] = dropped;
+        }
+    }
+
+    while (count < budget && uart_tx_free() >= LOG_LINE_MAX) {
+        int i = oldest_ring();
+        if (i < 0) {
+            break;
+        }
+        struct log_ring *ring = &log_rings[i];
+        print_record(&ring->records[ring->tail & (LOG_RING_ENTRIES - 1)], freq);
+        // 出力し終わってから tail を進め、書き込み側にスロットを返す
+        __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+        count++;
+    }
+
+    release_lock(&log_drain_lock);
+    return count;
+}
+
+// 溜まっているログをすべて出力し、送信が終わるまで待つ(PANIC 時など)
+// 他のコアが出力中の場合はそちらに任せる
+void log_flush(void) {
+    // 出力中に PANIC した場合は再入しない
+    if (holding_lock(&log_drain_lock)) {
+        return;
+    }
+    do {
+        uart_tx_flush();
+    } while (log_drain(LOG_RING_ENTRIES) > 0);
+    uart_tx_flush();
+}
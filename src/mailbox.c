@@ -1,8 +1,39 @@
 #include "peripherals/mailbox.h"
 #include "sched.h"
+#include "cpu_core.h"
+#include "smp.h"
+#include "utils.h"
 #include "debug.h"
 
+static const unsigned long mbox_sets[] = {
+    MBOX_CORE0_SET_0, MBOX_CORE1_SET_0, MBOX_CORE2_SET_0, MBOX_CORE3_SET_0
+};
+static const unsigned long mbox_rd_clrs[] = {
+    MBOX_CORE0_RD_CLR_0, MBOX_CORE1_RD_CLR_0, MBOX_CORE2_RD_CLR_0, MBOX_CORE3_RD_CLR_0
+};
+
+// cpuid のコアに IPI_* を送る
+void send_ipi(unsigned long cpuid, unsigned int ipi) {
+    put32(mbox_sets[cpuid], ipi);
+}
+
 void handle_mailbox_irq(unsigned long cpuid) {
-    // INFO("MAILBOX!");
-    timer_tick();
+    // 読んだビットだけをクリアする(読んでから書くまでに届いた要求は次の割込みで処理する)
+    unsigned int ipi = get32(mbox_rd_clrs[cpuid]);
+    put32(mbox_rd_clrs[cpuid], ipi);
+
+    if (ipi & IPI_CALL) {
+        handle_smp_calls(cpuid);
+    }
+
+    // IPI_VIRQ は何もしなくてよい
+    // VM から抜けてきたことで、復帰するときに set_cpu_virtual_interrupt が仮想割込みを設定し直す
+
+    // 呼び出しの中では VM を切り替えられないので、すべて処理し終えてから切り替える
+    if (smp_take_reschedule(cpuid)) {
+        // スケジューラ自身の実行中なら切り替える VM がない
+        if (current_cpu_core()->current_vm) {
+            timer_tick();
+        }
+    }
 }
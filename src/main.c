@@ -11,18 +11,19 @@
 #include "mini_uart.h"
 #include "mm.h"
 #include "sd.h"
+#include "bcache.h"
+#include "fat32.h"
 #include "debug.h"
 #include "loader.h"
 #include "peripherals/irq.h"
 #include "peripherals/mailbox.h"
 #include "cpu_core.h"
+#include "sysreg.h"
+#include "smp.h"
 
 // boot.S で初期化が終わるまでコアを止めるのに使うフラグ
 volatile unsigned long initialized_flag = 0;
 
-// todo: どこか適切な場所に移す
-struct spinlock log_lock;
-
 // todo: 他の種類の OS のロード
 // この情報は、あとから VM にコンテキストスイッチしたときに参照される
 // そのときまで解放されないようにグローバル変数としておく
@@ -95,6 +96,8 @@ static void initialize_cpu_core(unsigned long cpuid) {
 static void initialize_hypervisor() {
 	// initiate_idle_vms();
 	mm_init();
+	sysreg_init();
+	smp_init();
 	uart_init();
 	init_printf(NULL, putc);
 
@@ -102,7 +105,8 @@ static void initialize_hypervisor() {
 	// todo: generic timer にする
 	systimer_init();
 
-	// Core 1~3 の Core 0 からの MAILBOX の割込みを有効化
+	// 各コアの MAILBOX 0 の割込み(コア間割込み)を有効化
+	put32(MBOX_CORE0_CONTROL, MBOX_CONTROL_IRQ_0_BIT);
 	put32(MBOX_CORE1_CONTROL, MBOX_CONTROL_IRQ_0_BIT);
 	put32(MBOX_CORE2_CONTROL, MBOX_CONTROL_IRQ_0_BIT);
 	put32(MBOX_CORE3_CONTROL, MBOX_CONTROL_IRQ_0_BIT);
@@ -116,6 +120,12 @@ static void initialize_hypervisor() {
 	if (sd_init() < 0) {
 		PANIC("sd_init() failed");
 	}
+
+	// SD カード上のファイルシステムは一度だけマウントし、以降は BPB などを使い回す
+	bcache_init();
+	if (fat32_mount() < 0) {
+		WARN("failed to mount fat32 file system");
+	}
 }
 
 // todo: このへんは dom0 相当のゲストで実装すべき
@@ -173,6 +183,8 @@ void hypervisor_main(unsigned long cpuid)
 		INFO("guest VMs are prepared");
 
 		initialized_flag = 1;
+		// 他のコアは MMU とキャッシュを有効にする前にこのフラグを見ているので、メモリに書き出す
+		dcache_clean_range((void *)&initialized_flag, sizeof(initialized_flag));
 	}
 
 	INFO("CPU%d runs IDLE process", cpuid);
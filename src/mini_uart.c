@@ -1,20 +1,90 @@
 #include "peripherals/mini_uart.h"
 #include "peripherals/gpio.h"
+#include "mini_uart.h"
 #include "printf.h"
 #include "utils.h"
 #include "sched.h"
 #include "fifo.h"
 #include "vm.h"
+#include "cpu_core.h"
 #include "systimer.h"
+#include "spinlock.h"
+#include "log.h"
+
+// AUX_MU_IER_REG のビット
+#define UART_IER_RX     (1 << 0)
+#define UART_IER_TX     (1 << 1)
+
+// AUX_MU_LSR_REG のビット
+#define UART_LSR_DATA_READY     (1 << 0)
+#define UART_LSR_TX_EMPTY       (1 << 5)    // 送信 FIFO に 1 バイト以上の空きがある
+
+// 送信リング
+//   送信データはいったんここに溜め、送信 FIFO が空いたときの割込みでハードウェアに送り込む
+//   head/tail は単調増加させ、添字にするときにマスクする
+static char uart_tx_ring[UART_TX_RING_SIZE];
+static unsigned int uart_tx_head;
+static unsigned int uart_tx_tail;
+static int uart_tx_irq_enabled;
+static struct spinlock uart_tx_lock = SPINLOCK_INIT("uart_tx");
+
+#define UART_TX_USED()  (uart_tx_head - uart_tx_tail)
+
+// 送信 FIFO に入るだけリングから移す
+// uart_tx_lock を取った状態で呼ぶこと
+static void uart_tx_pump(void) {
+    while (uart_tx_head != uart_tx_tail && (get32(AUX_MU_LSR_REG) & UART_LSR_TX_EMPTY)) {
+        put32(AUX_MU_IO_REG, uart_tx_ring[uart_tx_tail % UART_TX_RING_SIZE]);
+        uart_tx_tail++;
+    }
+
+    // 送るものが残っているときだけ送信割込みを有効にする
+    int want = uart_tx_head != uart_tx_tail;
+    if (want != uart_tx_irq_enabled) {
+        put32(AUX_MU_IER_REG, want ? (UART_IER_RX | UART_IER_TX) : UART_IER_RX);
+        uart_tx_irq_enabled = want;
+    }
+}
 
+// リングに 1 バイト積む
+// リングが一杯のときは、ハードウェアに送り出して空きができるまで待つ
 static void _uart_send(char c) {
-    // 送信バッファが空くまで待つビジーループ
-    while (1) {
-        if (get32(AUX_MU_LSR_REG) & 0x20) {
-            break;
-        }
+    acquire_lock(&uart_tx_lock);
+    while (UART_TX_USED() == UART_TX_RING_SIZE) {
+        uart_tx_pump();
     }
-    put32(AUX_MU_IO_REG, c);
+    uart_tx_ring[uart_tx_head % UART_TX_RING_SIZE] = c;
+    uart_tx_head++;
+    uart_tx_pump();
+    release_lock(&uart_tx_lock);
+}
+
+// 空いている分だけリングに積み、積んだバイト数を返す(待たない)
+int uart_write(const char *buf, int len) {
+    acquire_lock(&uart_tx_lock);
+    int n = MIN(len, (int)(UART_TX_RING_SIZE - UART_TX_USED()));
+    for (int i = 0; i < n; i++) {
+        uart_tx_ring[uart_tx_head % UART_TX_RING_SIZE] = buf[i];
+        uart_tx_head++;
+    }
+    uart_tx_pump();
+    release_lock(&uart_tx_lock);
+    return n;
+}
+
+// 送信リングの空き容量を返す
+int uart_tx_free(void) {
+    return UART_TX_RING_SIZE - UART_TX_USED();
+}
+
+// 送信リングの中身をすべてハードウェアに送り出すまで待つ
+// 割込みが使えない状況(PANIC など)で使う
+void uart_tx_flush(void) {
+    acquire_lock(&uart_tx_lock);
+    while (uart_tx_head != uart_tx_tail) {
+        uart_tx_pump();
+    }
+    release_lock(&uart_tx_lock);
 }
 
 void uart_send(char c) {
@@ -29,7 +99,7 @@ void uart_send(char c) {
 char uart_recv(void) {
     // 受信バッファにデータが届くまで待つビジーループ
     while (1) {
-        if (get32(AUX_MU_LSR_REG) & 0x01) {
+        if (get32(AUX_MU_LSR_REG) & UART_LSR_DATA_READY) {
             break;
         }
     }
@@ -58,11 +128,11 @@ void uart_send_string(char *str) {
 }
 
 // uart_forwarded_vm が指す VM かホストに文字データを追加する
-// todo: キューに値が入っているときは、そのゲストに切り替わったときに仮想割り込みを発生させる
-void handle_uart_irq(void) {
+// 追加したら UART の仮想割込みの状態を更新し、kick_vm ですぐにゲストに届ける
+//   他のコアで実行中の VM には IPI を送り、実行されていない VM は次のスケジューリングで優先させる
+static void handle_uart_rx(char received) {
     static int is_escaped = 0;
 
-    char received = get32(AUX_MU_IO_REG) & 0xff;
     struct vm_struct *tsk;
 
     if (is_escaped) {
@@ -72,8 +142,8 @@ void handle_uart_irq(void) {
             // VM を切り替えるのではなく、単に UART 入力の送り先を変えるだけ
             uart_forwarded_vm = received - '0';
             printf("\nswitched to %d\n", uart_forwarded_vm);
-            tsk = vms[uart_forwarded_vm];
-            if (tsk->state == VM_RUNNING || tsk->state == VM_RUNNABLE) {
+            tsk = vm_get(uart_forwarded_vm);
+            if (tsk && tsk->state != VM_ZOMBIE) {
                 flush_vm_console(tsk);
             }
         }
@@ -83,6 +153,23 @@ void handle_uart_irq(void) {
         else if (received == 't') {
             show_systimer_info();
         }
+        else if (received == 's') {
+            show_vm_exit_stats();
+        }
+        else if (received == 'b') {
+            run_el2_bench();
+        }
+        else if (received == 'c') {
+            show_lock_stats();
+        }
+        else if (received == 'k') {
+            // UART 入力の送り先の VM を終了させる(IDLE VM は終了させない)
+            tsk = vm_get(uart_forwarded_vm);
+            if (tsk && tsk->vmid >= NUMBER_OF_CPU_CORES && tsk->state != VM_ZOMBIE) {
+                kill_vm(tsk);
+                printf("\nkilled %d\n", uart_forwarded_vm);
+            }
+        }
         else if (received == ESCAPE_CHAR) {
             goto enqueue_char;
         }
@@ -92,14 +179,31 @@ void handle_uart_irq(void) {
     }
     else {
 enqueue_char:
-        tsk = vms[uart_forwarded_vm];
+        tsk = vm_get(uart_forwarded_vm);
         // もし VM が終了してしまっていたら無視する
-        if (tsk->state == VM_RUNNING ||  tsk->state == VM_RUNNABLE) {
+        // VM 表はロックを取らずに読むが、この割込みを処理し終わるまで tsk は解放されない
+        if (tsk && tsk->state != VM_ZOMBIE) {
             enqueue_fifo(tsk->console.in_fifo, received);
+            notify_vm_console(tsk);
+            kick_vm(tsk);
         }
     }
 }
 
+// 受信したバイトを処理し、送信 FIFO が空いていればリングから送り込む
+void handle_uart_irq(void) {
+    while (get32(AUX_MU_LSR_REG) & UART_LSR_DATA_READY) {
+        handle_uart_rx(get32(AUX_MU_IO_REG) & 0xff);
+    }
+
+    acquire_lock(&uart_tx_lock);
+    uart_tx_pump();
+    release_lock(&uart_tx_lock);
+
+    // リングに空きができたので、溜まっているログを補充する
+    log_drain(LOG_RING_ENTRIES);
+}
+
 void uart_init(void) {
     unsigned int selector;
 
@@ -123,7 +227,8 @@ void uart_init(void) {
                                     // (this also enables access to its registers)
     put32(AUX_MU_CNTL_REG, 0);      // Disable auto flow control and disable
                                     // receiver and transmitter (for now)
-    put32(AUX_MU_IER_REG, 1);       // Enable receive interrupts
+    put32(AUX_MU_IER_REG, UART_IER_RX); // Enable receive interrupts
+                                    // (transmit interrupts are enabled on demand)
     put32(AUX_MU_LCR_REG, 3);       // Enable 8 bit mode
     put32(AUX_MU_MCR_REG, 0);       // Set RTS line to be always high
     put32(AUX_MU_BAUD_REG, 270);    // Set baud rate to 115200
@@ -5,6 +5,7 @@
 #include "board.h"
 #include "vm.h"
 #include "spinlock.h"
+#include "shm.h"
 
 // ページの使用状況を表す領域
 static unsigned short mem_map [ PAGING_PAGES ] = {0,};
@@ -27,6 +28,15 @@ unsigned long allocate_page() {
 	return page + VA_START;
 }
 
+// ゲストは自分のメモリをキャッシュ不可(MAIR 0x44 など)でマッピングしていることがあり、
+// その場合 EL2 のデータキャッシュとは一貫性が保たれない
+// ハイパーバイザがゲストのメモリを読む前と書いた後に呼び、キャッシュの内容をメモリに揃える
+void sync_guest_memory(void *addr, unsigned long len) {
+#if EL2_CACHE
+	dcache_flush_range(addr, len);
+#endif
+}
+
 // VM で使うためのページを確保してマッピングし、ハイパーバイザ上の仮想アドレスを返す
 // つまり、ハイパーバイザ上でこのアドレスに書き込むことで、確保したメモリにアクセスできるということ
 unsigned long allocate_vm_page(struct vm_struct *vm, unsigned long ipa) {
@@ -35,6 +45,8 @@ unsigned long allocate_vm_page(struct vm_struct *vm, unsigned long ipa) {
 	if (page == 0) {
 		return 0;
 	}
+	// ゼロクリアした内容がキャッシュに残っているとゲストから見えないことがある
+	sync_guest_memory((void *)(page + VA_START), PAGE_SIZE);
 	// 新たに確保したページをこの VM のアドレス空間にマッピングする
 	map_stage2_page(vm, ipa, page, MMU_STAGE2_PAGE_FLAGS);
 	// INFO("VTTBR0_EL2(VMID %d): IPA 0x%lx(0x%lx in full) -> PA 0x%lx (allocate_vm_page)",
@@ -44,13 +56,130 @@ unsigned long allocate_vm_page(struct vm_struct *vm, unsigned long ipa) {
 	return page + VA_START;
 }
 
+// allocate_vm_page と同じだが、ページをゼロクリアしない
+// 呼び出し側がページ全体をすぐに上書きする場合(ファイルからのロードなど)に使う
+unsigned long allocate_vm_page_nozero(struct vm_struct *vm, unsigned long ipa) {
+	unsigned long page = get_free_page_nozero();
+	if (page == 0) {
+		return 0;
+	}
+	map_stage2_page(vm, ipa, page, MMU_STAGE2_PAGE_FLAGS);
+	return page + VA_START;
+}
+
+// vm の Stage2 変換テーブルをたどり、ipa に対応するレベル3 のエントリを返す
+// 途中のテーブルがない場合やエントリが未設定の場合は 0 を返す
+static unsigned long get_stage2_entry(struct vm_struct *vm, unsigned long ipa) {
+	unsigned long table = vm->mm.first_table;
+	if (!table) {
+		return 0;
+	}
+
+	unsigned long *lv1_table = (unsigned long *)(table + VA_START);
+	unsigned long entry = lv1_table[(ipa >> LV1_SHIFT) & (PTRS_PER_TABLE - 1)];
+	if (!entry) {
+		return 0;
+	}
+	unsigned long *lv2_table = (unsigned long *)((entry & PAGE_MASK) + VA_START);
+	entry = lv2_table[(ipa >> LV2_SHIFT) & (PTRS_PER_TABLE - 1)];
+	if (!entry) {
+		return 0;
+	}
+	unsigned long *lv3_table = (unsigned long *)((entry & PAGE_MASK) + VA_START);
+	return lv3_table[(ipa >> PAGE_SHIFT) & (PTRS_PER_TABLE - 1)];
+}
+
+// vm の Stage2 変換テーブルをたどり、ipa にマッピングされている通常のメモリページの
+// ハイパーバイザ上の仮想アドレスを返す(マッピングがないか MMIO 用のエントリなら 0)
+unsigned long get_vm_page(struct vm_struct *vm, unsigned long ipa) {
+	unsigned long entry = get_stage2_entry(vm, ipa);
+	if ((entry & MM_STAGE2_AP) == MM_STAGE2_AP_NONE) {
+		return 0;
+	}
+	return (entry & PAGE_MASK & 0xFFFFFFFFF000) + VA_START;
+}
+
+// get_vm_page と同じだが、まだマッピングがなければページフォルト時と同様にページを割り当てる
+// MMIO 用のエントリの場合は 0 を返す
+unsigned long get_or_allocate_vm_page(struct vm_struct *vm, unsigned long ipa) {
+	unsigned long entry = get_stage2_entry(vm, ipa);
+	if (entry == 0) {
+		return allocate_vm_page(vm, ipa & PAGE_MASK);
+	}
+	if ((entry & MM_STAGE2_AP) == MM_STAGE2_AP_NONE) {
+		return 0;
+	}
+	return (entry & PAGE_MASK & 0xFFFFFFFFF000) + VA_START;
+}
+
+// ipa に Stage2 のマッピングが何もない(通常のメモリも MMIO 用のエントリもない)なら 1 を返す
+int is_vm_page_unmapped(struct vm_struct *vm, unsigned long ipa) {
+	return get_stage2_entry(vm, ipa) == 0;
+}
+
 void set_vm_page_notaccessable(struct vm_struct *vm, unsigned long va) {
 	map_stage2_page(vm, va, 0, MMU_STAGE2_MMIO_FLAGS);
+	// すでにページが割り当てられていた場合、古い変換が TLB に残っているかもしれない
+	flush_vm_tlb(vm);
 // if (current_cpu_core()->current_vm->vmid != 0)INFO("VA 0x%lx -> IPA 0x%lx -> PA 0x%lx (set_vm_page_notaccessable)", va, get_ipa(va), 0);
 }
 
+// vm の Stage2 のマッピングを書き換えたり外したりした後に呼び、全コアの TLB から古い変換を消す
+// 他のコアで vm が実行中でも、TLB の無効化はハードウェアでブロードキャストされるので IPI は要らない
+void flush_vm_tlb(struct vm_struct *vm) {
+	if (!vm->mm.first_table) {
+		return;
+	}
+	push_disable_irq();
+	flush_stage2_tlb(vm->mm.first_table, vm->vmid);
+	pop_disable_irq();
+}
+
+// VM の Stage2 変換テーブルと、そこにマッピングされているページを解放する
+// 共有メモリのページ(shm.c)と MMIO 用のエントリの先にはページがないので、そのまま残す
+// VM を解放するとき(destroy_vm)にだけ呼ぶこと
+void free_vm_memory(struct vm_struct *vm) {
+	unsigned long table = vm->mm.first_table;
+	if (!table) {
+		return;
+	}
+	// VMID は次の VM が使い回すので、古い変換が TLB に残らないよう先に消しておく
+	flush_vm_tlb(vm);
+
+	unsigned long *lv1_table = (unsigned long *)(table + VA_START);
+	for (int i = 0; i < PTRS_PER_TABLE; i++) {
+		if (!lv1_table[i]) {
+			continue;
+		}
+		unsigned long *lv2_table = (unsigned long *)((lv1_table[i] & PAGE_MASK) + VA_START);
+		for (int j = 0; j < PTRS_PER_TABLE; j++) {
+			if (!lv2_table[j]) {
+				continue;
+			}
+			unsigned long *lv3_table = (unsigned long *)((lv2_table[j] & PAGE_MASK) + VA_START);
+			for (int k = 0; k < PTRS_PER_TABLE; k++) {
+				unsigned long entry = lv3_table[k];
+				if (!entry || (entry & MM_STAGE2_AP) == MM_STAGE2_AP_NONE) {
+					continue;
+				}
+				unsigned long pa = entry & PAGE_MASK & 0xFFFFFFFFF000;
+				if (!shm_owns_page(pa)) {
+					free_page((void *)(pa + VA_START));
+				}
+			}
+			free_page(lv3_table);
+		}
+		free_page(lv2_table);
+	}
+	free_page(lv1_table);
+
+	vm->mm.first_table = 0;
+	vm->mm.vm_pages_count = 0;
+	vm->mm.kernel_pages_count = 0;
+}
+
 // 未使用のページを探してその場所(DRAM 内のオフセット)を返す
-unsigned long get_free_page()
+static unsigned long find_free_page(int zero)
 {
 	acquire_lock(&mm_lock);
 
@@ -58,12 +187,15 @@ unsigned long get_free_page()
 		if (mem_map[i] == 0){
 			// 未使用領域を見つけたらフラグを立てる
 			mem_map[i] = 1;
+			release_lock(&mm_lock);
+
 			unsigned long page = LOW_MEMORY + i*PAGE_SIZE;
 			// RPi OS はリニアマッピングなので VA_START を足せば仮想アドレスになる
 			// そのアドレスを使ってページの内容をゼロクリアする
-			memzero((void *)(page + VA_START), PAGE_SIZE);
-
-			release_lock(&mm_lock);
+			// フラグを立てた時点でこのページは自分のものなので、ロックの外でクリアしてよい
+			if (zero) {
+				memzero((void *)(page + VA_START), PAGE_SIZE);
+			}
 			return page;
 		}
 	}
@@ -74,6 +206,18 @@ unsigned long get_free_page()
 	return 0;
 }
 
+// ゼロクリアされたページを返す
+unsigned long get_free_page()
+{
+	return find_free_page(1);
+}
+
+// ゼロクリアしないページを返す(内容は不定)
+unsigned long get_free_page_nozero()
+{
+	return find_free_page(0);
+}
+
 // 指定された仮想アドレスのぺージを解放する
 void free_page(void *p){
 	// 解放は単にフラグをクリアするだけ
@@ -173,6 +317,48 @@ unsigned long get_pa_2nd(unsigned long va) {
 	return pa;
 }
 
+// PAR_EL1 の変換失敗時のフィールド
+#define PAR_F			(1 << 0)	// 変換に失敗した
+#define PAR_FST(par)	(((par) >> 1) & 0x3f)	// 失敗の要因(DFSC と同じエンコーディング)
+#define PAR_S			(1 << 9)	// ステージ2 での失敗
+
+// 現在実行中のゲストの仮想アドレスを、ハイパーバイザからアクセスできるアドレスに変換する
+// ステージ2 のページがまだ割り当てられていなければ、ページフォルト時と同様に割り当てる
+// 変換できなかった場合(ステージ1 の失敗や MMIO 領域など)は 0 を返す
+unsigned long get_guest_va_host_addr(unsigned long va) {
+	unsigned long par = translate_el12(va);
+
+	if ((par & PAR_F) && (par & PAR_S) && (PAR_FST(par) >> 2) == 0x1) {
+		struct vm_struct *vm = current_cpu_core()->current_vm;
+		if (allocate_vm_page(vm, get_ipa(va) & PAGE_MASK) == 0) {
+			return 0;
+		}
+		par = translate_el12(va);
+	}
+	if (par & PAR_F) {
+		return 0;
+	}
+	return (par & 0xFFFFFFFFF000) + VA_START + (va & 0xFFF);
+}
+
+// ゲストの仮想アドレス va にある '\0' で終わる文字列を dst(size バイト)にコピーする
+// 変換できないアドレスを含む場合や、size に収まらない場合は -1 を返す
+int copy_string_from_guest(unsigned long va, char *dst, int size) {
+	for (int i = 0; i < size; i++) {
+		// ページをまたぐかもしれないので 1 文字ずつ変換する
+		char *p = (char *)get_guest_va_host_addr(va + i);
+		if (!p) {
+			return -1;
+		}
+		sync_guest_memory(p, 1);
+		dst[i] = *p;
+		if (*p == '\0') {
+			return 0;
+		}
+	}
+	return -1;
+}
+
 // ESR_EL2.ISS encoding for an exception from a Data Abort
 // https://developer.arm.com/documentation/ddi0595/2021-03/AArch64-Registers/ESR-EL2--Exception-Syndrome-Register--EL2-?lang=en#fieldset_0-24_0
 // SAS[23:22] Syndrome Access Size: indicates the size of the access
@@ -236,6 +422,7 @@ int handle_mem_abort(unsigned long addr, unsigned long esr) {
 		if (page == 0) {
 			return -1;
 		}
+		sync_guest_memory((void *)(page + VA_START), PAGE_SIZE);
 		// IPA -> PA の変換を登録
 		// todo: ページ境界に合わないアドレスがくることがあるので応急処置
 		addr = addr / PAGE_SIZE * PAGE_SIZE;
@@ -244,6 +431,7 @@ int handle_mem_abort(unsigned long addr, unsigned long esr) {
 		// 	 current_cpu_core()->current_vm->vmid, get_ipa(addr) & 0xffffffffffff, addr, page);
 
 		vm->stat.pf_trap_count++;
+		vm->exit_reason = VM_EXIT_PF;
 		return 0;
 	}
 	else if (dfsc >> 2 == 0x3) {
@@ -277,6 +465,7 @@ int handle_mem_abort(unsigned long addr, unsigned long esr) {
 
 		increment_current_pc(4);
 		vm->stat.mmio_trap_count++;
+		vm->exit_reason = VM_EXIT_MMIO;
 		return 0;
 	}
 	return -1;
@@ -232,3 +232,38 @@ void tfp_sprintf(char* s,char *fmt, ...)
     putcp(&s,0);
     va_end(va);
     }
+
+struct bounded_buf
+    {
+    char* s;
+    size_t left;
+    };
+
+static void putcb(void* p,char c)
+    {
+    struct bounded_buf* b=(struct bounded_buf*)p;
+    if (b->left>1)
+        {
+        *(b->s)++ = c;
+        b->left--;
+        }
+    }
+
+void tfp_vsnprintf(char* s,size_t n,char *fmt, va_list va)
+    {
+    struct bounded_buf b;
+    if (n==0)
+        return;
+    b.s=s;
+    b.left=n;
+    tfp_format(&b,putcb,fmt,va);
+    *b.s=0;
+    }
+
+void tfp_snprintf(char* s,size_t n,char *fmt, ...)
+    {
+    va_list va;
+    va_start(va,fmt);
+    tfp_vsnprintf(s,n,fmt,va);
+    va_end(va);
+    }
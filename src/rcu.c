@@ -0,0 +1,62 @@
+#include <stddef.h>
+#include "rcu.h"
+#include "spinlock.h"
+#include "cpu_core.h"
+#include "utils.h"
+
+static struct spinlock rcu_lock = SPINLOCK_INIT("rcu");
+// 猶予期間を待っているコールバック
+static struct rcu_head *rcu_callbacks;
+// 終わった猶予期間の数
+static unsigned long rcu_gp_seq;
+// 今の猶予期間の間に静止状態を通過したコア(ビット番号が CPU ID)
+static unsigned long rcu_qs_mask;
+
+// 猶予期間の後に func(head) を呼ぶ
+// 呼んだ時点で既に始まっている猶予期間は、head を外す前に静止状態を通過したコアを含むので数えない
+// その次の猶予期間が終わるのを待つ
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *)) {
+	head->func = func;
+	acquire_lock(&rcu_lock);
+	head->seq = rcu_gp_seq + 2;
+	head->next = rcu_callbacks;
+	rcu_callbacks = head;
+	release_lock(&rcu_lock);
+}
+
+// スケジューラのループから呼ばれ、このコアが静止状態にあることを報告する
+// 猶予期間が終わったコールバックがあれば、ロックを外してから呼ぶ
+// 待っているコールバックがなければ何もしないので、普段はロックを取らない
+void rcu_quiescent(void) {
+	if (!__atomic_load_n(&rcu_callbacks, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	struct rcu_head *ready = NULL;
+
+	acquire_lock(&rcu_lock);
+	rcu_qs_mask |= 1UL << get_cpuid();
+	if (rcu_qs_mask == (1UL << NUMBER_OF_CPU_CORES) - 1) {
+		rcu_gp_seq++;
+		rcu_qs_mask = 0;
+	}
+	struct rcu_head **pp = &rcu_callbacks;
+	while (*pp) {
+		struct rcu_head *head = *pp;
+		if ((long)(rcu_gp_seq - head->seq) >= 0) {
+			*pp = head->next;
+			head->next = ready;
+			ready = head;
+		}
+		else {
+			pp = &head->next;
+		}
+	}
+	release_lock(&rcu_lock);
+
+	while (ready) {
+		struct rcu_head *next = ready->next;
+		ready->func(ready);
+		ready = next;
+	}
+}
@@ -1,3 +1,5 @@
+#include <stddef.h>
+
 #include "sched.h"
 #include "irq.h"
 #include "utils.h"
@@ -7,17 +9,30 @@
 #include "vm.h"
 #include "cpu_core.h"
 #include "spinlock.h"
-
-// idle vm や動的に作られた vm などへの参照を保持する配列
-// todo: 直接触らせないようにする
-struct vm_struct *vms[NUMBER_OF_VMS];
-
-// 現在実行中の VM の数(idle_vms があるので初期値は NUMBER_OF_CPU_CORES)
-int current_number_of_vms = NUMBER_OF_CPU_CORES;
+#include "log.h"
+#include "virtq.h"
+#include "peripherals/mailbox.h"
+#include "shm.h"
+#include "smp.h"
+
+// idle vm や動的に作られた vm などへの参照を保持する配列(VM 表)
+//   添字が VMID で、先頭の NUMBER_OF_CPU_CORES 個は idle vm
+//   読む側(スケジューラ、UART 入力、統計の表示)はロックを取らずに vm_get で読む
+//   書く側は vms_lock を取り、エントリを埋めてから公開する
+//   終了した VM は retire_vm で外し、読んでいたコアがいなくなってから解放する(rcu.h)
+static struct vm_struct *vms[NUMBER_OF_VMS];
+static struct spinlock vms_lock = SPINLOCK_INIT("vms");
+
+// 使ったことのある vms[] の末尾(idle_vms があるので初期値は NUMBER_OF_CPU_CORES)
+// 外した VM の場所は再利用するので、この値は減らない
+static int current_number_of_vms = NUMBER_OF_CPU_CORES;
+
+static void switch_to_scheduler(struct vm_struct *vm);
 
 void set_cpu_virtual_interrupt(struct vm_struct *tsk) {
 	// もし current の VM に対して irq が発生していたら、仮想割込みを設定する
-	if (HAVE_FUNC(tsk->board_ops, is_irq_asserted) && tsk->board_ops->is_irq_asserted(tsk)) {
+	// デバイスは状態が変わるたびに tsk->virq を更新しているので、ここではビットを見るだけ
+	if (virq_irq_asserted(tsk)) {
 		assert_virq();
 	}
 	else {
@@ -25,7 +40,7 @@ void set_cpu_virtual_interrupt(struct vm_struct *tsk) {
 	}
 
 	// fiq も同様
-	if (HAVE_FUNC(tsk->board_ops, is_fiq_asserted) && tsk->board_ops->is_fiq_asserted(tsk)) {
+	if (virq_fiq_asserted(tsk)) {
 		assert_vfiq();
 	}
 	else {
@@ -35,18 +50,176 @@ void set_cpu_virtual_interrupt(struct vm_struct *tsk) {
 	// todo: vserror は？
 }
 
+// 準仮想割込みのビット(PV_IRQ_*)に対応する仮想割込みのソース
+static const int pv_irq_sources[] = {
+	VIRQ_DOORBELL0,     // PV_IRQ_VIRTQ
+	VIRQ_DOORBELL1,     // PV_IRQ_SHM
+};
+
+static void update_pv_irq_lines(struct vm_struct *vm, unsigned long bits, unsigned long pending) {
+	for (int i = 0; i < sizeof(pv_irq_sources) / sizeof(pv_irq_sources[0]); i++) {
+		if (bits & (1UL << i)) {
+			virq_set_level(vm, pv_irq_sources[i], (pending >> i) & 1);
+		}
+	}
+}
+
+// 準仮想デバイスからの割込みを立てる
+// 他のコアからも呼ばれるのでアトミックに更新する
+// 実際に仮想割込みになるのは、次にその VM に復帰するときの set_cpu_virtual_interrupt
+void raise_pv_irq(struct vm_struct *vm, unsigned long bits) {
+	__atomic_fetch_or(&vm->pv_irq_pending, bits, __ATOMIC_RELEASE);
+	update_pv_irq_lines(vm, bits, bits);
+}
+
+// ゲストが処理した準仮想割込みを落とし、残っているビットを返す
+unsigned long ack_pv_irq(struct vm_struct *vm, unsigned long bits) {
+	unsigned long pending = __atomic_and_fetch(&vm->pv_irq_pending, ~bits, __ATOMIC_ACQ_REL);
+	update_pv_irq_lines(vm, bits, 0);
+	// 割込み線を落とす間に他のコアが raise_pv_irq した場合に備えて、もう一度見直す
+	pending = __atomic_load_n(&vm->pv_irq_pending, __ATOMIC_ACQUIRE);
+	update_pv_irq_lines(vm, bits & pending, pending);
+	return pending;
+}
+
+// boosted が立っている VM の数(0 ならスケジューラは優先する VM を探さない)
+static volatile int nr_boosted = 0;
+
+// vm の仮想割込みを立てた後に呼び、できるだけ早くゲストに届ける
+//   他のコアで実行中なら、そのコアに IPI を送って VM exit させる
+//     復帰するときの set_cpu_virtual_interrupt で仮想割込みが設定される
+//   このコアで実行中なら、今処理している VM exit から復帰するときに設定されるので何もしない
+//   実行されていなければ、次のスケジューリングで優先させ、IDLE VM を動かしているコアがあれば起こす
+// current_vm はロックを取らずに読むので、直後に VM が切り替わることもあるが、
+// その場合も VM に復帰するときには必ず仮想割込みが設定し直される
+void kick_vm(struct vm_struct *vm) {
+	int cpuid = find_cpu_which_runs(vm);
+	if (cpuid >= 0) {
+		if (cpuid != get_cpuid()) {
+			send_ipi(cpuid, IPI_VIRQ);
+		}
+		return;
+	}
+
+	if (vm->state != VM_RUNNABLE) {
+		return;
+	}
+	if (!__atomic_exchange_n(&vm->boosted, 1, __ATOMIC_ACQ_REL)) {
+		__atomic_fetch_add(&nr_boosted, 1, __ATOMIC_RELEASE);
+	}
+	for (int i = 0; i < NUMBER_OF_CPU_CORES; i++) {
+		struct vm_struct *current = cpu_core(i)->current_vm;
+		if (current && current->vmid < NUMBER_OF_CPU_CORES && i != get_cpuid()) {
+			smp_send_reschedule(i);
+			break;
+		}
+	}
+}
+
+// VMID が vmid の VM を返す(なければ NULL)
+// 返した VM はスケジューラのループに戻るまで(CPU を譲るまで)は解放されない
+struct vm_struct *vm_get(int vmid) {
+	if (vmid < 0 || vmid >= NUMBER_OF_VMS) {
+		return NULL;
+	}
+	return rcu_dereference(vms[vmid]);
+}
+
+// vms[] を走査するときの上限
+int number_of_vm_slots(void) {
+	return __atomic_load_n(&current_number_of_vms, __ATOMIC_ACQUIRE);
+}
+
+// vm を VM 表に登録して VMID を返す(空きがなければ -1)
+// vmid が負なら、idle vm の後ろで空いている最初の場所を使う
+// vm->vmid を設定してから公開するので、vm_get で見つけた VM はすべて初期化済み
+int register_vm(struct vm_struct *vm, int vmid) {
+	acquire_lock(&vms_lock);
+	if (vmid < 0) {
+		for (int i = NUMBER_OF_CPU_CORES; i < NUMBER_OF_VMS; i++) {
+			if (!vms[i]) {
+				vmid = i;
+				break;
+			}
+		}
+	}
+	if (vmid < 0 || vms[vmid]) {
+		release_lock(&vms_lock);
+		return -1;
+	}
+	vm->vmid = vmid;
+	rcu_assign_pointer(vms[vmid], vm);
+	if (vmid >= current_number_of_vms) {
+		__atomic_store_n(&current_number_of_vms, vmid + 1, __ATOMIC_RELEASE);
+	}
+	release_lock(&vms_lock);
+	return vmid;
+}
+
+static void clear_boosted(struct vm_struct *vm);
+
+// 猶予期間が終わり、どのコアも vm を参照していなくなってから呼ばれる
+static void free_retired_vm(struct rcu_head *head) {
+	struct vm_struct *vm = (struct vm_struct *)((char *)head - offsetof(struct vm_struct, rcu));
+	// 猶予期間中に kick_vm で立てられた分も含めて数を戻す
+	clear_boosted(vm);
+	destroy_vm(vm);
+}
+
+// 終了した vm を VM 表から外し、猶予期間の後に解放する
+// vm を最後に実行していたコアのスケジューラから、切り替え終わった後に呼ばれる
+static void retire_vm(struct vm_struct *vm) {
+	acquire_lock(&vms_lock);
+	rcu_assign_pointer(vms[vm->vmid], NULL);
+	release_lock(&vms_lock);
+
+	// VM 表以外で vm を長く覚えているのは共有メモリの相手だけなので、そこからも外す
+	shm_detach_vm(vm);
+
+	call_rcu(&vm->rcu, free_retired_vm);
+}
+
 // タイマが発火すると呼ばれ、VM 切り替えを行う
 void timer_tick() {
 	yield();
 }
 
+// 実行中の VM を終了させる(戻ってこない)
+// リソースは、切り替え終わった後にスケジューラが retire_vm で解放する
 void exit_vm(){
-	// todo: リソースを解放する(コンソールとかメモリページとか)
+	struct vm_struct *vm = current_cpu_core()->current_vm;
 
 	// 実行中の VM のstate を zombie にする(=スケジューリング対象から外れる)
-	current_cpu_core()->current_vm->state = VM_ZOMBIE;
+	acquire_lock(&vm->lock);
+	vm->state = VM_ZOMBIE;
+	switch_to_scheduler(vm);
+}
 
-	yield();
+// kill_vm から他のコアへの呼び出しとして実行される(割込みハンドラの中なので yield しない)
+// このコアで実行中なら、割込みから復帰するときの vm_entering_work で VM が終了する
+// 他のコアに移っていたらそちらに IPI を送り直し、実行されていなければ優先して実行させる
+static void kick_vm_on_cpu(void *arg) {
+	struct vm_struct *vm = vm_get((long)arg);
+	if (vm) {
+		kick_vm(vm);
+	}
+}
+
+// VM を終了させる(他のコアで実行中の VM でもよい)
+// その場では止めずに印をつけるだけで、VM が次に復帰しようとしたとき(vm_entering_work)に終了する
+//   SD カードの転送中や、待ち行列やスリープロックを持ったまま止めると後始末できないため
+// 他のコアで実行中なら、そのコアへの呼び出しで VM exit させる
+// 実行されていなければ優先して実行させる
+void kill_vm(struct vm_struct *vm) {
+	__atomic_store_n(&vm->killed, 1, __ATOMIC_RELEASE);
+
+	int cpuid = find_cpu_which_runs(vm);
+	if (cpuid >= 0 && cpuid != get_cpuid()) {
+		// 呼び出しの実行までに vm が解放されていてもよいように VMID を渡す
+		smp_call_function_single(cpuid, kick_vm_on_cpu, (void *)vm->vmid, 0);
+		return;
+	}
+	kick_vm(vm);
 }
 
 void set_cpu_sysregs(struct vm_struct *tsk) {
@@ -54,10 +227,57 @@ void set_cpu_sysregs(struct vm_struct *tsk) {
 	restore_sysregs(&tsk->cpu_sysregs);
 }
 
+// CNTPCT のティック数 ticks が入るヒストグラムのビンを返す
+static int vm_exit_hist_bucket(unsigned long ticks) {
+	int n = 63 - __builtin_clzl(ticks | 1);
+	return MIN(n, VM_EXIT_HIST_BUCKETS - 1);
+}
+
+static void account_vm_exit(struct vm_struct *vm, int reason, unsigned long ticks) {
+	struct vm_exit_stat *stat = &vm->exit_stats->reasons[reason];
+	stat->count++;
+	stat->ticks += ticks;
+	stat->hist[vm_exit_hist_bucket(ticks)]++;
+	vm->exit_stats->hv_ticks += ticks;
+}
+
+// 前回 VM に復帰してから now までをゲストの実行時間として記録する
+static void account_guest_time(struct vm_struct *vm, unsigned long now) {
+	if (!vm->exit_stats || !vm->enter_ticks) {
+		return;
+	}
+	unsigned long ticks = now - vm->enter_ticks;
+	vm->exit_stats->guest_ticks += ticks;
+
+	struct cpu_core_struct *cpu_core = current_cpu_core();
+	if (vm->vmid < NUMBER_OF_CPU_CORES) {
+		cpu_core->idle_ticks += ticks;
+	}
+	else {
+		cpu_core->guest_ticks += ticks;
+	}
+}
+
+// 高速パスのハイパーコール(kernel_entry/kernel_exit を通らない)の時間を記録する
+// start はハンドラを呼ぶ前の CNTPCT
+void account_fast_vm_exit(struct vm_struct *vm, unsigned long start) {
+	unsigned long now = get_cntpct();
+	if (vm->exit_stats) {
+		account_vm_exit(vm, VM_EXIT_HVC_FAST, now - start);
+	}
+	// 次の VM exit でゲストの実行時間に含めないよう、復帰した時刻をずらす
+	vm->enter_ticks += now - start;
+}
+
 // ハイパーバイザでの処理を終えて VM に処理を戻すときに kernel_exit から呼ばれる
 void vm_entering_work() {
 	struct vm_struct *vm = current_cpu_core()->current_vm;
 
+	// kill_vm されていたら、ゲストに戻らずにここで終了する
+	if (__atomic_load_n(&vm->killed, __ATOMIC_ACQUIRE)) {
+		exit_vm();
+	}
+
 	if (HAVE_FUNC(vm->board_ops, entering_vm)) {
 		vm->board_ops->entering_vm(vm);
 	}
@@ -68,6 +288,10 @@ void vm_entering_work() {
 		flush_vm_console(vm);
 	}
 
+	// ゲストの notify を待たずに処理できる virtqueue のリクエストを処理する
+	// 完了通知の仮想割込みは、この後の set_cpu_virtual_interrupt で設定される
+	virtio_poll(vm);
+
 	// todo: entering_vm, flush, set_cpu_sysregs, set_cpu_virtual_interrupt の正しい呼び出し順がわからない
 	// 控えておいたレジスタの値を戻す
 	set_cpu_sysregs(vm);
@@ -76,12 +300,26 @@ void vm_entering_work() {
 	//   ハイパーバイザ環境では VM に対し割込みを発生させる必要があるので
 	//   VM が実行開始するタイミングで仮想割込みを生成しないといけない
 	set_cpu_virtual_interrupt(vm);
+
+	// VM exit にかかった時間を記録する
+	// 最初に VM を起動したとき(switch_from_kthread)は対応する VM exit がない
+	unsigned long now = get_cntpct();
+	if (vm->exit_stats && vm->exit_ticks) {
+		account_vm_exit(vm, vm->exit_reason, now - vm->exit_ticks);
+	}
+	vm->enter_ticks = now;
 }
 
 // VM での処理を抜けてハイパーバイザに処理に入るときに kernel_entry から呼ばれる
 void vm_leaving_work() {
 	struct vm_struct *vm = current_cpu_core()->current_vm;
 
+	unsigned long now = get_cntpct();
+	account_guest_time(vm, now);
+	vm->exit_ticks = now;
+	// 要因は各ハンドラで上書きされる
+	vm->exit_reason = VM_EXIT_IRQ;
+
 	// 今のレジスタの値を控える
 	save_sysregs(&vm->cpu_sysregs);
 
@@ -98,6 +336,7 @@ const char *vm_state_str[] = {
 	"RUNNING",
 	"RUNNABLE",
 	"ZOMBIE",
+	"BLOCKED",
 };
 
 int find_cpu_which_runs(struct vm_struct *vm) {
@@ -112,11 +351,15 @@ int find_cpu_which_runs(struct vm_struct *vm) {
 void show_vm_list() {
     printf("  %4s %3s %12s %8s %7s %9s %7s %7s %7s %7s %7s\n",
 		   "vmid", "cpu", "name", "state", "pages", "saved-pc", "wfx", "hvc", "sysregs", "pf", "mmio");
-    for (int i = 0; i < current_number_of_vms; i++) {
-        struct vm_struct *vm = vms[i];
+    int nr_slots = number_of_vm_slots();
+    for (int i = 0; i < nr_slots; i++) {
+        struct vm_struct *vm = vm_get(i);
+		if (!vm) {
+			continue;
+		}
 		int cpuid = find_cpu_which_runs(vm);
         printf("%c %4d   %c %12s %8s %7d %9x %7d %7d %7d %7d %7d\n",
-               is_uart_forwarded_vm(vms[i]) ? '*' : ' ',
+               is_uart_forwarded_vm(vm) ? '*' : ' ',
 			   vm->vmid,
 			   // CPUID は1桁のみ対応
 			   (cpuid < 0 || vm->state == VM_ZOMBIE? '-' : '0' + cpuid),
@@ -132,10 +375,163 @@ void show_vm_list() {
     }
 }
 
+static const char *vm_exit_reason_str[NR_VM_EXIT_REASONS] = {
+	"irq", "wfx", "hvc", "hvc-fast", "sysregs", "pf", "mmio",
+};
+
+// CNTPCT のティック数をナノ秒・マイクロ秒に変換する
+// ticks * 1000000000 はすぐにあふれるので、秒の部分と端数に分けて計算する
+unsigned long ticks_to_ns(unsigned long ticks, unsigned long freq) {
+	return ticks / freq * 1000000000 + ticks % freq * 1000000000 / freq;
+}
+
+unsigned long ticks_to_us(unsigned long ticks, unsigned long freq) {
+	return ticks_to_ns(ticks, freq) / 1000;
+}
+
+// CPU コアごとの時間の内訳と、VM ごとの VM exit の要因別の時間を表示する
+void show_vm_exit_stats() {
+	unsigned long freq = get_cntfrq();
+	unsigned long now = get_cntpct();
+
+	printf("  %3s %12s %12s %12s\n", "cpu", "guest(us)", "hyp(us)", "idle(us)");
+	for (int i = 0; i < NUMBER_OF_CPU_CORES; i++) {
+		struct cpu_core_struct *core = cpu_core(i);
+		unsigned long total = now - core->start_ticks;
+		unsigned long hv = total - core->guest_ticks - core->idle_ticks;
+		printf("  %3d %12ld %12ld %12ld\n", i,
+			   ticks_to_us(core->guest_ticks, freq), ticks_to_us(hv, freq), ticks_to_us(core->idle_ticks, freq));
+	}
+
+	int nr_slots = number_of_vm_slots();
+	for (int i = 0; i < nr_slots; i++) {
+		struct vm_struct *vm = vm_get(i);
+		if (!vm || !vm->exit_stats) {
+			continue;
+		}
+		struct vm_exit_stats *stats = vm->exit_stats;
+		printf("vmid %d (%s): guest %ld us, hypervisor %ld us\n", vm->vmid, vm->name ? vm->name : "",
+			   ticks_to_us(stats->guest_ticks, freq), ticks_to_us(stats->hv_ticks, freq));
+		printf("  %8s %8s %10s %8s  %s\n", "reason", "count", "total(us)", "avg(ns)", "histogram(log2 ticks)");
+		for (int r = 0; r < NR_VM_EXIT_REASONS; r++) {
+			struct vm_exit_stat *stat = &stats->reasons[r];
+			if (stat->count == 0) {
+				continue;
+			}
+			printf("  %8s %8ld %10ld %8ld ", vm_exit_reason_str[r], stat->count,
+				   ticks_to_us(stat->ticks, freq), ticks_to_ns(stat->ticks, freq) / stat->count);
+			for (int b = 0; b < VM_EXIT_HIST_BUCKETS; b++) {
+				printf(" %ld", stat->hist[b]);
+			}
+			printf("\n");
+		}
+		for (int id = 0; id <= SYSREG_UNHANDLED; id++) {
+			if (stats->sysreg_traps[id] > 0) {
+				printf("  sysreg %16s %8ld\n", sysreg_name(id), stats->sysreg_traps[id]);
+			}
+		}
+	}
+}
+
+// EL2 のメモリアクセスが支配的な処理の所要時間を測って表示する
+// EL2_CACHE=0 と 1 でビルドしたものを比べると、キャッシュの効果がわかる
+//   sysregs:  VM の切り替えで行う EL1 システムレジスタの退避と復帰
+//   page:     ページフォールトで行うページの確保(ゼロクリア)と解放
+//   vms scan: スケジューラが行う vms[] の走査
+//   memcpy など: 1 ページ分の操作(unaligned はコピー元を 1 バイトずらしたもの)
+#define EL2_BENCH_LOOPS 1000
+
+static void show_el2_bench(const char *name, unsigned long start, unsigned long freq) {
+	unsigned long ticks = get_cntpct() - start;
+	printf("  %16s %8ld ns\n", name, ticks_to_ns(ticks, freq) / EL2_BENCH_LOOPS);
+}
+
+void run_el2_bench(void) {
+	unsigned long freq = get_cntfrq();
+	struct cpu_sysregs regs;
+	unsigned long start;
+	volatile int runnable = 0;
+
+#if EL2_CACHE
+	printf("EL2 cache: enabled\n");
+#else
+	printf("EL2 cache: disabled\n");
+#endif
+
+	// 今の EL1 の値を読んでそのまま書き戻すので、実行中の VM には影響しない
+	start = get_cntpct();
+	for (int i = 0; i < EL2_BENCH_LOOPS; i++) {
+		save_sysregs(&regs);
+		restore_sysregs(&regs);
+	}
+	show_el2_bench("sysregs", start, freq);
+
+	start = get_cntpct();
+	for (int i = 0; i < EL2_BENCH_LOOPS; i++) {
+		free_page((void *)(get_free_page() + VA_START));
+	}
+	show_el2_bench("page", start, freq);
+
+	start = get_cntpct();
+	for (int i = 0; i < EL2_BENCH_LOOPS; i++) {
+		int nr_slots = number_of_vm_slots();
+		for (int j = 0; j < nr_slots; j++) {
+			struct vm_struct *vm = vm_get(j);
+			if (vm && vm->state == VM_RUNNABLE) {
+				runnable++;
+			}
+		}
+	}
+	show_el2_bench("vms scan", start, freq);
+
+	char *src = (char *)allocate_page();
+	char *dst = (char *)allocate_page();
+	if (!src || !dst) {
+		return;
+	}
+
+	start = get_cntpct();
+	for (int i = 0; i < EL2_BENCH_LOOPS; i++) {
+		memzero(dst, PAGE_SIZE);
+	}
+	show_el2_bench("memzero", start, freq);
+
+	start = get_cntpct();
+	for (int i = 0; i < EL2_BENCH_LOOPS; i++) {
+		memcpy(dst, src, PAGE_SIZE);
+	}
+	show_el2_bench("memcpy", start, freq);
+
+	start = get_cntpct();
+	for (int i = 0; i < EL2_BENCH_LOOPS; i++) {
+		memcpy(dst, src + 1, PAGE_SIZE - 1);
+	}
+	show_el2_bench("memcpy unaligned", start, freq);
+
+	// 後ろに重なっているので末尾からコピーされる
+	start = get_cntpct();
+	for (int i = 0; i < EL2_BENCH_LOOPS; i++) {
+		memmove(dst + 8, dst, PAGE_SIZE - 8);
+	}
+	show_el2_bench("memmove", start, freq);
+
+	free_page(src);
+	free_page(dst);
+}
+
+static void clear_boosted(struct vm_struct *vm) {
+	if (__atomic_exchange_n(&vm->boosted, 0, __ATOMIC_ACQ_REL)) {
+		__atomic_fetch_sub(&nr_boosted, 1, __ATOMIC_RELEASE);
+	}
+}
+
 // EL2 から EL1 に遷移し、VM を復帰させる
 static void schedule(struct vm_struct *vm) {
 	struct cpu_core_struct *cpu_core = current_cpu_core();
 
+	// ラウンドロビンの順番で実行された場合も、起こされた分の実行はこれで済んだことにする
+	clear_boosted(vm);
+
 	vm->state = VM_RUNNING;
 	cpu_core->current_vm = vm;
 
@@ -143,12 +539,58 @@ static void schedule(struct vm_struct *vm) {
 	cpu_switch_to(&cpu_core->scheduler_context, vm);
 
 	// ここに戻ってきたら、今まで動いていた VM を停止させる
-	vm->state = vm->state == VM_ZOMBIE ? VM_ZOMBIE : VM_RUNNABLE;
+	// 終了した VM や待ち行列で眠った VM は、そのままにしておく
+	if (vm->state == VM_RUNNING) {
+		vm->state = VM_RUNNABLE;
+	}
 	cpu_core->current_vm = NULL;
 }
 
+// vm が RUNNABLE なら実行し、実行したら 1 を返す
+// 呼び出し側はロックを取らずに state を見て候補を絞り、ここでロックを取って確かめ直す
+// 実行中に終了した VM は、最後に実行していたこのコアが VM 表から外す
+static int run_vm(struct vm_struct *vm) {
+	int exited = 0;
+
+	acquire_lock(&vm->lock);
+	int run = vm->state == VM_RUNNABLE;
+	if (run) {
+		schedule(vm);
+		exited = vm->state == VM_ZOMBIE;
+	}
+	release_lock(&vm->lock);
+
+	if (exited) {
+		retire_vm(vm);
+	}
+	return run;
+}
+
+// boosted が立っている VM があれば、ラウンドロビンの順番を待たずに実行する
+// 実行したら 1 を返す
+static int schedule_boosted_vm(void) {
+	if (!__atomic_load_n(&nr_boosted, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	int nr_slots = number_of_vm_slots();
+	for (int i = NUMBER_OF_CPU_CORES; i < nr_slots; i++) {
+		struct vm_struct *vm = vm_get(i);
+		if (!vm || !vm->boosted) {
+			continue;
+		}
+		if (run_vm(vm)) {
+			return 1;
+		}
+		// 終了した VM や、他のコアが先に実行した VM
+		clear_boosted(vm);
+	}
+	return 0;
+}
+
 // 各コア専用に用意された idle vm で実行され、タイマ割込みが発生するとここに帰ってくる
 // 切り替える前に必ず VM のロックを取り、切り替え終わったらすぐにロックを解放する
+// VM 表はロックを取らずに読み、RUNNABLE に見えた VM のロックだけを取る
+//   他のコアが VM を作ったり外したりしていても、ここで待たされることはない
 // todo: 割込みを無効にしないといけないタイミングがありそう
 // todo: hypervisor 実行中に割込みは処理してもいいが、コンテキストスイッチはしてはいけない
 void scheduler(unsigned long cpuid) {
@@ -164,23 +606,29 @@ void scheduler(unsigned long cpuid) {
 
 		// 単純なラウンドロビンで VM に CPU 時間を割り当てる
 		// 先頭の VM は idle vm なので飛ばす
-		for (int i = NUMBER_OF_CPU_CORES; i < NUMBER_OF_VMS; i++) {
-			vm = vms[i];
+		int nr_slots = number_of_vm_slots();
+		for (int i = NUMBER_OF_CPU_CORES; i < nr_slots; i++) {
+			// VM を切り替え終わったこの位置では、どの VM への参照も持っていない
+			rcu_quiescent();
 
-			acquire_lock(&vm->lock);
+			// 起こされた VM がいれば先に実行する
+			found |= schedule_boosted_vm();
 
 			// RUNNABLE 状態の VM を探す
-			if (vm && vm->state == VM_RUNNABLE) {
+			vm = vm_get(i);
+			if (vm && vm->state == VM_RUNNABLE && run_vm(vm)) {
 				found = 1;
-				schedule(vm);
 			}
-
-			release_lock(&vm->lock);
 		}
+		rcu_quiescent();
+
+		// 溜まっているログを出力する
+		// VM を動かしているコアでは VM の実行が遅れないよう少しだけにする
+		log_drain(found ? 1 : LOG_RING_ENTRIES);
 
 		// 全 VM を走査しても実行できる VM がひとつも見つからなかったら IDLE VM を実行
-		if (!found) {
-			vm = vms[cpuid];
+		if (!found && !schedule_boosted_vm()) {
+			vm = vm_get(cpuid);
 			acquire_lock(&vm->lock);
 			schedule(vm);
 			release_lock(&vm->lock);
@@ -188,22 +636,97 @@ void scheduler(unsigned long cpuid) {
 	}
 }
 
-// CPU 時間を手放し VM を切り替える
-void yield() {
+// vm->lock を取った状態で呼び、スケジューラに切り替える
+// また戻ってきたらロックを解放する
+static void switch_to_scheduler(struct vm_struct *vm) {
 	struct cpu_core_struct *cpu_core = current_cpu_core();
-	struct vm_struct *vm = cpu_core->current_vm;
-
-	// ロックを取ってから idle_vm に切り替える
-	acquire_lock(&vm->lock);
 
 	// 割込みの有効・無効状態は CPU の状態ではなくこのスレッドの状態なので、退避・復帰させる必要がある
-	int interrupt_enable = current_cpu_core()->interrupt_enable;
+	int interrupt_enable = cpu_core->interrupt_enable;
 
 	// スケジューラに復帰
+	unsigned long switched = get_cntpct();
 	cpu_switch_to(vm, &cpu_core->scheduler_context);
+	// 他の VM が動いていた間は、この VM の VM exit の処理時間に含めない
+	vm->exit_ticks += get_cntpct() - switched;
 
+	// 戻ってきたときは別のコアで動いているかもしれない
 	current_cpu_core()->interrupt_enable = interrupt_enable;
 
-	// また戻ってきたらロックを解放する
 	release_lock(&vm->lock);
 }
+
+// CPU 時間を手放し VM を切り替える
+void yield() {
+	struct vm_struct *vm = current_cpu_core()->current_vm;
+
+	// ロックを取ってから idle_vm に切り替える
+	acquire_lock(&vm->lock);
+	switch_to_scheduler(vm);
+}
+
+void init_wait_queue(struct wait_queue *wq, char *name) {
+	init_lock(&wq->lock, name);
+	wq->head = NULL;
+}
+
+// 今のコンテキストが待ち行列で眠れるなら 1 を返す
+//   IDLE VM やスケジューラ自身(初期化中を含む)には切り替え先に戻ってくる仕組みがない
+//   スピンロックを持ったまま切り替えると、他のコアがそのロックを待ち続けてしまう
+int can_sleep(void) {
+	struct cpu_core_struct *cpu_core = current_cpu_core();
+	struct vm_struct *vm = cpu_core->current_vm;
+	return vm && vm->vmid >= NUMBER_OF_CPU_CORES && cpu_core->number_of_off == 0;
+}
+
+// cond(arg) が 0 以外を返すまで、実行中の VM を BLOCKED にして CPU を譲る
+// can_sleep が 1 のときだけ呼べる
+// cond は wq->lock を取った状態で呼ばれるので、wake_up する側と食い違わない
+//   wake_up する側は、条件を変えてから wake_up を呼ぶこと
+void sleep_on(struct wait_queue *wq, wait_cond_t cond, void *arg) {
+	struct vm_struct *vm = current_cpu_core()->current_vm;
+
+	while (1) {
+		acquire_lock(&wq->lock);
+		if (cond(arg)) {
+			release_lock(&wq->lock);
+			return;
+		}
+
+		// スケジューラに切り替え終わるまで vm->lock を持っておくので、
+		// 切り替える前に wake_up されても、他のコアがこの VM を動かし始めることはない
+		// kill_vm されても VM が終了するのは復帰するとき(vm_entering_work)なので、
+		// 眠っている VM は必ず起こされてから終了する
+		acquire_lock(&vm->lock);
+		vm->state = VM_BLOCKED;
+		vm->wait_next = wq->head;
+		wq->head = vm;
+		release_lock(&wq->lock);
+
+		switch_to_scheduler(vm);
+	}
+}
+
+// wq で待っている VM をすべて RUNNABLE に戻す
+// 起きた VM は条件を見直し、満たされていなければまた眠る
+void wake_up(struct wait_queue *wq) {
+	acquire_lock(&wq->lock);
+	struct vm_struct *vm = wq->head;
+	wq->head = NULL;
+	release_lock(&wq->lock);
+
+	while (vm) {
+		struct vm_struct *next = vm->wait_next;
+		vm->wait_next = NULL;
+
+		acquire_lock(&vm->lock);
+		if (vm->state == VM_BLOCKED) {
+			vm->state = VM_RUNNABLE;
+		}
+		release_lock(&vm->lock);
+
+		// IDLE VM を動かしているコアがあれば、すぐに実行させる
+		kick_vm(vm);
+		vm = next;
+	}
+}
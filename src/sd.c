@@ -25,10 +25,14 @@
 
 #include "peripherals/base.h"
 #include "peripherals/gpio.h"
+#include "peripherals/dma.h"
 #include "debug.h"
 #include "delays.h"
+#include "dma.h"
 #include "sd.h"
 #include "spinlock.h"
+#include "wait.h"
+#include "systimer.h"
 #include "utils.h"
 
 // SD カードにアクセスするための規格を SDHCI と呼ぶ
@@ -85,6 +89,8 @@
 #define CMD_STOP_TRANS      0x0C030000  // Stop to read data
 #define CMD_READ_SINGLE     0x11220010  // Read a block
 #define CMD_READ_MULTI      0x12220032  // Read multiple blocks
+#define CMD_WRITE_SINGLE    0x18220000  // Write a block
+#define CMD_WRITE_MULTI     0x19220022  // Write multiple blocks
 #define CMD_SET_BLOCKCNT    0x17020000  // For only MMC. Define number of blocks to transfer
                                         // with next multi-block read/write command.
 #define CMD_APP_CMD         0x37000000  // Leading command of ACMD<n> command
@@ -102,6 +108,8 @@
 #define INT_DATA_TIMEOUT    0x00100000
 #define INT_CMD_TIMEOUT     0x00010000
 #define INT_READ_RDY        0x00000020
+#define INT_WRITE_RDY       0x00000010
+#define INT_DATA_DONE       0x00000002
 #define INT_CMD_DONE        0x00000001
 
 #define INT_ERROR_MASK      0x017E8000
@@ -145,6 +153,29 @@ unsigned long sd_scr[2], sd_ocr, sd_rca, sd_err, sd_hv;
 // たとえば EMMC_INTERRUPT などのフラグはグローバルなので、それを触る処理はスレッドセーフではない
 struct spinlock sd_lock;
 
+// 転送の完了を待つ上限(マイクロ秒)
+#define SD_REQ_TIMEOUT_US   1000000
+
+// 読み込み要求のキュー(sd_lock で保護する)
+//   sd_active が DMA 転送中の要求で、完了すると次の要求がすぐに開始される
+static struct sd_request *sd_queue_head, *sd_queue_tail;
+static struct sd_request *sd_active;
+static unsigned long sd_active_start;
+static int sd_active_phase;
+static struct dma_control_block sd_dma_cb;
+
+// sd_active の進み具合
+//   CMD: 読み込みコマンドを発行し、EMMC にデータが届く(READ_RDY)のを待っている
+//   DMA: DMA で EMMC_DATA からバッファに転送している
+//   DATA: DMA は終わったので、EMMC の DATA_DONE を待っている
+#define SD_PHASE_CMD    0
+#define SD_PHASE_DMA    1
+#define SD_PHASE_DATA   2
+
+// 要求の完了を待つ VM の待ち行列
+// 要求を完了させた側は、sd_lock を解放してから wake_up する
+static struct wait_queue sd_wait_queue;
+
 /**
  * Wait for data or command ready
  */
@@ -248,54 +279,26 @@ int sd_cmd(unsigned int code, unsigned int arg)
     return 0;
 }
 
-/**
- * read a block from sd card and return the number of bytes read
- * returns 0 on error.
- */
-int sd_readblock(unsigned int lba, unsigned char *buffer, unsigned int num) {
-    acquire_lock(&sd_lock);
-
+// PIO で EMMC_DATA からブロックを読み込む
+// バイト単位でアドレスを指定する SDSC カード(CCS 非対応)のときだけ使う
+static int sd_read_pio(struct sd_request *req) {
     int r, c = 0, d;
-    if (num < 1) {
-        num = 1;
-    }
-    // INFO("sd_readblock lba %x num %x", lba, num);
+    unsigned int *buf = (unsigned int *)req->buffer;
+
     if (sd_status(SR_DAT_INHIBIT)) {
         sd_err = SD_TIMEOUT;
-        release_lock(&sd_lock);
-        return 0;
+        return SD_TIMEOUT;
     }
-    unsigned int *buf = (unsigned int *)buffer;
-    if (sd_scr[0] & SCR_SUPP_CCS) {
-        if (num > 1 && (sd_scr[0] & SCR_SUPP_SET_BLKCNT)) {
-            sd_cmd(CMD_SET_BLOCKCNT, num);
-            if (sd_err) {
-                release_lock(&sd_lock);
-                return 0;
-            }
-        }
-        put32(EMMC_BLKSIZECNT, (num << 16) | 512);
-        sd_cmd(num == 1 ? CMD_READ_SINGLE : CMD_READ_MULTI, lba);
+    put32(EMMC_BLKSIZECNT, (1 << 16) | 512);
+    while (c < req->num) {
+        sd_cmd(CMD_READ_SINGLE, (req->lba + c) * 512);
         if (sd_err) {
-            release_lock(&sd_lock);
-            return 0;
-        }
-    } else {
-        put32(EMMC_BLKSIZECNT, (1 << 16) | 512);
-    }
-    while (c < num) {
-        if (!(sd_scr[0] & SCR_SUPP_CCS)) {
-            sd_cmd(CMD_READ_SINGLE, (lba + c) * 512);
-            if (sd_err) {
-                release_lock(&sd_lock);
-                return 0;
-            }
+            return sd_err;
         }
         if ((r = sd_int(INT_READ_RDY))) {
             WARN("ERROR: Timeout waiting for ready to read");
             sd_err = r;
-            release_lock(&sd_lock);
-            return 0;
+            return r;
         }
         for (d = 0; d < 128; d++) {
             buf[d] = get32(EMMC_DATA);
@@ -303,14 +306,305 @@ int sd_readblock(unsigned int lba, unsigned char *buffer, unsigned int num) {
         c++;
         buf += 128;
     }
-    if (num > 1 && !(sd_scr[0] & SCR_SUPP_SET_BLKCNT) &&
-        (sd_scr[0] & SCR_SUPP_CCS)) {
+    return SD_OK;
+}
+
+// PIO で EMMC_DATA にブロックを書き込む
+// 書き込みは読み込みほど頻繁ではないので DMA は使わず、キューの順番が来たらその場で書いてしまう
+static int sd_write_pio(struct sd_request *req) {
+    int r, c = 0, d;
+    unsigned int *buf = (unsigned int *)req->buffer;
+
+    if (sd_status(SR_DAT_INHIBIT)) {
+        sd_err = SD_TIMEOUT;
+        return SD_TIMEOUT;
+    }
+    if (req->num > 1 && (sd_scr[0] & SCR_SUPP_SET_BLKCNT)) {
+        sd_cmd(CMD_SET_BLOCKCNT, req->num);
+        if (sd_err) {
+            return sd_err;
+        }
+    }
+
+    put32(EMMC_BLKSIZECNT, (req->num << 16) | 512);
+    // SDSC カードはバイト単位、SDHC 以降はブロック単位でアドレスを指定する
+    unsigned int addr = (sd_scr[0] & SCR_SUPP_CCS) ? req->lba : req->lba * 512;
+    sd_cmd(req->num == 1 ? CMD_WRITE_SINGLE : CMD_WRITE_MULTI, addr);
+    if (sd_err) {
+        return sd_err;
+    }
+
+    while (c < req->num) {
+        if ((r = sd_int(INT_WRITE_RDY))) {
+            WARN("ERROR: Timeout waiting for ready to write");
+            sd_err = r;
+            return r;
+        }
+        for (d = 0; d < 128; d++) {
+            put32(EMMC_DATA, buf[d]);
+        }
+        c++;
+        buf += 128;
+    }
+
+    if ((r = sd_int(INT_DATA_DONE))) {
+        WARN("ERROR: Timeout waiting for data done");
+        sd_err = r;
+        return r;
+    }
+    if (req->num > 1 && !(sd_scr[0] & SCR_SUPP_SET_BLKCNT)) {
         sd_cmd(CMD_STOP_TRANS, 0);
     }
+    return SD_OK;
+}
+
+// DMA で EMMC_DATA から直接バッファに転送する読み込みを開始する
+// ここではコマンドを発行するだけで、DMA は READ_RDY が立ってから sd_check_active で開始する
+// 完了は DMA の割込み(もしくは sd_poll)で検知する
+static int sd_start_dma_read(struct sd_request *req) {
+    if (sd_status(SR_DAT_INHIBIT)) {
+        sd_err = SD_TIMEOUT;
+        return SD_TIMEOUT;
+    }
+    if (req->num > 1 && (sd_scr[0] & SCR_SUPP_SET_BLKCNT)) {
+        sd_cmd(CMD_SET_BLOCKCNT, req->num);
+        if (sd_err) {
+            return sd_err;
+        }
+    }
+
+    // EMMC の DREQ に合わせて EMMC_DATA(固定アドレス)からバッファ(インクリメント)へ転送する
+    sd_dma_cb.ti = DMA_TI_SRC_DREQ | DMA_TI_PERMAP(DMA_DREQ_EMMC) |
+                   DMA_TI_DEST_INC | DMA_TI_WAIT_RESP | DMA_TI_INTEN;
+    sd_dma_cb.source_ad = dma_bus_addr_peripheral(EMMC_DATA);
+    sd_dma_cb.dest_ad = dma_bus_addr_memory(req->buffer);
+    sd_dma_cb.txfr_len = req->num * 512;
+    sd_dma_cb.stride = 0;
+    sd_dma_cb.nextconbk = 0;
+    // 転送中にダーティなラインが追い出されて DMA の書いたデータを壊さないように、先に書き戻して捨てておく
+    dcache_flush_range(req->buffer, req->num * 512);
+
+    // DREQ を待たずに EMMC_DATA を読みにいく実装(QEMU など)もあるので、
+    // DMA はコマンドを発行してデータが届いてから(READ_RDY が立ってから)開始する
+    put32(EMMC_BLKSIZECNT, (req->num << 16) | 512);
+    sd_cmd(req->num == 1 ? CMD_READ_SINGLE : CMD_READ_MULTI, req->lba);
+    if (sd_err) {
+        return sd_err;
+    }
+    sd_active_phase = SD_PHASE_CMD;
+    return SD_OK;
+}
+
+// 実行中の要求を完了させる(sd_lock を取った状態で呼ぶこと)
+// 割込みの中からも呼ばれるので、ここでは EMMC の状態を待たない
+static void sd_finish_active(int status) {
+    struct sd_request *req = sd_active;
+
+    if (status == SD_OK) {
+        // 転送中に投機的に読み込まれたラインを捨て、DMA が書いたデータを読めるようにする
+        // バッファはキャッシュラインに揃っているとは限らないので、前後の同じラインにある
+        // データを失わないように invalidate ではなく clean & invalidate する
+        dcache_flush_range(req->buffer, req->num * 512);
+    } else {
+        dma_abort(SD_DMA_CHANNEL);
+    }
+
+    if (req->num > 1 && !(sd_scr[0] & SCR_SUPP_SET_BLKCNT)) {
+        sd_cmd(CMD_STOP_TRANS, 0);
+    }
+
+    sd_active = NULL;
+    req->status = status;
+}
+
+// 実行中の要求の状態を一度だけ確認して、次の段階に進める(sd_lock を取った状態で呼ぶこと)
+// 割込みの中から呼ばれるので待たずに戻る。要求を完了させたら 1 を返す
+static int sd_check_active() {
+    unsigned int r = get32(EMMC_INTERRUPT);
+
+    if (r & INT_ERROR_MASK) {
+        put32(EMMC_INTERRUPT, r);
+        WARN("ERROR: EMMC read failed(interrupt: %x)", r);
+        sd_finish_active((r & (INT_CMD_TIMEOUT | INT_DATA_TIMEOUT)) ? SD_TIMEOUT : SD_ERROR);
+        return 1;
+    }
+
+    if (sd_active_phase == SD_PHASE_CMD && (r & INT_READ_RDY)) {
+        // 残りのブロックは DREQ に合わせて DMA が読み出す
+        put32(EMMC_INTERRUPT, INT_READ_RDY);
+        dma_start(SD_DMA_CHANNEL, &sd_dma_cb);
+        sd_active_phase = SD_PHASE_DMA;
+    }
+    if (sd_active_phase == SD_PHASE_DMA && dma_is_done(SD_DMA_CHANNEL)) {
+        if (dma_has_error(SD_DMA_CHANNEL)) {
+            WARN("ERROR: DMA transfer failed(debug: %x)", get32(DMA_DEBUG(SD_DMA_CHANNEL)));
+            sd_finish_active(SD_ERROR);
+            return 1;
+        }
+        dma_clear(SD_DMA_CHANNEL);
+        sd_active_phase = SD_PHASE_DATA;
+        // DMA が最後のブロックを読み終えた時点で DATA_DONE が立っていることが多い
+        r = get32(EMMC_INTERRUPT);
+    }
+    if (sd_active_phase == SD_PHASE_DATA && (r & INT_DATA_DONE)) {
+        put32(EMMC_INTERRUPT, INT_DATA_DONE);
+        sd_finish_active(SD_OK);
+        return 1;
+    }
+    return 0;
+}
+
+// キューの先頭から要求を取り出して実行を開始する(sd_lock を取った状態で呼ぶこと)
+// PIO で処理するなど、その場で完了させた要求の数を返す
+static int sd_start_next() {
+    int completed = 0;
+
+    while (!sd_active && sd_queue_head) {
+        struct sd_request *req = sd_queue_head;
+        sd_queue_head = req->next;
+        if (!sd_queue_head) {
+            sd_queue_tail = NULL;
+        }
+        req->next = NULL;
+
+        if (req->write) {
+            req->status = sd_write_pio(req);
+            completed++;
+            continue;
+        }
+
+        if (!(sd_scr[0] & SCR_SUPP_CCS)) {
+            // SDSC カードは PIO でその場で読んでしまう
+            req->status = sd_read_pio(req);
+            completed++;
+            continue;
+        }
+
+        int r = sd_start_dma_read(req);
+        if (r != SD_OK) {
+            req->status = r;
+            completed++;
+            continue;
+        }
+        sd_active = req;
+        sd_active_start = get_physical_systimer_count();
+        // 既にデータが届いていれば、次の割込みを待たずに DMA を開始する
+        if (sd_check_active()) {
+            completed++;
+        }
+    }
+    return completed;
+}
+
+void sd_init_request(struct sd_request *req, unsigned int lba, unsigned char *buffer, unsigned int num) {
+    req->lba = lba;
+    req->buffer = buffer;
+    req->num = num < 1 ? 1 : num;
+    req->status = SD_REQ_PENDING;
+    req->write = 0;
+    req->next = NULL;
+}
+
+// 読み込み要求をキューにつなぐ
+// コントローラが空いていればすぐに転送を開始し、そうでなければ前の要求の完了時に開始される
+void sd_submit(struct sd_request *req) {
+    acquire_lock(&sd_lock);
+
+    req->status = SD_REQ_PENDING;
+    req->next = NULL;
+    if (sd_queue_tail) {
+        sd_queue_tail->next = req;
+    } else {
+        sd_queue_head = req;
+    }
+    sd_queue_tail = req;
+
+    int completed = sd_start_next();
 
     release_lock(&sd_lock);
 
-    return sd_err != SD_OK || c != num ? 0 : num * 512;
+    if (completed) {
+        wake_up(&sd_wait_queue);
+    }
+}
+
+// 実行中の転送を次の段階に進め、終わっていれば完了させて次の要求を開始する
+// DMA の完了割込みと、READ_RDY・DATA_DONE の確認と転送のタイムアウトを見るための
+// システムタイマ割込み(どちらもコア0)から呼ばれる
+// 割込みが使えない状況では待っている側がこれを呼ぶ
+void sd_poll() {
+    int completed = 0;
+
+    acquire_lock(&sd_lock);
+
+    if (sd_active) {
+        if (sd_check_active()) {
+            completed++;
+        }
+        else if (get_physical_systimer_count() - sd_active_start > SD_REQ_TIMEOUT_US) {
+            WARN("ERROR: Timeout waiting for DMA transfer");
+            sd_finish_active(SD_TIMEOUT);
+            completed++;
+        }
+    }
+    else if (dma_is_done(SD_DMA_CHANNEL)) {
+        // 既に完了させた転送の割込みが残っている
+        dma_clear(SD_DMA_CHANNEL);
+    }
+    completed += sd_start_next();
+
+    release_lock(&sd_lock);
+
+    if (completed) {
+        wake_up(&sd_wait_queue);
+    }
+}
+
+static int sd_request_done(void *arg) {
+    struct sd_request *req = arg;
+    return req->status != SD_REQ_PENDING;
+}
+
+// 要求が完了するまで待ち、読み込んだバイト数を返す(エラーなら 0)
+// VM のコンテキスト(ローダなど)からなら、完了するまで VM を眠らせて CPU を他の VM に譲る
+// 眠れない場合は、これまでどおり sd_poll を呼びながら待つ
+int sd_wait(struct sd_request *req) {
+    if (can_sleep()) {
+        sleep_on(&sd_wait_queue, sd_request_done, req);
+    }
+    while (req->status == SD_REQ_PENDING) {
+        sd_poll();
+    }
+    return req->status == SD_OK ? req->num * 512 : 0;
+}
+
+// DMA チャネルの完了割込みから呼ばれる
+void handle_sd_dma_irq() {
+    sd_poll();
+}
+
+// 要求が完了するまで待ち、書き込んだバイト数を返す(エラーなら 0)
+// 書き込みも読み込みと同じキューに並べるので、実行中の DMA 転送と衝突しない
+int sd_writeblock(unsigned int lba, unsigned char *buffer, unsigned int num) {
+    struct sd_request req;
+
+    sd_init_request(&req, lba, buffer, num);
+    req.write = 1;
+    sd_submit(&req);
+    return sd_wait(&req);
+}
+
+/**
+ * read a block from sd card and return the number of bytes read
+ * returns 0 on error.
+ */
+int sd_readblock(unsigned int lba, unsigned char *buffer, unsigned int num) {
+    struct sd_request req;
+
+    // INFO("sd_readblock lba %x num %x", lba, num);
+    sd_init_request(&req, lba, buffer, num);
+    sd_submit(&req);
+    return sd_wait(&req);
 }
 
 /**
@@ -398,6 +692,8 @@ int sd_init() {
     long r, cnt, ccs = 0;
 
     init_lock(&sd_lock, "sd_lock");
+    init_wait_queue(&sd_wait_queue, "sd_wait");
+    dma_init_channel(SD_DMA_CHANNEL);
 
     // GPIO_CD
     r = get32(GPFSEL4);
@@ -0,0 +1,215 @@
+#include "shm.h"
+#include "sched.h"
+#include "mm.h"
+#include "arm/mmu.h"
+#include "utils.h"
+#include "spinlock.h"
+#include "debug.h"
+
+struct shm_region {
+	char name[SHM_NAME_LEN];        // name[0] == '\0' なら未使用
+	int nr_pages;
+	unsigned long pages[SHM_MAX_PAGES];     // 物理アドレス
+	int nr_peers;
+	struct vm_struct *peers[SHM_MAX_PEERS];
+};
+
+static struct shm_region shm_regions[SHM_MAX_REGIONS];
+static struct spinlock shm_lock = SPINLOCK_INIT("shm");
+
+static int name_equals(const char *a, const char *b) {
+	for (int i = 0; i < SHM_NAME_LEN; i++) {
+		if (a[i] != b[i]) {
+			return 0;
+		}
+		if (a[i] == '\0') {
+			return 1;
+		}
+	}
+	return 1;
+}
+
+static int find_region(const char *name) {
+	for (int i = 0; i < SHM_MAX_REGIONS; i++) {
+		if (shm_regions[i].name[0] != '\0' && name_equals(shm_regions[i].name, name)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// 新しい領域を作り、ゼロクリアしたページを確保する
+// shm_lock を取った状態で呼ぶこと
+static int create_region(const char *name, int nr_pages) {
+	int id = -1;
+	for (int i = 0; i < SHM_MAX_REGIONS; i++) {
+		if (shm_regions[i].name[0] == '\0') {
+			id = i;
+			break;
+		}
+	}
+	if (id < 0) {
+		WARN("no free shared memory region");
+		return -1;
+	}
+
+	struct shm_region *shm = &shm_regions[id];
+	for (int i = 0; i < nr_pages; i++) {
+		unsigned long page = get_free_page();
+		if (!page) {
+			for (int j = 0; j < i; j++) {
+				free_page((void *)(shm->pages[j] + VA_START));
+			}
+			return -1;
+		}
+		sync_guest_memory((void *)(page + VA_START), PAGE_SIZE);
+		shm->pages[i] = page;
+	}
+	for (int i = 0; i < SHM_NAME_LEN; i++) {
+		shm->name[i] = name[i];
+	}
+	shm->nr_pages = nr_pages;
+	shm->nr_peers = 0;
+	return id;
+}
+
+// 名前が name_va の共有メモリを vm の ipa から size バイト分マッピングし、領域の番号を返す
+// 同じ名前の領域がなければ size の大きさで作る
+// マッピング先の IPA にはまだ何もマッピングされていないこと(既にあるページを置き換えることはしない)
+long shm_map(struct vm_struct *vm, unsigned long name_va, unsigned long ipa, unsigned long size) {
+	char name[SHM_NAME_LEN];
+	if (copy_string_from_guest(name_va, name, sizeof(name)) < 0 || name[0] == '\0') {
+		return -1;
+	}
+	int nr_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	if ((ipa & (PAGE_SIZE - 1)) || nr_pages == 0 || nr_pages > SHM_MAX_PAGES) {
+		WARN("invalid shared memory: ipa 0x%lx, size 0x%lx", ipa, size);
+		return -1;
+	}
+
+	long ret = -1;
+	acquire_lock(&shm_lock);
+
+	int id = find_region(name);
+	if (id < 0) {
+		id = create_region(name, nr_pages);
+		if (id < 0) {
+			goto out;
+		}
+	}
+	struct shm_region *shm = &shm_regions[id];
+
+	if (nr_pages > shm->nr_pages) {
+		WARN("%s: shared memory is smaller than requested", name);
+		goto out;
+	}
+	if (shm->nr_peers == SHM_MAX_PEERS) {
+		WARN("%s: too many VMs share this memory", name);
+		goto out;
+	}
+	for (int i = 0; i < shm->nr_peers; i++) {
+		if (shm->peers[i] == vm) {
+			WARN("%s: already mapped", name);
+			goto out;
+		}
+	}
+	for (int i = 0; i < nr_pages; i++) {
+		if (!is_vm_page_unmapped(vm, ipa + i * PAGE_SIZE)) {
+			WARN("%s: IPA 0x%lx is already in use", name, ipa + i * PAGE_SIZE);
+			goto out;
+		}
+	}
+
+	// 未設定のエントリは TLB に載らないので、新しく書き込むだけでよい
+	for (int i = 0; i < nr_pages; i++) {
+		map_stage2_page(vm, ipa + i * PAGE_SIZE, shm->pages[i], MMU_STAGE2_PAGE_FLAGS);
+	}
+	shm->peers[shm->nr_peers++] = vm;
+	ret = id;
+
+out:
+	release_lock(&shm_lock);
+	return ret;
+}
+
+// 領域 id をマッピングしている vm 以外の VM に通知(doorbell)し、通知した VM の数を返す
+// 相手が他のコアで実行中なら kick_vm で VM exit させ、すぐに割込みを届ける
+long shm_notify(struct vm_struct *vm, unsigned long id) {
+	if (id >= SHM_MAX_REGIONS) {
+		return -1;
+	}
+
+	long ret = -1;
+	acquire_lock(&shm_lock);
+	struct shm_region *shm = &shm_regions[id];
+	for (int i = 0; i < shm->nr_peers; i++) {
+		if (shm->peers[i] == vm) {
+			ret = 0;
+			break;
+		}
+	}
+	// マッピングしていない VM からは通知させない
+	if (ret < 0) {
+		goto out;
+	}
+	for (int i = 0; i < shm->nr_peers; i++) {
+		struct vm_struct *peer = shm->peers[i];
+		if (peer == vm || peer->state == VM_ZOMBIE) {
+			continue;
+		}
+		// どの領域かを先に書いてから割込みを上げる
+		__atomic_fetch_or(&peer->shm_pending, 1UL << id, __ATOMIC_RELEASE);
+		raise_pv_irq(peer, PV_IRQ_SHM);
+		kick_vm(peer);
+		ret++;
+	}
+
+out:
+	release_lock(&shm_lock);
+	return ret;
+}
+
+// 通知があった領域のビットを返し、doorbell の割込みを落とす
+// 先に割込みを落としてから読むので、その間に来た通知は次の割込みで取りこぼさずに届く
+unsigned long shm_ack(struct vm_struct *vm) {
+	ack_pv_irq(vm, PV_IRQ_SHM);
+	return __atomic_exchange_n(&vm->shm_pending, 0, __ATOMIC_ACQ_REL);
+}
+
+// 終了した VM を、マッピングしているすべての領域の相手から外す
+// 外した後は shm_notify で通知されなくなる
+// 領域とそのページは、他の VM が後から同じ名前でマッピングできるように残しておく
+void shm_detach_vm(struct vm_struct *vm) {
+	acquire_lock(&shm_lock);
+	for (int id = 0; id < SHM_MAX_REGIONS; id++) {
+		struct shm_region *shm = &shm_regions[id];
+		for (int i = 0; i < shm->nr_peers; i++) {
+			if (shm->peers[i] == vm) {
+				shm->peers[i] = shm->peers[--shm->nr_peers];
+				break;
+			}
+		}
+	}
+	release_lock(&shm_lock);
+}
+
+// 物理アドレス pa のページが共有メモリの領域のものなら 1 を返す
+// VM のページを解放するとき、共有メモリのページを VM と一緒に解放しないようにするため
+int shm_owns_page(unsigned long pa) {
+	int owned = 0;
+	acquire_lock(&shm_lock);
+	for (int id = 0; id < SHM_MAX_REGIONS && !owned; id++) {
+		struct shm_region *shm = &shm_regions[id];
+		if (shm->name[0] == '\0') {
+			continue;
+		}
+		for (int i = 0; i < shm->nr_pages; i++) {
+			if (shm->pages[i] == pa) {
+				owned = 1;
+				break;
+			}
+		}
+	}
+	release_lock(&shm_lock);
+	return owned;
+}
@@ -0,0 +1,48 @@
+#include <stddef.h>
+#include "sleeplock.h"
+#include "sched.h"
+#include "cpu_core.h"
+
+void init_sleeplock(struct sleeplock *lock, char *name) {
+	init_wait_queue(&lock->wq, name);
+	lock->locked = 0;
+	lock->owner = NULL;
+	lock->name = name;
+}
+
+// wq.lock を取った状態で sleep_on から呼ばれる
+// 空いていればそのままロックを取る
+static int try_take_sleeplock(void *arg) {
+	struct sleeplock *lock = arg;
+	if (lock->locked) {
+		return 0;
+	}
+	lock->locked = 1;
+	lock->owner = current_cpu_core()->current_vm;
+	return 1;
+}
+
+void acquire_sleeplock(struct sleeplock *lock) {
+	if (can_sleep()) {
+		sleep_on(&lock->wq, try_take_sleeplock, lock);
+		return;
+	}
+
+	while (1) {
+		acquire_lock(&lock->wq.lock);
+		int taken = try_take_sleeplock(lock);
+		release_lock(&lock->wq.lock);
+		if (taken) {
+			return;
+		}
+	}
+}
+
+void release_sleeplock(struct sleeplock *lock) {
+	acquire_lock(&lock->wq.lock);
+	lock->locked = 0;
+	lock->owner = NULL;
+	release_lock(&lock->wq.lock);
+
+	wake_up(&lock->wq);
+}
@@ -0,0 +1,150 @@
+#include "smp.h"
+#include "cpu_core.h"
+#include "spinlock.h"
+#include "utils.h"
+#include "peripherals/mailbox.h"
+
+struct smp_call {
+	smp_call_func_t func;
+	void *arg;
+	volatile int *done;     // 実行が終わったら 1 足す(待たない呼び出しなら NULL)
+};
+
+// コアごとの呼び出し要求のキュー(リングバッファ)
+struct smp_call_queue {
+	struct spinlock lock;
+	unsigned int head;
+	unsigned int tail;
+	struct smp_call calls[SMP_CALL_QUEUE_SIZE];
+};
+
+static struct smp_call_queue call_queues[NUMBER_OF_CPU_CORES];
+
+// VM 切り替えの要求(smp_send_reschedule)
+//   resched_queued: 呼び出しをキューに積んだがまだ実行されていない(同じ要求をまとめる)
+//   need_resched: 呼び出しが実行され、handle_mailbox_irq での切り替えを待っている
+static volatile int resched_queued[NUMBER_OF_CPU_CORES];
+static volatile int need_resched[NUMBER_OF_CPU_CORES];
+
+void smp_init(void) {
+	for (int i = 0; i < NUMBER_OF_CPU_CORES; i++) {
+		init_lock(&call_queues[i].lock, "smp_call");
+		call_queues[i].head = 0;
+		call_queues[i].tail = 0;
+	}
+}
+
+// cpuid のコアのキューに呼び出し要求を積み、IPI を送る
+static void enqueue_call(unsigned long cpuid, smp_call_func_t func, void *arg, volatile int *done) {
+	struct smp_call_queue *q = &call_queues[cpuid];
+
+	while (1) {
+		acquire_lock(&q->lock);
+		if (q->tail - q->head < SMP_CALL_QUEUE_SIZE) {
+			struct smp_call *call = &q->calls[q->tail % SMP_CALL_QUEUE_SIZE];
+			call->func = func;
+			call->arg = arg;
+			call->done = done;
+			q->tail++;
+			release_lock(&q->lock);
+			break;
+		}
+		release_lock(&q->lock);
+		// キューが一杯なら、相手がこちらへの呼び出しを待っている場合に備えて自分宛ての分を処理しながら待つ
+		handle_smp_calls(get_cpuid());
+	}
+
+	send_ipi(cpuid, IPI_CALL);
+}
+
+// done が n になるまで、自分宛ての呼び出しを処理しながら待つ
+static void wait_for_calls(volatile int *done, int n) {
+	unsigned long cpuid = get_cpuid();
+	while (__atomic_load_n(done, __ATOMIC_ACQUIRE) < n) {
+		handle_smp_calls(cpuid);
+	}
+}
+
+// cpuid のコアで func(arg) を実行する
+// 自分のコアを指定した場合はその場で実行する
+int smp_call_function_single(unsigned long cpuid, smp_call_func_t func, void *arg, int wait) {
+	if (cpuid >= NUMBER_OF_CPU_CORES) {
+		return -1;
+	}
+	if (cpuid == get_cpuid()) {
+		func(arg);
+		return 0;
+	}
+
+	volatile int done = 0;
+	enqueue_call(cpuid, func, arg, wait ? &done : NULL);
+	if (wait) {
+		wait_for_calls(&done, 1);
+	}
+	return 0;
+}
+
+// 全コアで func(arg) を実行する(自分のコアでも実行する)
+void smp_call_function(smp_call_func_t func, void *arg, int wait) {
+	unsigned long self = get_cpuid();
+	volatile int done = 0;
+	int n = 0;
+
+	for (unsigned long i = 0; i < NUMBER_OF_CPU_CORES; i++) {
+		if (i != self) {
+			enqueue_call(i, func, arg, wait ? &done : NULL);
+			n++;
+		}
+	}
+	func(arg);
+	if (wait) {
+		wait_for_calls(&done, n);
+	}
+}
+
+// 割込みハンドラの中では切り替えられないので、印をつけるだけにする
+static void reschedule_on_cpu(void *arg) {
+	unsigned long cpuid = get_cpuid();
+	__atomic_store_n(&need_resched[cpuid], 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&resched_queued[cpuid], 0, __ATOMIC_RELEASE);
+}
+
+// cpuid のコアに VM を切り替えさせる(タイマ割込みの代わり)
+// 既に積んである要求がまだ実行されていなければ、新しく積まずにそれで済ませる
+void smp_send_reschedule(unsigned long cpuid) {
+	if (cpuid >= NUMBER_OF_CPU_CORES) {
+		return;
+	}
+	if (__atomic_exchange_n(&resched_queued[cpuid], 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+	smp_call_function_single(cpuid, reschedule_on_cpu, NULL, 0);
+}
+
+// 自分のコアへの VM 切り替えの要求を取り出す(要求があれば 1)
+// handle_smp_calls で呼び出しを処理し終えた後に呼ぶこと
+int smp_take_reschedule(unsigned long cpuid) {
+	return __atomic_exchange_n(&need_resched[cpuid], 0, __ATOMIC_ACQ_REL);
+}
+
+// cpuid(自分のコア)宛ての呼び出し要求をすべて実行する
+// IPI_CALL の割込みと、他のコアを待っている間に呼ばれる
+void handle_smp_calls(unsigned long cpuid) {
+	struct smp_call_queue *q = &call_queues[cpuid];
+
+	while (1) {
+		acquire_lock(&q->lock);
+		if (q->head == q->tail) {
+			release_lock(&q->lock);
+			return;
+		}
+		struct smp_call call = q->calls[q->head % SMP_CALL_QUEUE_SIZE];
+		q->head++;
+		release_lock(&q->lock);
+
+		call.func(call.arg);
+		if (call.done) {
+			__atomic_fetch_add(call.done, 1, __ATOMIC_RELEASE);
+		}
+	}
+}
@@ -5,19 +5,70 @@
 #include "spinlock.h"
 #include "irq.h"
 #include "cpu_core.h"
+#include "printf.h"
 
-// todo: sleeplock も実装したい
-//   sleeplock はスケジューラを使って実装する
-//   他プロセスとロックが重複したら、そのロックの ID を保持しつつプロセスを SLEEP させる
-//   他プロセスがロックを解放したら、そのロックの ID で待っているプロセス達を一斉に RUNNABLE にする
-//     1つのプロセスだけが sleeplock を取るために spinlock で守る必要あり
-//   最初にロックを取れたプロセス以外は再び SLEEP しないといけないので、sleeplock 内でループさせる
+// 長い間持つロックはスリープロック(sleeplock.h)を使う
 
-extern void _spinlock_acquire(unsigned long *);
-extern void _spinlock_release(unsigned long *);
+extern void _spinlock_acquire(unsigned int *);
+extern int _spinlock_try_acquire(unsigned int *);
+extern void _spinlock_release(unsigned int *);
+
+// チケットロックの owner と next が違えば誰かがロックを持っている
+static int is_locked(struct spinlock *lock) {
+    unsigned int ticket = lock->ticket;
+    return (ticket & 0xffff) != (ticket >> 16);
+}
 
 static int holding(struct spinlock *lock) {
-    return lock->locked && lock->cpuid == get_cpuid();
+    return is_locked(lock) && lock->cpuid == get_cpuid();
+}
+
+// このコアが lock を持っていれば 1 を返す
+int holding_lock(struct spinlock *lock) {
+    return holding(lock);
+}
+
+// ロックの名前ごとの統計
+// 最後のエントリは、表が一杯になったときに残りをまとめて数えるのに使う
+static struct lock_stat lock_stats[NR_LOCK_STATS];
+// lock_stats を探したり追加したりするときのロック(これ自体の統計は取らない)
+static unsigned int lock_stats_lock;
+
+static struct lock_stat *find_lock_stat(const char *name) {
+    struct lock_stat *stat = &lock_stats[NR_LOCK_STATS - 1];
+
+    if (!name) {
+        name = "(noname)";
+    }
+
+    _spinlock_acquire(&lock_stats_lock);
+    for (int i = 0; i < NR_LOCK_STATS - 1; i++) {
+        if (!lock_stats[i].name) {
+            lock_stats[i].name = name;
+            stat = &lock_stats[i];
+            break;
+        }
+        if (strcmp(lock_stats[i].name, name) == 0) {
+            stat = &lock_stats[i];
+            break;
+        }
+    }
+    if (!stat->name) {
+        stat->name = "(others)";
+    }
+    _spinlock_release(&lock_stats_lock);
+
+    return stat;
+}
+
+// 同じ名前のロックは別のコアから同時に数えられるので、アトミックに足す
+static void account_lock(struct spinlock *lock, int contended, unsigned long spin_ticks) {
+    struct lock_stat *stat = lock->stat;
+    __atomic_fetch_add(&stat->acquired, 1, __ATOMIC_RELAXED);
+    if (contended) {
+        __atomic_fetch_add(&stat->contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stat->spin_ticks, spin_ticks, __ATOMIC_RELAXED);
+    }
 }
 
 // 多重で CPU 割込みを禁止するときに使う、割込み禁止関数
@@ -50,9 +101,10 @@ void pop_disable_irq() {
 }
 
 void init_lock(struct spinlock *lock, char *name) {
-    lock->locked = 0;
+    lock->ticket = 0;
     lock->name = name;
     lock->cpuid = -1;
+    lock->stat = 0;
 }
 
 void acquire_lock(struct spinlock *lock) {
@@ -64,9 +116,43 @@ void acquire_lock(struct spinlock *lock) {
         PANIC("acquire: already locked by myself(cpu: %d)", cpuid);
     }
 
-    // サポートされるなら __sync_lock_test_and_set を使うほうがいい
-    _spinlock_acquire(&lock->locked);
+    if (!lock->stat) {
+        lock->stat = find_lock_stat(lock->name);
+    }
+
+    // 空いていればすぐに取れる
+    // 取れなかったときだけ、整理券を受け取って順番が来るまでの時間を測る
+    if (_spinlock_try_acquire(&lock->ticket)) {
+        lock->cpuid = cpuid;
+        account_lock(lock, 0, 0);
+        return;
+    }
+    unsigned long start = get_cntpct();
+    _spinlock_acquire(&lock->ticket);
     lock->cpuid = cpuid;
+    account_lock(lock, 1, get_cntpct() - start);
+}
+
+// ロックが取れなければ待たずに 0 を返す
+// 取れた場合は 1 を返すので、呼び出し側で release_lock すること
+int try_acquire_lock(struct spinlock *lock) {
+    push_disable_irq();
+
+    unsigned long cpuid = get_cpuid();
+    if (holding(lock)) {
+        PANIC("try_acquire: already locked by myself(cpu: %d)", cpuid);
+    }
+
+    if (!_spinlock_try_acquire(&lock->ticket)) {
+        pop_disable_irq();
+        return 0;
+    }
+    lock->cpuid = cpuid;
+    if (!lock->stat) {
+        lock->stat = find_lock_stat(lock->name);
+    }
+    account_lock(lock, 0, 0);
+    return 1;
 }
 
 void release_lock(struct spinlock *lock) {
@@ -75,7 +161,24 @@ void release_lock(struct spinlock *lock) {
     }
 
     lock->cpuid = -1;
-    _spinlock_release(&lock->locked);
+    _spinlock_release(&lock->ticket);
 
     pop_disable_irq();
 }
+
+// ロックの名前ごとに、取った回数と待った回数・時間を表示する
+// 待った回数や時間が多いロックが、コアを増やしても性能が伸びない原因になっている
+void show_lock_stats(void) {
+    unsigned long freq = get_cntfrq();
+
+    printf("  %16s %10s %10s %10s %8s\n", "name", "acquired", "contended", "spin(us)", "avg(ns)");
+    for (int i = 0; i < NR_LOCK_STATS; i++) {
+        struct lock_stat *stat = &lock_stats[i];
+        if (!stat->name) {
+            continue;
+        }
+        printf("  %16s %10ld %10ld %10ld %8ld\n", stat->name, stat->acquired, stat->contended,
+               ticks_to_us(stat->spin_ticks, freq),
+               stat->contended ? ticks_to_ns(stat->spin_ticks, freq) / stat->contended : 0);
+    }
+}
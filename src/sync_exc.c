@@ -5,6 +5,7 @@
 #include "vm.h"
 #include "arm/sysregs.h"
 #include "hypercall.h"
+#include "sysreg.h"
 
 // eclass のインデックスに合わせたエラーメッセージ
 static const char *sync_error_reasons[] = {
@@ -76,105 +77,6 @@ static void handle_trap_wfx() {
 	increment_current_pc(4);
 }
 
-static void handle_trap_system(unsigned long esr) {
-// ESR_EL2.ISS encding for an exception from MSR, MRS
-// IL[25] instruction length for synchronous exceptions
-//   0b0: 16-bit instruction trapped
-//   0b1: 32-bit instruction trapped
-// Op0[21:20]
-// Op2[19:17]
-// Op1[16:14]
-// CRn[13:10]
-// Rt[9:5]
-// CRm[4:1]
-// Direction[0]
-//   0b0: Write access, including MSR instructions
-//   0b1: Read access, including MRS instructions
-
-#define DEFINE_SYSREG_MSR(name, _op1, _crn, _crm, _op2) \
-	do { \
-		if (op1 == (_op1) && crn == (_crn) && crm == (_crm) && op2 == (_op2)) { \
-			current_cpu_core()->current_vm->cpu_sysregs.name = regs->regs[rt]; \
-			goto sys_fin; \
-		} \
-	} while (0)
-
-#define DEFINE_SYSREG_MRS(name, _op1, _crn, _crm, _op2) \
-	do { \
-		if (op1 == (_op1) && crn == (_crn) && crm == (_crm) && op2 == (_op2)) { \
-			regs->regs[rt] = current_cpu_core()->current_vm->cpu_sysregs.name; \
-			goto sys_fin; \
-		} \
-	} while (0)
-
-	// hypercall した VM のプロセス情報を取り出す
-	struct pt_regs *regs = vm_pt_regs(current_cpu_core()->current_vm);
-
-	// ESR.ISS[24:0] instruction specific syndrome
-	// exception class に応じて使われ方が違う
-	// これは MSR/MRS のときのフォーマットを前提にしている
-	unsigned int op0 = (esr >> 20) & 0x03;
-	unsigned int op2 = (esr >> 17) & 0x07;
-	unsigned int op1 = (esr >> 14) & 0x07;
-	unsigned int crn = (esr >> 10) & 0x0f;
-	unsigned int rt  = (esr >>  5) & 0x1f;
-	unsigned int crm = (esr >>  1) & 0x0f;
-	unsigned int dir = esr         & 0x01;
-
-	// INFO("trap_system: op0=%d, op2=%d, op1=%d, crn=%d, rt=%d, crm=%d, dir=%d",
-	// 	 op0, op2, op1, crn, rt, crm, dir);
-	// INFO("id_aa64mmfr0_el1 = %d", current()->cpu_sysregs.id_aa64mmfr0_el1);
-
-	// todo: (op0 & 2) の意図が分からない 
-	if ((op0 & 2) && dir == 0) {
-		// msr
-		// todo: マクロの引数に使われている定数の意味は？
-		DEFINE_SYSREG_MSR(actlr_el1, 0, 1, 0, 1);
-		DEFINE_SYSREG_MSR(csselr_el1, 1, 0, 0, 0);
-	}
-	else if ((op0 & 2) && dir == 1) {
-		// mrs
-		DEFINE_SYSREG_MRS(actlr_el1, 0, 1, 0, 1);
-		DEFINE_SYSREG_MRS(id_pfr0_el1, 0, 0, 1, 0);
-		DEFINE_SYSREG_MRS(id_pfr1_el1, 0, 0, 1, 1);
-		DEFINE_SYSREG_MRS(id_mmfr0_el1, 0, 0, 1, 4);
-		DEFINE_SYSREG_MRS(id_mmfr1_el1, 0, 0, 1, 5);
-		DEFINE_SYSREG_MRS(id_mmfr2_el1, 0, 0, 1, 6);
-		DEFINE_SYSREG_MRS(id_mmfr3_el1, 0, 0, 1, 7);
-		DEFINE_SYSREG_MRS(id_isar0_el1, 0, 0, 2, 0);
-		DEFINE_SYSREG_MRS(id_isar1_el1, 0, 0, 2, 1);
-		DEFINE_SYSREG_MRS(id_isar2_el1, 0, 0, 2, 2);
-		DEFINE_SYSREG_MRS(id_isar3_el1, 0, 0, 2, 3);
-		DEFINE_SYSREG_MRS(id_isar4_el1, 0, 0, 2, 4);
-		DEFINE_SYSREG_MRS(id_isar5_el1, 0, 0, 2, 5);
-		DEFINE_SYSREG_MRS(mvfr0_el1, 0, 0, 3, 0);
-		DEFINE_SYSREG_MRS(mvfr1_el1, 0, 0, 3, 1);
-		DEFINE_SYSREG_MRS(mvfr2_el1, 0, 0, 3, 2);
-		DEFINE_SYSREG_MRS(id_aa64pfr0_el1, 0, 0, 4, 0);
-		DEFINE_SYSREG_MRS(id_aa64pfr1_el1, 0, 0, 4, 1);
-		DEFINE_SYSREG_MRS(id_aa64dfr0_el1, 0, 0, 5, 0);
-		DEFINE_SYSREG_MRS(id_aa64dfr1_el1, 0, 0, 5, 1);
-		DEFINE_SYSREG_MRS(id_aa64isar0_el1, 0, 0, 6, 0);
-		DEFINE_SYSREG_MRS(id_aa64isar1_el1, 0, 0, 6, 1);
-		DEFINE_SYSREG_MRS(id_aa64mmfr0_el1, 0, 0, 7, 0);
-		DEFINE_SYSREG_MRS(id_aa64mmfr1_el1, 0, 0, 7, 1);
-		DEFINE_SYSREG_MRS(id_aa64afr0_el1, 0, 0, 5, 4);
-		DEFINE_SYSREG_MRS(id_aa64afr1_el1, 0, 0, 5, 5);
-		DEFINE_SYSREG_MRS(ctr_el0, 3, 0, 0, 1);
-		DEFINE_SYSREG_MRS(ccsidr_el1, 1, 0, 0, 0);
-		DEFINE_SYSREG_MRS(clidr_el1, 1, 0, 0, 1);
-		DEFINE_SYSREG_MRS(csselr_el1, 2, 0, 0, 0);
-		DEFINE_SYSREG_MRS(aidr_el1, 1, 0, 0, 7);
-		DEFINE_SYSREG_MRS(revidr_el1, 0, 0, 0, 6);
-	}
-
-	// DEFINE_SYSREG_MRS で sys_fin にジャンプするので else は不要
-	WARN("system register access is not handled");
-sys_fin:
-	increment_current_pc(4);
-	return;
-}
-
 // ESR_EL2
 // https://developer.arm.com/documentation/ddi0595/2021-03/AArch64-Registers/ESR-EL2--Exception-Syndrome-Register--EL2-?lang=en#fieldset_0-24_0
 void handle_sync_exception(unsigned long esr, unsigned long elr, unsigned long far) {
@@ -190,6 +92,7 @@ void handle_sync_exception(unsigned long esr, unsigned long elr, unsigned long f
 	{
 	case ESR_EL2_EC_TRAP_WFX:
 		current_cpu_core()->current_vm->stat.wfx_trap_count++;
+		current_cpu_core()->current_vm->exit_reason = VM_EXIT_WFX;
 		// ゲスト VM が WFI/WFE を実行したら VM を切り替える
 		handle_trap_wfx();
 		break;
@@ -198,7 +101,8 @@ void handle_sync_exception(unsigned long esr, unsigned long elr, unsigned long f
 		break;
 	case ESR_EL2_EC_TRAP_SYSTEM:
 		current_cpu_core()->current_vm->stat.sysregs_trap_count++;
-		handle_trap_system(esr);
+		current_cpu_core()->current_vm->exit_reason = VM_EXIT_SYSREGS;
+		handle_sysreg_trap(current_cpu_core()->current_vm, esr);
 		break;
 	case ESR_EL2_EC_TRAP_SVE:
 		WARN("TRAP_SVE is not implemented.");
@@ -223,5 +127,6 @@ void handle_sync_exception(unsigned long esr, unsigned long elr, unsigned long f
 // EL1 からのハイパーコールの処理
 void handle_sync_exception_hvc64(unsigned long hvc_nr, unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3) {
 	current_cpu_core()->current_vm->stat.hvc_trap_count++;
+	current_cpu_core()->current_vm->exit_reason = VM_EXIT_HVC;
 	hypercall(hvc_nr, a0, a1, a2, a3);
 }
@@ -0,0 +1,128 @@
+#include <stddef.h>
+
+#include "sysreg.h"
+#include "sched.h"
+#include "vm.h"
+#include "debug.h"
+
+// ESR_EL2.ISS encding for an exception from MSR, MRS
+// IL[25] instruction length for synchronous exceptions
+//   0b0: 16-bit instruction trapped
+//   0b1: 32-bit instruction trapped
+// Op0[21:20]
+// Op2[19:17]
+// Op1[16:14]
+// CRn[13:10]
+// Rt[9:5]
+// CRm[4:1]
+// Direction[0]
+//   0b0: Write access, including MSR instructions
+//   0b1: Read access, including MRS instructions
+#define ESR_SYSREG_ENC(op0, op1, crn, crm, op2) \
+	(((op0) << 20) | ((op2) << 17) | ((op1) << 14) | ((crn) << 10) | ((crm) << 1))
+// ISS から Rt と Direction を除いたもの(アクセスしたレジスタを表す)
+#define ESR_SYSREG_ENC_MASK	ESR_SYSREG_ENC(0x3, 0x7, 0xf, 0xf, 0x7)
+
+static const struct sysreg_desc sysreg_descs[NR_SYSREGS] = {
+#define SYSREG_DESC(_name, op0, op1, crn, crm, op2, _read, _write) \
+	[SYSREG_##_name] = { \
+		.name = #_name, \
+		.enc = ESR_SYSREG_ENC(op0, op1, crn, crm, op2), \
+		.offset = offsetof(struct cpu_sysregs, _name), \
+		.read = _read, \
+		.write = _write, \
+	},
+	SYSREG_LIST(SYSREG_DESC)
+#undef SYSREG_DESC
+};
+
+// enc から sysreg_descs の添字を引くためのハッシュ表(オープンアドレス法)
+//   値は添字 + 1(0 なら空き)
+//   レジスタ数の倍以上の大きさにしておけば、ほとんどの場合 1 回で見つかる
+#define SYSREG_HASH_SIZE	64
+
+static unsigned char sysreg_hash[SYSREG_HASH_SIZE];
+
+_Static_assert(NR_SYSREGS * 2 <= SYSREG_HASH_SIZE, "SYSREG_HASH_SIZE is too small");
+
+static unsigned int sysreg_hash_of(unsigned int enc) {
+	unsigned int key = enc >> 1;
+	return (key ^ (key >> 6) ^ (key >> 13)) & (SYSREG_HASH_SIZE - 1);
+}
+
+// SYSREG_LIST からハッシュ表を作る(起動時に一度だけ呼ぶ)
+void sysreg_init(void) {
+	for (int id = 0; id < NR_SYSREGS; id++) {
+		unsigned int h = sysreg_hash_of(sysreg_descs[id].enc);
+		while (sysreg_hash[h]) {
+			if (sysreg_descs[sysreg_hash[h] - 1].enc == sysreg_descs[id].enc) {
+				PANIC("duplicated system register: %s", sysreg_descs[id].name);
+			}
+			h = (h + 1) & (SYSREG_HASH_SIZE - 1);
+		}
+		sysreg_hash[h] = id + 1;
+	}
+}
+
+// 見つからなければ SYSREG_UNHANDLED を返す
+static int find_sysreg(unsigned int enc) {
+	unsigned int h = sysreg_hash_of(enc);
+	while (sysreg_hash[h]) {
+		int id = sysreg_hash[h] - 1;
+		if (sysreg_descs[id].enc == enc) {
+			return id;
+		}
+		h = (h + 1) & (SYSREG_HASH_SIZE - 1);
+	}
+	return SYSREG_UNHANDLED;
+}
+
+const char *sysreg_name(int id) {
+	return id < NR_SYSREGS ? sysreg_descs[id].name : "(unhandled)";
+}
+
+int sysreg_read_saved(struct vm_struct *vm, const struct sysreg_desc *desc, unsigned long *val) {
+	*val = *(unsigned long *)((char *)&vm->cpu_sysregs + desc->offset);
+	return 0;
+}
+
+int sysreg_write_saved(struct vm_struct *vm, const struct sysreg_desc *desc, unsigned long val) {
+	*(unsigned long *)((char *)&vm->cpu_sysregs + desc->offset) = val;
+	return 0;
+}
+
+// ESR_EL2.EC が MSR/MRS のトラップのときに呼ばれる
+void handle_sysreg_trap(struct vm_struct *vm, unsigned long esr) {
+	struct pt_regs *regs = vm_pt_regs(vm);
+	unsigned int enc = esr & ESR_SYSREG_ENC_MASK;
+	unsigned int rt  = (esr >>  5) & 0x1f;
+	unsigned int dir = esr         & 0x01;
+
+	int id = find_sysreg(enc);
+	if (vm->exit_stats) {
+		vm->exit_stats->sysreg_traps[id]++;
+	}
+
+	int r = -1;
+	if (id != SYSREG_UNHANDLED) {
+		const struct sysreg_desc *desc = &sysreg_descs[id];
+		unsigned long val;
+		// Rt が 31 のときは xzr
+		if (dir == 1 && desc->read) {
+			r = desc->read(vm, desc, &val);
+			if (r == 0 && rt != 31) {
+				regs->regs[rt] = val;
+			}
+		}
+		else if (dir == 0 && desc->write) {
+			r = desc->write(vm, desc, rt != 31 ? regs->regs[rt] : 0);
+		}
+	}
+	if (r < 0) {
+		WARN("system register access is not handled: %s %s (op0=%d, op1=%d, crn=%d, crm=%d, op2=%d)",
+			 dir ? "mrs" : "msr", sysreg_name(id),
+			 (esr >> 20) & 0x3, (esr >> 14) & 0x7, (esr >> 10) & 0xf, (esr >> 1) & 0xf, (esr >> 17) & 0x7);
+	}
+
+	increment_current_pc(4);
+}
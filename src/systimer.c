@@ -2,7 +2,8 @@
 #include "sched.h"
 #include "printf.h"
 #include "peripherals/systimer.h"
-#include "peripherals/mailbox.h"
+#include "smp.h"
+#include "sd.h"
 
 // todo: これは system timer である
 //       コアごとにある generic timer ではない
@@ -25,13 +26,17 @@ void handle_systimer1_irq() {
 	// 割込みをクリア
 	put32(TIMER_CS, TIMER_CS_M1);
 
+	// DMA の完了割込みが来ないまま止まった SD カードの転送をタイムアウトさせる
+	// 完了を待って眠っている VM は、誰かが sd_poll を呼ばないと起きられない
+	sd_poll();
+
 	// CPU0 の VM 切り替え
 	timer_tick();
 
 	// CPU0 以外のコアに mbox 割込みを送ってタスクを切り替えさせる
-	put32(MBOX_CORE1_SET_0, 0x1);
-	put32(MBOX_CORE2_SET_0, 0x1);
-	put32(MBOX_CORE3_SET_0, 0x1);
+	smp_send_reschedule(1);
+	smp_send_reschedule(2);
+	smp_send_reschedule(3);
 }
 
 // VM の割込み用
@@ -68,19 +68,6 @@ int memcmp(const void *s1, const void *s2, size_t n) {
     }
 }
 
-void *memmove(void *dst, const void *src, size_t n) {
-    if (src + n > dst) {
-        src += n - 1;
-        dst += n - 1;
-        for (size_t i = 0; i < n; i++) {
-            *(uint8_t *)dst-- = *(uint8_t *)src--;
-        }
-    } else {
-        memcpy(dst, src, n);
-    }
-    return dst;
-}
-
 void *memchr(const void *s, int c, size_t n) {
     uint8_t *p = (uint8_t *)s;
     for (size_t i = 0; i < n; i++, p++) {
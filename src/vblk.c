@@ -0,0 +1,226 @@
+#include "vblk.h"
+#include "virtq.h"
+#include "sched.h"
+#include "mm.h"
+#include "sd.h"
+#include "bcache.h"
+#include "fat32.h"
+#include "utils.h"
+#include "debug.h"
+
+// リクエストのセグメントのうち、デバイスが書き込む側(write = 1)か読む側(write = 0)だけを
+// 1 本につなげたものとして扱い、その off バイト目を指すポインタを返す
+// *avail には、そのセグメント内で連続している残りのバイト数を入れる
+static char *stream_at(struct virtq_req *req, int write, uint32_t off, uint32_t *avail) {
+	for (int i = 0; i < req->nr_segs; i++) {
+		struct virtq_seg *seg = &req->segs[i];
+		if (seg->write != write) {
+			continue;
+		}
+		if (off < seg->len) {
+			*avail = seg->len - off;
+			return seg->buf + off;
+		}
+		off -= seg->len;
+	}
+	*avail = 0;
+	return NULL;
+}
+
+static uint32_t stream_len(struct virtq_req *req, int write) {
+	uint32_t len = 0;
+	for (int i = 0; i < req->nr_segs; i++) {
+		if (req->segs[i].write == write) {
+			len += req->segs[i].len;
+		}
+	}
+	return len;
+}
+
+// to_stream が 1 ならバッファからリクエストへ、0 ならリクエストからバッファへコピーする
+static void stream_copy(struct virtq_req *req, int write, uint32_t off, uint8_t *buf, uint32_t len, int to_stream) {
+	while (len > 0) {
+		uint32_t avail;
+		char *p = stream_at(req, write, off, &avail);
+		if (!p) {
+			return;
+		}
+		uint32_t n = MIN(avail, len);
+		for (uint32_t i = 0; i < n; i++) {
+			if (to_stream) {
+				p[i] = buf[i];
+			} else {
+				buf[i] = p[i];
+			}
+		}
+		buf += n;
+		off += n;
+		len -= n;
+	}
+}
+
+// イメージファイルの sector から len バイトを、リクエストのデータ部分との間で転送する
+// データ部分は stream_at(req, write, data_off + ...) で指す
+static int vblk_transfer(struct vblk_device *blk, struct virtq_req *req, int write, uint32_t data_off,
+						 uint64_t sector, uint32_t len, int is_out) {
+	if (len % VBLK_SECTOR_SIZE != 0) {
+		return VBLK_S_IOERR;
+	}
+	uint32_t nblk = len / VBLK_SECTOR_SIZE;
+	// sector はゲストが決める 64 ビットの値なので、足し算があふれないように比べる
+	if (sector > blk->nr_sectors || nblk > blk->nr_sectors - sector) {
+		return VBLK_S_IOERR;
+	}
+
+	uint32_t done = 0;
+	while (done < nblk) {
+		uint32_t contig;
+		long lba = fat32_file_lba(&blk->file, (sector + done) * VBLK_SECTOR_SIZE, &contig);
+		if (lba < 0) {
+			return VBLK_S_IOERR;
+		}
+
+		uint32_t off = data_off + done * VBLK_SECTOR_SIZE;
+		uint32_t avail;
+		char *p = stream_at(req, write, off, &avail);
+		uint32_t n;
+		int r;
+
+		if (avail >= VBLK_SECTOR_SIZE && ((unsigned long)p & 0x3) == 0) {
+			// ゲストのバッファにディスク上で連続しているブロックをまとめて直接転送する
+			n = MIN(MIN(avail / VBLK_SECTOR_SIZE, contig), nblk - done);
+			n = MIN(n, VBLK_MAX_BLOCKS_PER_IO);
+			if (is_out) {
+				r = bcache_write(lba, p, n);
+			}
+			else if (n == 1) {
+				r = bcache_read(lba, p);
+			}
+			else {
+				r = sd_readblock(lba, (unsigned char *)p, n) == 0 ? -1 : 0;
+			}
+		}
+		else {
+			// ブロックがゲストのバッファの切れ目をまたぐので、1 ブロックずつ経由させる
+			n = 1;
+			if (is_out) {
+				stream_copy(req, write, off, blk->bounce, VBLK_SECTOR_SIZE, 0);
+				r = bcache_write(lba, blk->bounce, 1);
+			}
+			else {
+				r = bcache_read(lba, blk->bounce);
+				stream_copy(req, write, off, blk->bounce, VBLK_SECTOR_SIZE, 1);
+			}
+		}
+		if (r < 0) {
+			return VBLK_S_IOERR;
+		}
+		done += n;
+	}
+	return VBLK_S_OK;
+}
+
+// VIRTQ_DEV_BLOCK のリクエストを処理する(vm->virtio->lock を取った状態で呼ばれる)
+// SD カードとの転送の間は vm->virtio->lock を外し、転送を待つ間 VM が眠れるようにする
+//   virtio の状態を操作するのはこの VM 自身のハイパーコールと VM への復帰だけなので、
+//   VM が眠っている間に他から触られることはない(virtq_unlock_for_io で確認する)
+//   それでも lock を取り直した後は、外す前に読んだ状態を使わずに読み直す
+int vblk_handler(struct vm_struct *vm, struct virtq *vq, struct virtq_req *req) {
+	struct vblk_device *blk = vm->virtio->blk;
+	uint32_t in_len = stream_len(req, 0);
+	uint32_t out_len = stream_len(req, 1);
+	struct vblk_req_hdr hdr;
+	uint8_t status;
+	uint32_t written = 0;
+
+	// ステータスを書き込む場所がなければ何もできない
+	if (out_len < 1) {
+		return 0;
+	}
+
+	if (!blk || in_len < sizeof(hdr)) {
+		status = VBLK_S_IOERR;
+		goto out;
+	}
+	stream_copy(req, 0, 0, (uint8_t *)&hdr, sizeof(hdr), 0);
+
+	switch (hdr.type) {
+	case VBLK_T_IN:
+		virtq_unlock_for_io(vm);
+		status = vblk_transfer(blk, req, 1, 0, hdr.sector, out_len - 1, 0);
+		virtq_relock_after_io(vm);
+		if (vm->virtio->blk != blk) {
+			// 転送中にデバイスが置き換えられた
+			status = VBLK_S_IOERR;
+		}
+		if (status == VBLK_S_OK) {
+			written = out_len - 1;
+		}
+		break;
+	case VBLK_T_OUT:
+		virtq_unlock_for_io(vm);
+		status = vblk_transfer(blk, req, 0, sizeof(hdr), hdr.sector, in_len - sizeof(hdr), 1);
+		virtq_relock_after_io(vm);
+		if (vm->virtio->blk != blk) {
+			status = VBLK_S_IOERR;
+		}
+		break;
+	case VBLK_T_FLUSH:
+		// bcache はライトスルーなので、書き込みは既に SD カードに届いている
+		status = VBLK_S_OK;
+		break;
+	default:
+		status = VBLK_S_UNSUPP;
+		break;
+	}
+
+out:
+	stream_copy(req, 1, out_len - 1, &status, 1, 1);
+	return written + 1;
+}
+
+// FAT32 ボリューム上のファイルを VM のブロックデバイスとして接続し、容量(セクタ数)を返す
+// 既に接続されている場合は置き換える
+long vblk_attach(struct vm_struct *vm, unsigned long filename_va) {
+	struct fat32_fs *fat32 = fat32_get_fs();
+	char name[FAT32_MAX_FILENAME_LEN + 1];
+
+	if (!fat32 || copy_string_from_guest(filename_va, name, sizeof(name)) < 0) {
+		return -1;
+	}
+
+	struct vblk_device *blk = (struct vblk_device *)allocate_page();
+	if (!blk) {
+		return -1;
+	}
+	if (fat32_lookup(fat32, name, &blk->file) < 0 || fat32_is_directory(&blk->file)) {
+		WARN("%s: no such image file", name);
+		free_page(blk);
+		return -1;
+	}
+	blk->nr_sectors = fat32_file_size(&blk->file) / VBLK_SECTOR_SIZE;
+
+	struct virtio_state *virtio = get_virtio_state(vm);
+	if (!virtio) {
+		free_page(blk);
+		return -1;
+	}
+
+	acquire_lock(&virtio->lock);
+	struct vblk_device *old = virtio->blk;
+	virtio->blk = blk;
+	release_lock(&virtio->lock);
+
+	if (old) {
+		vblk_release(old);
+	}
+
+	INFO("%s is attached as a block device(%d sectors)", name, blk->nr_sectors);
+	return blk->nr_sectors;
+}
+
+// 接続を外したデバイスのファイルを閉じて解放する
+void vblk_release(struct vblk_device *blk) {
+	fat32_close(&blk->file);
+	free_page(blk);
+}
@@ -0,0 +1,67 @@
+#include "virq.h"
+#include "sched.h"
+
+#define VIRQ_WORD(irq)  ((irq) / 64)
+#define VIRQ_BIT(irq)   (1UL << ((irq) % 64))
+
+void virq_init(struct virq_state *virq) {
+	for (int i = 0; i < VIRQ_WORDS; i++) {
+		virq->pending[i] = 0;
+		virq->enabled[i] = 0;
+	}
+	virq->fiq_source = VIRQ_NONE;
+}
+
+// 割込み線のレベルを設定する(レベルトリガ)
+// デバイスの状態が変わったときに、そのデバイスを操作したコアから呼ぶ
+void virq_set_level(struct vm_struct *vm, int irq, int level) {
+	if (irq < 0 || irq >= VIRQ_NR_SOURCES) {
+		return;
+	}
+	volatile unsigned long *word = &vm->virq.pending[VIRQ_WORD(irq)];
+	if (level) {
+		__atomic_fetch_or(word, VIRQ_BIT(irq), __ATOMIC_RELEASE);
+	}
+	else {
+		__atomic_fetch_and(word, ~VIRQ_BIT(irq), __ATOMIC_RELEASE);
+	}
+}
+
+int virq_is_pending(struct vm_struct *vm, int irq) {
+	if (irq < 0 || irq >= VIRQ_NR_SOURCES) {
+		return 0;
+	}
+	return (vm->virq.pending[VIRQ_WORD(irq)] & VIRQ_BIT(irq)) != 0;
+}
+
+// 有効になっているソースのうち、割込みを要求しているもの
+unsigned long virq_pending_word(struct vm_struct *vm, int word) {
+	return __atomic_load_n(&vm->virq.pending[word], __ATOMIC_ACQUIRE) & vm->virq.enabled[word];
+}
+
+void virq_enable(struct vm_struct *vm, int word, unsigned long mask) {
+	vm->virq.enabled[word] |= mask;
+}
+
+void virq_disable(struct vm_struct *vm, int word, unsigned long mask) {
+	vm->virq.enabled[word] &= ~mask;
+}
+
+void virq_set_fiq(struct vm_struct *vm, int irq) {
+	vm->virq.fiq_source = irq;
+}
+
+// VM に復帰する直前に呼ばれる
+int virq_irq_asserted(struct vm_struct *vm) {
+	unsigned long asserted = 0;
+	for (int i = 0; i < VIRQ_WORDS; i++) {
+		asserted |= virq_pending_word(vm, i);
+	}
+	return asserted != 0;
+}
+
+// FIQ は enabled に関係なく、選ばれたソースが割込みを要求していれば発生する
+int virq_fiq_asserted(struct vm_struct *vm) {
+	int irq = vm->virq.fiq_source;
+	return irq != VIRQ_NONE && virq_is_pending(vm, irq);
+}
@@ -0,0 +1,350 @@
+#include "virtq.h"
+#include "sched.h"
+#include "cpu_core.h"
+#include "mm.h"
+#include "fifo.h"
+#include "utils.h"
+#include "debug.h"
+#include "vm.h"
+#include "vblk.h"
+
+// ゲストが書き換えるリングのインデックスは acquire で読み、
+// used リングのエントリを書き終えてから used->idx を release で書く
+#define LOAD_ACQUIRE(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int console_tx_handler(struct vm_struct *, struct virtq *, struct virtq_req *);
+static int console_rx_handler(struct vm_struct *, struct virtq *, struct virtq_req *);
+int vblk_handler(struct vm_struct *, struct virtq *, struct virtq_req *);
+
+static virtq_handler_t virtq_handler_of(uint32_t type) {
+	switch (type) {
+	case VIRTQ_DEV_CONSOLE_TX:
+		return console_tx_handler;
+	case VIRTQ_DEV_CONSOLE_RX:
+		return console_rx_handler;
+	case VIRTQ_DEV_BLOCK:
+		return vblk_handler;
+	}
+	return NULL;
+}
+
+// ゲストの IPA から size バイトの構造体を、ハイパーバイザからアクセスできるアドレスに変換する
+// 構造体がページ境界をまたぐ場合は、ホスト側で連続している保証がないので 0 を返す
+static void *ring_host_addr(struct vm_struct *vm, unsigned long ipa, unsigned long size) {
+	if ((ipa & (PAGE_SIZE - 1)) + size > PAGE_SIZE) {
+		return 0;
+	}
+	unsigned long page = get_or_allocate_vm_page(vm, ipa & PAGE_MASK);
+	if (!page) {
+		return 0;
+	}
+	return (void *)(page + (ipa & (PAGE_SIZE - 1)));
+}
+
+// VM の virtqueue の状態を返す(最初に呼ばれたときに確保する)
+// VM 自身のコアからのハイパーコールでだけ呼ばれるので、確保の競合は起きない
+struct virtio_state *get_virtio_state(struct vm_struct *vm) {
+	if (!vm->virtio) {
+		struct virtio_state *virtio = (struct virtio_state *)allocate_page();
+		if (!virtio) {
+			return NULL;
+		}
+		init_lock(&virtio->lock, "virtio");
+		vm->virtio = virtio;
+	}
+	return vm->virtio;
+}
+
+// VM の virtqueue の状態と、接続されているブロックデバイスを解放する
+// VM を解放するとき(destroy_vm)にだけ呼ばれるので、ロックは取らない
+void free_virtio_state(struct vm_struct *vm) {
+	if (!vm->virtio) {
+		return;
+	}
+	if (vm->virtio->blk) {
+		vblk_release(vm->virtio->blk);
+	}
+	free_page(vm->virtio);
+	vm->virtio = NULL;
+}
+
+// virtqueue を登録する
+// setup_va は struct virtq_setup を指すゲストの仮想アドレス
+// 変換するのは先頭のページだけなので、8 バイト境界に揃っていてページをまたがないこと
+long virtq_setup(struct vm_struct *vm, unsigned long setup_va) {
+	if ((setup_va & 7) || (setup_va & (PAGE_SIZE - 1)) + sizeof(struct virtq_setup) > PAGE_SIZE) {
+		WARN("invalid virtqueue setup address: 0x%lx", setup_va);
+		return -1;
+	}
+	struct virtq_setup *setup = (struct virtq_setup *)get_guest_va_host_addr(setup_va);
+	if (!setup) {
+		return -1;
+	}
+	sync_guest_memory(setup, sizeof(*setup));
+
+	uint32_t num = setup->num;
+	if (setup->index >= VIRTQ_MAX_QUEUES || num == 0 || num > VIRTQ_MAX_SIZE || (num & (num - 1))) {
+		WARN("invalid virtqueue: index %d, num %d", setup->index, num);
+		return -1;
+	}
+	virtq_handler_t handler = virtq_handler_of(setup->type);
+	if (!handler) {
+		WARN("unknown virtqueue device type: %d", setup->type);
+		return -1;
+	}
+
+	struct virtq_desc *desc = ring_host_addr(vm, setup->desc, sizeof(struct virtq_desc) * num);
+	struct virtq_avail *avail = ring_host_addr(vm, setup->avail, sizeof(struct virtq_avail) + sizeof(uint16_t) * num);
+	struct virtq_used *used = ring_host_addr(vm, setup->used, sizeof(struct virtq_used) + sizeof(struct virtq_used_elem) * num);
+	if (!desc || !avail || !used) {
+		WARN("virtqueue rings must not cross a page boundary");
+		return -1;
+	}
+
+	if (!get_virtio_state(vm)) {
+		return -1;
+	}
+
+	sync_guest_memory(used, sizeof(struct virtq_used));
+
+	acquire_lock(&vm->virtio->lock);
+	struct virtq *vq = &vm->virtio->queues[setup->index];
+	vq->type = setup->type;
+	vq->num = num;
+	vq->desc = desc;
+	vq->avail = avail;
+	vq->used = used;
+	vq->last_avail_idx = LOAD_ACQUIRE(&used->idx);
+	vq->handler = handler;
+	vq->dev = NULL;
+	release_lock(&vm->virtio->lock);
+
+	return 0;
+}
+
+// head から始まるディスクリプタチェーンを、ページ境界で区切ったセグメントの列に変換する
+static int virtq_build_req(struct vm_struct *vm, struct virtq *vq, uint16_t head, struct virtq_req *req) {
+	uint16_t idx = head;
+
+	req->head = head;
+	req->nr_segs = 0;
+
+	// ゲストが循環するチェーンを作っても止まるように、たどる数は num までにする
+	for (uint32_t count = 0; count < vq->num; count++) {
+		if (idx >= vq->num) {
+			return -1;
+		}
+		struct virtq_desc *d = &vq->desc[idx];
+		uint64_t addr = d->addr;
+		uint32_t remain = d->len;
+
+		while (remain > 0) {
+			unsigned long page = get_or_allocate_vm_page(vm, addr & PAGE_MASK);
+			if (!page) {
+				return -1;
+			}
+			uint32_t off = addr & (PAGE_SIZE - 1);
+			uint32_t len = MIN(remain, PAGE_SIZE - off);
+			int write = (d->flags & VIRTQ_DESC_F_WRITE) != 0;
+
+			// ホスト側でも連続しているなら、直前のセグメントを伸ばす
+			// こうしておくと、ブロックデバイスなどでまとめて転送できる
+			struct virtq_seg *prev = req->nr_segs > 0 ? &req->segs[req->nr_segs - 1] : NULL;
+			if (prev && prev->write == write && prev->buf + prev->len == (char *)(page + off)) {
+				prev->len += len;
+				addr += len;
+				remain -= len;
+				continue;
+			}
+
+			if (req->nr_segs == VIRTQ_MAX_SEGS) {
+				return -1;
+			}
+			struct virtq_seg *seg = &req->segs[req->nr_segs++];
+			seg->buf = (char *)(page + off);
+			seg->len = len;
+			seg->write = write;
+
+			addr += len;
+			remain -= len;
+		}
+
+		if (!(d->flags & VIRTQ_DESC_F_NEXT)) {
+			return 0;
+		}
+		idx = d->next;
+	}
+	return -1;
+}
+
+// ゲストが書く available リングとディスクリプタテーブルを、読む前にメモリと揃える
+static void virtq_sync_avail(struct virtq *vq) {
+	sync_guest_memory(vq->avail, sizeof(struct virtq_avail) + sizeof(uint16_t) * vq->num);
+	sync_guest_memory(vq->desc, sizeof(struct virtq_desc) * vq->num);
+}
+
+// リクエストのバッファを、デバイスが読み書きする前(write = 0)か書き込んだ後(write = 1)にメモリと揃える
+static void virtq_sync_req(struct virtq_req *req, int write) {
+	for (int i = 0; i < req->nr_segs; i++) {
+		if (!write || req->segs[i].write) {
+			sync_guest_memory(req->segs[i].buf, req->segs[i].len);
+		}
+	}
+}
+
+static void virtq_push_used(struct virtq *vq, uint16_t head, uint32_t len) {
+	uint16_t used_idx = vq->used->idx;
+	struct virtq_used_elem *elem = &vq->used->ring[used_idx & (vq->num - 1)];
+	elem->id = head;
+	elem->len = len;
+	STORE_RELEASE(&vq->used->idx, (uint16_t)(used_idx + 1));
+	sync_guest_memory(elem, sizeof(*elem));
+	sync_guest_memory(vq->used, sizeof(struct virtq_used));
+}
+
+// available リングに積まれたリクエストを処理できるだけ処理し、処理した数を返す
+// vm->virtio->lock を取った状態で呼ぶこと
+static int virtq_process(struct vm_struct *vm, struct virtq *vq) {
+	struct virtq_req req;
+	int processed = 0;
+
+	virtq_sync_avail(vq);
+	while (vq->last_avail_idx != LOAD_ACQUIRE(&vq->avail->idx)) {
+		uint16_t head = vq->avail->ring[vq->last_avail_idx & (vq->num - 1)];
+		struct virtq_avail *avail = vq->avail;
+		unsigned long gen = vm->virtio->unlock_gen;
+
+		int len;
+		if (virtq_build_req(vm, vq, head, &req) < 0) {
+			// 不正なチェーンは処理せずに返す
+			WARN("invalid descriptor chain: %d", head);
+			len = 0;
+		}
+		else {
+			virtq_sync_req(&req, 0);
+			len = vq->handler(vm, vq, &req);
+			if (vm->virtio->unlock_gen != gen) {
+				// 処理関数が lock を外していたので、その前に読んだリングの状態は使わずに読み直す
+				if (!vq->handler || vq->avail != avail) {
+					// virtqueue が設定し直されたので、古いリングのリクエストは返さない
+					break;
+				}
+				virtq_sync_avail(vq);
+			}
+			if (len < 0) {
+				// 今は処理できないので、次の notify か poll で続きを処理する
+				break;
+			}
+			virtq_sync_req(&req, 1);
+		}
+
+		virtq_push_used(vq, head, len);
+		vq->last_avail_idx++;
+		processed++;
+	}
+
+	if (processed > 0 && !(LOAD_ACQUIRE(&vq->avail->flags) & VIRTQ_AVAIL_F_NO_INTERRUPT)) {
+		raise_pv_irq(vm, PV_IRQ_VIRTQ);
+	}
+	return processed;
+}
+
+// 処理関数が SD カードとの転送などで眠る前に vm->virtio->lock を外す
+// 眠っている間に virtio の状態を触るのはこの VM 自身だけ、という前提なので、
+// VM 自身のコンテキスト以外から呼ばれたら止める
+void virtq_unlock_for_io(struct vm_struct *vm) {
+	if (current_cpu_core()->current_vm != vm) {
+		PANIC("virtio lock of VM %ld is released outside of its context", vm->vmid);
+	}
+	vm->virtio->unlock_gen++;
+	release_lock(&vm->virtio->lock);
+}
+
+// virtq_unlock_for_io で外した lock を取り直す
+// 呼び出し側は、lock を外す前に読んだ virtio の状態を読み直すこと
+void virtq_relock_after_io(struct vm_struct *vm) {
+	acquire_lock(&vm->virtio->lock);
+}
+
+// ゲストからの doorbell(HYPERCALL_TYPE_VIRTQ_NOTIFY)
+// 処理したリクエストの数を返す
+long virtq_notify(struct vm_struct *vm, unsigned long index) {
+	if (!vm->virtio || index >= VIRTQ_MAX_QUEUES) {
+		return -1;
+	}
+
+	acquire_lock(&vm->virtio->lock);
+	struct virtq *vq = &vm->virtio->queues[index];
+	long processed = vq->handler ? virtq_process(vm, vq) : -1;
+	release_lock(&vm->virtio->lock);
+
+	return processed;
+}
+
+// VM に復帰する直前に呼ばれ、ゲストからの notify を待たずに処理できるものを処理する
+// 受信データが届いた場合や、出力先が空くのを待っていたリクエストがここで進む
+void virtio_poll(struct vm_struct *vm) {
+	if (!vm->virtio) {
+		return;
+	}
+
+	acquire_lock(&vm->virtio->lock);
+	for (int i = 0; i < VIRTQ_MAX_QUEUES; i++) {
+		struct virtq *vq = &vm->virtio->queues[i];
+		if (!vq->handler) {
+			continue;
+		}
+		sync_guest_memory(vq->avail, sizeof(struct virtq_avail));
+		if (vq->last_avail_idx != LOAD_ACQUIRE(&vq->avail->idx)) {
+			virtq_process(vm, vq);
+		}
+	}
+	release_lock(&vm->virtio->lock);
+}
+
+// コンソール出力: 読み込み用のバッファの中身を out_fifo にそのまま積む
+static int console_tx_handler(struct vm_struct *vm, struct virtq *vq, struct virtq_req *req) {
+	int total = 0;
+	for (int i = 0; i < req->nr_segs; i++) {
+		if (!req->segs[i].write) {
+			total += req->segs[i].len;
+		}
+	}
+	// 一部だけ書き込むとゲストに残りを伝えられないので、全部入らないときは出力が進むのを待つ
+	// out_fifo が空でも入りきらない大きさなら、入る分だけ書いて残りは捨てる
+	if (total > free_of_fifo(vm->console.out_fifo) && !is_empty_fifo(vm->console.out_fifo)) {
+		return -1;
+	}
+
+	for (int i = 0; i < req->nr_segs; i++) {
+		struct virtq_seg *seg = &req->segs[i];
+		if (!seg->write && enqueue_fifo_n(vm->console.out_fifo, seg->buf, seg->len) < seg->len) {
+			break;
+		}
+	}
+	notify_vm_console(vm);
+	return 0;
+}
+
+// コンソール入力: in_fifo に溜まっている入力を書き込み用のバッファに読み出す
+static int console_rx_handler(struct vm_struct *vm, struct virtq *vq, struct virtq_req *req) {
+	if (is_empty_fifo(vm->console.in_fifo)) {
+		return -1;
+	}
+
+	int total = 0;
+	for (int i = 0; i < req->nr_segs; i++) {
+		struct virtq_seg *seg = &req->segs[i];
+		if (!seg->write) {
+			continue;
+		}
+		int n = dequeue_fifo_n(vm->console.in_fifo, seg->buf, seg->len);
+		total += n;
+		if (n < seg->len) {
+			break;
+		}
+	}
+	notify_vm_console(vm);
+	return total;
+}
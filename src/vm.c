@@ -1,6 +1,7 @@
 #include "mm.h"
 #include "sched.h"
 #include "vm.h"
+#include "mini_uart.h"
 #include "utils.h"
 #include "entry.h"
 #include "debug.h"
@@ -9,6 +10,7 @@
 #include "fifo.h"
 #include "irq.h"
 #include "loader.h"
+#include "virtq.h"
 
 // 各スレッド用の領域の末尾に置かれた vm_struct へのポインタを返す
 struct pt_regs * vm_pt_regs(struct vm_struct *vm) {
@@ -50,9 +52,13 @@ static void load_vm_text_from_memory(unsigned long text) {
 	struct pt_regs *regs = vm_pt_regs(vm);
 
 	// コードをロードして PC/SP を設定
-	copy_code_to_memory(vm, 0, text, PAGE_SIZE);
+	if (copy_code_to_memory(vm, 0, text, PAGE_SIZE) < 0) {
+		PANIC("failed to load");
+	}
 	regs->pc = 0x0;
 	regs->sp = 0x100000;
+	// 以前に同じ物理ページにあったコードが命令キャッシュに残っていることがある
+	icache_invalidate_all();
 
 	INFO("%s enters EL1...", vm->name);
 }
@@ -66,6 +72,7 @@ static void load_vm_text_from_file(loader_func_t loader, void *arg) {
 	if (loader(arg, &regs->pc, &regs->sp) < 0) {
 		PANIC("failed to load");
 	}
+	icache_invalidate_all();
 
 	INFO("%s enters EL1...", vm->name);
 }
@@ -113,10 +120,13 @@ static struct vm_struct *create_vm() {
 	}
 
 	vm->flags = 0;
+	init_lock(&vm->lock, "vm");
 	// vm->priority = current_cpu_core()->current_vm->priority;
 	vm->state = VM_RUNNABLE;
 	// vm->counter = vm->priority;
 
+	virq_init(&vm->virq);
+
 	// このプロセス(vm)で再現するハードウェア(BCM2837)を初期化
 	vm->board_ops = &bcm2837_board_ops;
 	if (HAVE_FUNC(vm->board_ops, initialize)) {
@@ -135,6 +145,9 @@ static struct vm_struct *create_vm() {
 
 	init_vm_console(vm);
 
+	// 確保できなくても VM は動かせるので、その場合は時間の計測をしない
+	vm->exit_stats = (struct vm_exit_stats *)allocate_page();
+
 	return vm;
 }
 
@@ -151,14 +164,9 @@ int create_idle_vm(unsigned long cpuid) {
 	vm->name = "IDLE";
 
 	// IDLE VM は CPU ID をそのまま VMID にする
-	int vmid = cpuid;
-
-	// 新たに作った vm_struct 構造体のアドレスを vms 配列に入れておく
+	// 新たに作った vm_struct 構造体のアドレスを VM 表に入れておく
 	// これでそのうち今作った VM に処理が切り替わり、switch_from_kthread から実行開始される
-	vms[vmid] = vm;
-	vm->vmid = vmid;
-
-	return vmid;
+	return register_vm(vm, cpuid);
 }
 
 // 指定されたローダで VM を作る
@@ -177,23 +185,149 @@ int create_vm_with_loader(loader_func_t loader, void *arg) {
 	vm->cpu_context.x21 = (unsigned long)&vm->loader_args;
 	vm->name = "VM";
 
-	// 今動いている VM 数を増やし、その連番をそのまま PID とする
-	int vmid = current_number_of_vms++;
-	vms[vmid] = vm;
-	vm->vmid = vmid;
-
+	// VM 表の空いている場所に入れ、その位置をそのまま VMID とする
+	// 表に入れた時点で他のコアのスケジューラが実行し始めるので、設定はすべて先に済ませておく
+	int vmid = register_vm(vm, -1);
+	if (vmid < 0) {
+		WARN("too many VMs");
+		destroy_vm(vm);
+	}
 	return vmid;
 }
 
+// VM が使っていたページをすべて解放する
+// VM 表から外し、どのコアも vm を参照しなくなってから(猶予期間の後に)呼ぶこと
+void destroy_vm(struct vm_struct *vm) {
+	free_vm_memory(vm);
+	free_virtio_state(vm);
+
+	if (vm->console.in_fifo) {
+		free_page(vm->console.in_fifo);
+	}
+	if (vm->console.out_fifo) {
+		free_page(vm->console.out_fifo);
+	}
+	if (vm->exit_stats) {
+		free_page(vm->exit_stats);
+	}
+	if (vm->board_data) {
+		free_page(vm->board_data);
+	}
+	free_page(vm);
+}
+
 void init_vm_console(struct vm_struct *tsk) {
 	tsk->console.in_fifo = create_fifo();
 	tsk->console.out_fifo = create_fifo();
+	init_lock(&tsk->console.out_lock, "console_out");
+}
+
+// コンソールの FIFO を操作したら呼び、エミュレートしている UART の割込みの状態を更新させる
+void notify_vm_console(struct vm_struct *tsk) {
+	if (HAVE_FUNC(tsk->board_ops, console_updated)) {
+		tsk->board_ops->console_updated(tsk);
+	}
 }
 
+// ゲストの出力を UART の送信リングに移す
+// 実際の送信は送信割込みで行うので、VM の出入りで送信完了を待つことはない
+// 送信リングに入りきらなかった分は out_fifo に残し、次回に回す
 void flush_vm_console(struct vm_struct *tsk) {
-	struct fifo *outfifo = tsk->console.out_fifo;
-	unsigned long val;
-	while (dequeue_fifo(outfifo, &val) == 0) {
-		printf("%c", val);
+	char buf[64];
+
+	// 他のコアが flush 中ならそちらに任せる
+	if (!try_acquire_lock(&tsk->console.out_lock)) {
+		return;
+	}
+
+	int free = uart_tx_free();
+	int flushed = 0;
+	while (free > 0) {
+		int n = dequeue_fifo_n(tsk->console.out_fifo, buf, MIN(free, (int)sizeof(buf)));
+		if (n == 0) {
+			break;
+		}
+		flushed = 1;
+		int written = uart_write(buf, n);
+		if (written < n) {
+			// 他の出力に先に空きを使われた場合、取り出した分は待ってでも送る
+			for (int i = written; i < n; i++) {
+				putc(NULL, buf[i]);
+			}
+			break;
+		}
+		free -= written;
+	}
+
+	release_lock(&tsk->console.out_lock);
+
+	if (flushed) {
+		notify_vm_console(tsk);
+	}
+}
+
+// ゲストのバッファ(仮想アドレス va から len バイト)を out_fifo に書き込む
+// PV コンソールのハイパーコールから呼ばれ、1 回の VM exit でまとめて出力できる
+// 書き込んだバイト数を返す(out_fifo が一杯なら len より少なくなる)
+// ゲストのアドレスが変換できなかった場合は -1 を返す
+long write_vm_console(struct vm_struct *tsk, unsigned long va, unsigned long len) {
+	unsigned long done = 0;
+
+	while (done < len) {
+		unsigned long host = get_guest_va_host_addr(va + done);
+		if (!host) {
+			if (done == 0) {
+				return -1;
+			}
+			break;
+		}
+		// ページ境界をまたがないように区切る
+		int chunk = MIN(len - done, PAGE_SIZE - ((va + done) & (PAGE_SIZE - 1)));
+		sync_guest_memory((void *)host, chunk);
+		int n = enqueue_fifo_n(tsk->console.out_fifo, (const char *)host, chunk);
+		done += n;
+		if (n < chunk) {
+			break;
+		}
+	}
+	if (done > 0) {
+		notify_vm_console(tsk);
 	}
+	return done;
+}
+
+// in_fifo に溜まっている入力を最大 len バイトゲストのバッファに読み出す
+// 読み出したバイト数を返し、ゲストのアドレスが変換できなかった場合は -1 を返す
+long read_vm_console(struct vm_struct *tsk, unsigned long va, unsigned long len) {
+	unsigned long done = 0;
+
+	while (done < len) {
+		unsigned long host = get_guest_va_host_addr(va + done);
+		if (!host) {
+			if (done == 0) {
+				return -1;
+			}
+			break;
+		}
+		int chunk = MIN(len - done, PAGE_SIZE - ((va + done) & (PAGE_SIZE - 1)));
+		int n = dequeue_fifo_n(tsk->console.in_fifo, (char *)host, chunk);
+		sync_guest_memory((void *)host, n);
+		done += n;
+		if (n < chunk) {
+			break;
+		}
+	}
+	if (done > 0) {
+		notify_vm_console(tsk);
+	}
+	return done;
+}
+
+// ゲストが送信 FIFO のクリアを要求したときに呼ぶ
+// out_fifo の読み出し側として振る舞うので out_lock を取る
+void clear_vm_console_out(struct vm_struct *tsk) {
+	acquire_lock(&tsk->console.out_lock);
+	clear_fifo(tsk->console.out_fifo);
+	release_lock(&tsk->console.out_lock);
+	notify_vm_console(tsk);
 }